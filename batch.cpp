@@ -0,0 +1,319 @@
+#include "batch.h"
+#include "hls.h"
+#include "http_engine.h"
+#include "json.h"
+#include "logger.h"
+#include "parser.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+using Clock = std::chrono::steady_clock;
+
+static double seconds_since(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Hands out jobs to workers: argv URLs first, then lines read lazily from the input stream,
+// so a long list piped through stdin starts downloading before it has been fully read.
+class JobSource {
+public:
+    JobSource(const std::vector<std::string>& urls, std::istream* input, const PinOptions& defaults)
+        : urls_(urls), input_(input), defaults_(defaults) {}
+
+    bool next(BatchJob& job) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (next_url_ < urls_.size()) {
+            job.url = urls_[next_url_++];
+            job.options = defaults_;
+            return true;
+        }
+        std::string line, error;
+        while (input_ && std::getline(*input_, line)) {
+            ++line_no_;
+            if (parse_job_line(line, defaults_, job, error)) return true;
+            if (!error.empty()) log_error("Skipping input line " + std::to_string(line_no_) + ": " + error);
+        }
+        return false;
+    }
+
+private:
+    std::mutex mtx_;
+    const std::vector<std::string>& urls_;
+    size_t next_url_ = 0;
+    std::istream* input_;
+    long line_no_ = 0;
+    PinOptions defaults_;
+};
+
+bool parse_job_line(std::string line, const PinOptions& defaults, BatchJob& job, std::string& error) {
+    error.clear();
+    while (!line.empty() && (line.back() == '\r' || line.back() == ' ' || line.back() == '\t')) line.pop_back();
+    size_t start = line.find_first_not_of(" \t");
+    if (start == std::string::npos || line[start] == '#') return false;
+    line = line.substr(start);
+
+    job.id.clear();
+    job.options = defaults;
+    if (line[0] != '{') {
+        job.url = line;
+        return true;
+    }
+
+    std::map<std::string, std::string> fields;
+    if (!json_parse_object(line, fields)) {
+        error = "malformed JSON.";
+        return false;
+    }
+    if (fields["url"].empty()) {
+        error = "no \"url\".";
+        return false;
+    }
+    job.id = fields["id"];
+    job.url = fields["url"];
+    if (fields.count("output")) job.options.output = fields["output"];
+    if (fields.count("dir")) job.options.directory = fields["dir"];
+    if (fields.count("thumbnail")) job.options.thumbnail = (fields["thumbnail"] == "true");
+    if (std::atoi(fields["segments"].c_str()) > 0) job.options.download.segments = std::atoi(fields["segments"].c_str());
+    if (fields.count("quality") && !parse_quality(fields["quality"], job.options.quality)) {
+        error = "invalid \"quality\": " + fields["quality"] + ".";
+        return false;
+    }
+    return true;
+}
+
+std::string result_json(const PinResult& r) {
+    char timings[200];
+    snprintf(timings, sizeof(timings),
+             "\"resolve_s\":%.3f,\"thumbnail_s\":%.3f,\"video_s\":%.3f,\"download_s\":%.3f,\"total_s\":%.3f",
+             r.resolve_s, r.thumbnail_s, r.video_s, r.download_s, r.total_s);
+
+    std::string line = "{\"url\":\"" + json_escape(r.url) + "\",\"status\":\"" + (r.ok ? "ok" : "error") + "\"";
+    if (!r.error.empty()) line += ",\"error\":\"" + json_escape(r.error) + "\"";
+    if (!r.video_path.empty()) line += ",\"output\":\"" + json_escape(r.video_path) + "\"";
+    if (!r.thumbnail_path.empty()) line += ",\"thumbnail\":\"" + json_escape(r.thumbnail_path) + "\"";
+    if (!r.thumbnail_error.empty()) line += ",\"thumbnail_error\":\"" + json_escape(r.thumbnail_error) + "\"";
+    line += ",\"bytes\":" + std::to_string(r.bytes) + "," + timings;
+    if (!r.phases.empty()) line += ",\"phases\":" + r.phases;
+    return line + "}";
+}
+
+void write_result_line(const PinResult& r) {
+    std::string line = result_json(r) + "\n";
+    // Result lines are always written, even with --clear, so they can be consumed as JSONL.
+    log_output(std::move(line));
+}
+
+// Runs the whole batch on one thread: every pin is a chain of HttpEngine callbacks
+// (page -> sanitized page -> thumbnail and video), with up to `workers` pins in flight.
+class AsyncBatch {
+public:
+    AsyncBatch(JobSource& source, const BatchOptions& options) : source_(source), options_(options) {}
+
+    int run() {
+        // The engine resolves hosts on its own thread; have the media CDN addresses cached
+        // by the time the first pages are parsed.
+        prefetch_media_hosts(true, false);
+        fill();
+        engine_.run();
+        log_debug("[batch] Finished " + std::to_string(done_) + " pins, " + std::to_string(failed_) + " failed.");
+        return failed_;
+    }
+
+private:
+    struct Pin {
+        PinOptions options;
+        PinResult result;
+        Clock::time_point start;
+        Clock::time_point download_start;
+        std::string final_url;
+        PageScanner scanner;
+        bool from_cache = false;
+        int pending = 0;
+    };
+
+    void fill() {
+        BatchJob job;
+        while (in_flight_ < options_.workers && source_.next(job)) {
+            ++in_flight_;
+            auto pin = std::make_shared<Pin>();
+            pin->options = job.options;
+            pin->result.url = job.url;
+            pin->start = Clock::now();
+            log_normal("[pinterest] " + job.url + ": Resolving URL");
+
+            // The engine downloads one file per pin, so it uses the entries resolved without HLS.
+            PinCacheEntry cached;
+            if (pin_cache_lookup(job.url, pin_cache_options(pin->options, false), cached) &&
+                (!pin->options.thumbnail || !cached.thumbnail_url.empty()) && !is_hls_url(cached.video_url)) {
+                log_debug("[cache] Hit: " + job.url + " -> " + cached.final_url);
+                pin->from_cache = true;
+                pin->final_url = cached.final_url;
+                start_downloads(pin, cached.video_url, pin->options.thumbnail ? cached.thumbnail_url : "");
+                continue;
+            }
+            fetch_page(pin, job.url, false);
+        }
+    }
+
+    void fetch_page(std::shared_ptr<Pin> pin, const std::string& url, bool sanitized) {
+        pin->scanner = PageScanner(pin->options.thumbnail, pin->options.quality.kind != QualityPolicy::DEFAULT);
+        AsyncRequest req;
+        req.url = url;
+        req.timeout_ms = options_.timeout_ms;
+        req.on_data = [pin](const char* data, size_t len) {
+            pin->scanner.feed(data, len);
+            return !pin->scanner.complete();
+        };
+        req.on_complete = [this, pin, sanitized](const AsyncResponse& res) {
+            if (!sanitized) {
+                pin->final_url = res.final_url;
+                std::string clean_url = sanitize_pinterest_url(res.final_url);
+                if (clean_url != res.final_url) {
+                    log_debug("[pinterest] URL contains extra parameters. Sanitizing to: " + clean_url);
+                    pin->final_url = clean_url;
+                    return fetch_page(pin, clean_url, true);
+                }
+            }
+            if (!res.ok || pin->scanner.size() == 0) {
+                return fail(pin, "Failed to fetch HTML content from the final URL.");
+            }
+            MediaFields fields = pin->scanner.fields();
+            PinCacheEntry entry;
+            entry.final_url = pin->final_url;
+            entry.video_url = select_video_url(pin->scanner.variants(), std::string(fields.video_url), pin->options, false);
+            entry.thumbnail_url = std::string(fields.thumbnail_url);
+            if (!entry.video_url.empty()) pin_cache_store(pin->result.url, entry, pin_cache_options(pin->options, false));
+            start_downloads(pin, entry.video_url, entry.thumbnail_url);
+        };
+        engine_.submit(std::move(req));
+    }
+
+    void start_downloads(std::shared_ptr<Pin> pin, const std::string& media_url, const std::string& thumbnail_url) {
+        pin->result.resolve_s = seconds_since(pin->start);
+
+        if (media_url.empty()) return fail(pin, "Could not find media URL on the page.");
+        if (pin->options.thumbnail && thumbnail_url.empty()) {
+            pin->result.thumbnail_error = "Could not find thumbnail URL on the page.";
+            log_error(pin->result.thumbnail_error);
+        }
+
+        std::string video_path = pin_video_filename(pin->final_url, pin->options);
+        std::string thumb_path = pin_thumbnail_filename(pin->final_url, pin->options);
+        pin->pending = thumbnail_url.empty() ? 1 : 2;
+        pin->download_start = Clock::now();
+
+        if (!thumbnail_url.empty()) {
+            download(thumbnail_url, thumb_path, [this, pin, thumb_path](const AsyncResponse& res) {
+                if (res.ok) {
+                    log_normal("[pinoader] Thumbnail saved: " + thumb_path);
+                    pin->result.thumbnail_path = thumb_path;
+                    pin->result.bytes += res.bytes;
+                } else {
+                    pin->result.thumbnail_error = "Failed to download the thumbnail.";
+                    log_error(pin->result.thumbnail_error);
+                }
+                pin->result.thumbnail_s = seconds_since(pin->download_start);
+                if (--pin->pending == 0) finish(pin);
+            });
+        }
+
+        log_normal("[downloader] Media URL: " + media_url);
+        download(media_url, video_path, [this, pin, video_path](const AsyncResponse& res) {
+            if (res.ok) {
+                log_normal("[pinoader] File saved: " + video_path);
+                pin->result.ok = true;
+                pin->result.video_path = video_path;
+                pin->result.bytes += res.bytes;
+            } else {
+                pin->result.error = "Failed to download the file.";
+                log_error(pin->result.error);
+            }
+            pin->result.video_s = seconds_since(pin->download_start);
+            if (--pin->pending == 0) finish(pin);
+        });
+    }
+
+    void download(const std::string& url, const std::string& path,
+                  std::function<void(const AsyncResponse&)> done) {
+        log_normal("[downloader] Destination: " + path);
+        AsyncRequest req;
+        req.url = url;
+        req.output_path = path;
+        req.timeout_ms = options_.timeout_ms;
+        req.on_complete = std::move(done);
+        engine_.submit(std::move(req));
+    }
+
+    void fail(std::shared_ptr<Pin> pin, const std::string& error) {
+        pin->result.error = error;
+        log_error(error);
+        finish(pin);
+    }
+
+    void finish(std::shared_ptr<Pin> pin) {
+        if (!pin->result.ok && pin->from_cache) {
+            // The cached media URL may have gone stale.
+            log_normal("[cache] Download from the cached media URL failed. Resolving the pin again.");
+            std::string url = pin->result.url;
+            pin->from_cache = false;
+            pin->options.cache.read = false;
+            pin->result = PinResult();
+            pin->result.url = url;
+            pin->download_start = Clock::time_point();
+            return fetch_page(pin, url, false);
+        }
+
+        PinResult& r = pin->result;
+        if (pin->download_start == Clock::time_point()) r.resolve_s = seconds_since(pin->start);
+        else r.download_s = seconds_since(pin->download_start);
+        r.total_s = seconds_since(pin->start);
+        if (!r.ok) ++failed_;
+        ++done_;
+        write_result_line(r);
+        --in_flight_;
+        fill();
+    }
+
+    JobSource& source_;
+    const BatchOptions& options_;
+    HttpEngine engine_;
+    int in_flight_ = 0;
+    int failed_ = 0;
+    int done_ = 0;
+};
+
+int run_batch(const std::vector<std::string>& urls, std::istream* input, const BatchOptions& options) {
+    JobSource source(urls, input, options.defaults);
+
+    if (options.async) {
+        log_debug("[batch] Running up to " + std::to_string(options.workers) + " pins concurrently on the event loop.");
+        return AsyncBatch(source, options).run();
+    }
+
+    std::atomic<int> failed{0};
+    std::atomic<int> done{0};
+
+    auto worker = [&]() {
+        BatchJob job;
+        while (source.next(job)) {
+            PinResult result = process_pin(job.url, job.options);
+            if (!result.ok) ++failed;
+            ++done;
+            write_result_line(result);
+        }
+    };
+
+    int n = options.workers > 0 ? options.workers : 1;
+    log_debug("[batch] Starting " + std::to_string(n) + " workers.");
+    std::vector<std::thread> threads;
+    for (int i = 0; i < n; ++i) threads.emplace_back(worker);
+    for (auto& t : threads) t.join();
+
+    log_debug("[batch] Finished " + std::to_string(done.load()) + " pins, " + std::to_string(failed.load()) + " failed.");
+    return failed.load();
+}
@@ -0,0 +1,40 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <string>
+#include <vector>
+#include <istream>
+#include "pinterest.h"
+
+struct BatchJob {
+    std::string id;  // Optional "id" of a JSON job, echoed by the daemon (--serve)
+    std::string url;
+    PinOptions options;
+};
+
+struct BatchOptions {
+    int workers = 4;          // Worker threads, or pins in flight when `async` is set
+    bool async = false;       // Drive all pins from one thread through the epoll engine
+    int timeout_ms = 30000;   // Per-request deadline in async mode
+    PinOptions defaults;
+};
+
+// Downloads every pin from `urls` followed by every job read from `input` (may be null).
+// Input lines are either a bare URL or a JSON object:
+// {"url": "...", "output": "...", "dir": "...", "thumbnail": true, "segments": 4, "quality": "720p"}.
+// Blank lines and lines starting with '#' are ignored.
+// A JSON result line is written to stdout as each pin finishes.
+// Returns the number of failed pins.
+int run_batch(const std::vector<std::string>& urls, std::istream* input, const BatchOptions& options);
+
+// Parses one input line into `job`, starting from `defaults`. False for blank and comment
+// lines, and for malformed ones, which also set `error`.
+bool parse_job_line(std::string line, const PinOptions& defaults, BatchJob& job, std::string& error);
+
+// The JSON result object of one pin, without a trailing newline.
+std::string result_json(const PinResult& r);
+
+// Writes the JSON result line of one pin to stdout, even with --clear.
+void write_result_line(const PinResult& r);
+
+#endif
@@ -0,0 +1,200 @@
+// Loopback benchmarks for the HTTP client: starts BenchServer in-process, runs each
+// scenario through the public API and prints one JSON line per scenario on stdout
+// (a readable table goes to stderr), so runs can be diffed or compared by a script.
+// BenchServer speaks HTTP/1.1 only: the HTTP/2 paths (multiplexed streams, HPACK, flow
+// control) are not measured here.
+
+#include "bench_server.h"
+#include "http_client.h"
+#include "logger.h"
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+struct Scenario {
+    std::string name;
+    int ops;
+    int threads;
+    // Runs operation `i` and returns the bytes it transferred, or -1 on failure.
+    std::function<long long(int i)> run;
+};
+
+struct Result {
+    int ok = 0, failed = 0;
+    double seconds = 0;
+    std::vector<double> latencies_ms;
+    long long bytes = 0;
+};
+
+static double percentile(std::vector<double> v, double p) {
+    if (v.empty()) return 0;
+    std::sort(v.begin(), v.end());
+    size_t i = (size_t)std::min<double>(v.size() - 1, p / 100.0 * v.size());
+    return v[i];
+}
+
+static Result run_scenario(const Scenario& s) {
+    Result r;
+    std::vector<std::vector<double>> latencies(s.threads);
+    std::vector<long long> bytes(s.threads, 0);
+    std::vector<int> failed(s.threads, 0);
+    auto start = Clock::now();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < s.threads; ++t) {
+        threads.emplace_back([&, t] {
+            for (int i = t; i < s.ops; i += s.threads) {
+                auto op_start = Clock::now();
+                long long n = s.run(i);
+                latencies[t].push_back(std::chrono::duration<double, std::milli>(Clock::now() - op_start).count());
+                if (n < 0) ++failed[t];
+                else bytes[t] += n;
+            }
+        });
+    }
+    for (auto& th : threads) th.join();
+    r.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    for (int t = 0; t < s.threads; ++t) {
+        r.latencies_ms.insert(r.latencies_ms.end(), latencies[t].begin(), latencies[t].end());
+        r.bytes += bytes[t];
+        r.failed += failed[t];
+    }
+    r.ok = s.ops - r.failed;
+    return r;
+}
+
+static long long file_size(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? (long long)st.st_size : -1;
+}
+
+static void usage(const char* program) {
+    fprintf(stderr,
+            "Usage: %s [--fixtures <dir>] [--quick] [--only <scenario>]\n"
+            "  --fixtures <dir>  Pin page fixtures (default: bench/fixtures)\n"
+            "  --quick           Fewer iterations, for a smoke test\n"
+            "  --only <name>     Run a single scenario\n",
+            program);
+}
+
+int main(int argc, char* argv[]) {
+    g_log_level = LogLevel::SILENT;
+    std::string fixtures = "bench/fixtures";
+    std::string only;
+    bool quick = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--fixtures" && i + 1 < argc) fixtures = argv[++i];
+        else if (arg == "--only" && i + 1 < argc) only = argv[++i];
+        else if (arg == "--quick") quick = true;
+        else {
+            usage(argv[0]);
+            return arg == "-h" || arg == "--help" ? 0 : 1;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    // Every run starts cold: no sessions, addresses or stored media from earlier runs or the user's cache.
+    set_network_cache_enabled(false);
+    set_media_store_enabled(false);
+
+    const long long media_size = 32LL << 20;
+    const long long small_media = 256 << 10;
+    // About 300 KB of page, with the media URLs near the end like on pinterest.com.
+    BenchServer server(fixtures, 200, media_size);
+    if (!server.start()) {
+        fprintf(stderr, "Could not start the benchmark server (fixtures in %s?)\n", fixtures.c_str());
+        return 1;
+    }
+    std::string https = "https://127.0.0.1:" + std::to_string(server.https_port());
+    std::string http = "http://127.0.0.1:" + std::to_string(server.http_port());
+
+    char dir_template[] = "/tmp/pinoader-bench-XXXXXX";
+    if (!mkdtemp(dir_template)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string dir = dir_template;
+
+    int scale = quick ? 10 : 1;
+    auto fetch = [](const std::string& url) -> long long {
+        std::string final_url;
+        std::string body = fetch_url(url, final_url);
+        return body.empty() ? -1 : (long long)body.size();
+    };
+    auto download = [&](const std::string& url, int segments, int i) -> long long {
+        std::string path = dir + "/media" + std::to_string(i);
+        DownloadOptions options;
+        options.segments = segments;
+        bool ok = download_file(url, path, options);
+        long long size = ok ? file_size(path) : -1;
+        unlink(path.c_str());
+        return size;
+    };
+
+    std::vector<Scenario> scenarios = {
+        {"fetch_page_https", 200 / scale, 1, [&](int i) { return fetch(https + "/pin/" + std::to_string(i) + "/"); }},
+        {"fetch_page_chunked_https", 200 / scale, 1,
+         [&](int i) { return fetch(https + "/chunked/pin/" + std::to_string(i) + "/"); }},
+        {"fetch_page_http", 200 / scale, 1, [&](int i) { return fetch(http + "/pin/" + std::to_string(i) + "/"); }},
+        {"fetch_redirect_chain_https", 100 / scale, 1,
+         [&](int i) { return fetch(https + "/redirect/3/" + std::to_string(i)); }},
+        {"fetch_page_https_8_threads", 400 / scale, 8,
+         [&](int i) { return fetch(https + "/pin/" + std::to_string(i) + "/"); }},
+        {"download_small_media", 100 / scale, 1,
+         [&](int i) { return download(https + "/media/" + std::to_string(small_media) + "/s.mp4", 1, i); }},
+        {"download_large_media", 10 / scale, 1,
+         [&](int i) { return download(https + "/media/" + std::to_string(media_size) + "/l.mp4", 1, i); }},
+        {"download_large_media_4_segments", 10 / scale, 1,
+         [&](int i) { return download(https + "/media/" + std::to_string(media_size) + "/l.mp4", 4, i); }},
+    };
+
+    fprintf(stderr, "HTTP/1.1 only: the benchmark server offers no ALPN, so HTTP/2 is not measured.\n");
+    fprintf(stderr, "%-34s %7s %9s %9s %9s %9s %6s %6s %7s\n", "scenario", "ops", "req/s", "p50 ms", "p99 ms",
+            "MB/s", "conns", "full", "reuse");
+    int failures = 0;
+    for (const auto& s : scenarios) {
+        if (!only.empty() && s.name != only) continue;
+        long long conns = server.counters.connections, full = server.counters.full_handshakes;
+        long long resumed = server.counters.resumed_handshakes, requests = server.counters.requests;
+        long long sent = server.counters.bytes_sent;
+
+        Result r = run_scenario(s);
+
+        conns = server.counters.connections - conns;
+        full = server.counters.full_handshakes - full;
+        resumed = server.counters.resumed_handshakes - resumed;
+        requests = server.counters.requests - requests;
+        sent = server.counters.bytes_sent - sent;
+        double reuse = requests > 0 ? 1.0 - (double)conns / requests : 0;
+        double rps = r.seconds > 0 ? s.ops / r.seconds : 0;
+        double mbps = r.seconds > 0 ? r.bytes / r.seconds / (1 << 20) : 0;
+        double p50 = percentile(r.latencies_ms, 50), p99 = percentile(r.latencies_ms, 99);
+        failures += r.failed;
+
+        printf("{\"scenario\":\"%s\",\"ops\":%d,\"failed\":%d,\"threads\":%d,\"seconds\":%.4f,\"requests_per_s\":%.1f,"
+               "\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"mb_per_s\":%.1f,\"bytes\":%lld,\"server_requests\":%lld,"
+               "\"server_bytes_sent\":%lld,\"connections\":%lld,\"full_handshakes\":%lld,\"resumed_handshakes\":%lld,"
+               "\"reuse_rate\":%.3f}\n",
+               s.name.c_str(), s.ops, r.failed, s.threads, r.seconds, rps, p50, p99, mbps, r.bytes, requests, sent,
+               conns, full, resumed, reuse);
+        fflush(stdout);
+        fprintf(stderr, "%-34s %7d %9.1f %9.3f %9.3f %9.1f %6lld %6lld %6.1f%%\n", s.name.c_str(), s.ops, rps, p50, p99,
+                mbps, conns, full, reuse * 100);
+    }
+
+    server.stop();
+    rmdir(dir.c_str());
+    if (failures) fprintf(stderr, "%d operations failed.\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,302 @@
+#include "bench_server.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+static bool read_file(const std::string& path, std::string& out) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return false;
+    std::ostringstream ss;
+    ss << in.rdbuf();
+    out = ss.str();
+    while (!out.empty() && (out.back() == '\n' || out.back() == '\r')) out.pop_back();
+    return true;
+}
+
+static void replace_all(std::string& s, const std::string& from, const std::string& to) {
+    for (size_t pos = s.find(from); pos != std::string::npos; pos = s.find(from, pos + to.size())) {
+        s.replace(pos, from.size(), to);
+    }
+}
+
+static std::string lower(std::string s) {
+    for (auto& c : s) c = (char)std::tolower((unsigned char)c);
+    return s;
+}
+
+// Self-signed P-256 certificate for 127.0.0.1, valid for a day.
+static bool use_generated_certificate(SSL_CTX* ctx) {
+    EVP_PKEY* key = EVP_EC_gen("P-256");
+    X509* cert = X509_new();
+    if (!key || !cert) {
+        EVP_PKEY_free(key);
+        X509_free(cert);
+        return false;
+    }
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 86400);
+    X509_set_pubkey(cert, key);
+    X509_NAME* name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char*)"127.0.0.1", -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+    bool ok = X509_sign(cert, key, EVP_sha256()) > 0 && SSL_CTX_use_certificate(ctx, cert) == 1 &&
+              SSL_CTX_use_PrivateKey(ctx, key) == 1;
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    return ok;
+}
+
+static int listen_loopback(int& port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(fd, (sockaddr*)&addr, len) < 0 || listen(fd, 1024) < 0 || getsockname(fd, (sockaddr*)&addr, &len) < 0) {
+        close(fd);
+        return -1;
+    }
+    port = ntohs(addr.sin_port);
+    return fd;
+}
+
+BenchServer::BenchServer(const std::string& fixture_dir, int related_pins, long long media_size)
+    : fixture_dir_(fixture_dir), related_pins_(related_pins), media_size_(media_size) {}
+
+BenchServer::~BenchServer() {
+    stop();
+    if (ssl_ctx_) SSL_CTX_free(ssl_ctx_);
+}
+
+bool BenchServer::start() {
+    std::string page, related;
+    if (!read_file(fixture_dir_ + "/pin_page.html", page) || !read_file(fixture_dir_ + "/related_pin.json", related)) {
+        return false;
+    }
+
+    ssl_ctx_ = SSL_CTX_new(TLS_server_method());
+    if (!ssl_ctx_ || !use_generated_certificate(ssl_ctx_)) return false;
+
+    https_fd_ = listen_loopback(https_port_);
+    http_fd_ = listen_loopback(http_port_);
+    if (https_fd_ < 0 || http_fd_ < 0) return false;
+
+    // Everything but the pin ID is fixed, so the page is expanded once.
+    std::string items;
+    for (int i = 0; i < related_pins_; ++i) {
+        std::string item = related;
+        replace_all(item, "{{RID}}", std::to_string(5200000000LL + i));
+        items += (i ? "," : "") + item;
+    }
+    replace_all(page, "{{RELATED}}", items);
+    replace_all(page, "{{MEDIA}}", "https://127.0.0.1:" + std::to_string(https_port_));
+    replace_all(page, "{{SIZE}}", std::to_string(media_size_));
+    size_t from = 0;
+    for (size_t pos; (pos = page.find("{{ID}}", from)) != std::string::npos; from = pos + 6) {
+        page_parts_.push_back(page.substr(from, pos - from));
+    }
+    page_parts_.push_back(page.substr(from));
+
+    std::mt19937_64 rng(42);
+    media_block_.resize(1 << 20);
+    for (auto& c : media_block_) c = (char)rng();
+
+    https_thread_ = std::thread(&BenchServer::accept_loop, this, https_fd_, true);
+    http_thread_ = std::thread(&BenchServer::accept_loop, this, http_fd_, false);
+    return true;
+}
+
+void BenchServer::stop() {
+    if (stopping_.exchange(true)) return;
+    for (int fd : {https_fd_, http_fd_}) {
+        if (fd >= 0) shutdown(fd, SHUT_RDWR);
+    }
+    if (https_thread_.joinable()) https_thread_.join();
+    if (http_thread_.joinable()) http_thread_.join();
+    for (int fd : {https_fd_, http_fd_}) {
+        if (fd >= 0) close(fd);
+    }
+
+    std::unique_lock<std::mutex> lock(mtx_);
+    for (int fd : open_fds_) shutdown(fd, SHUT_RDWR);
+    idle_cv_.wait(lock, [&] { return active_ == 0; });
+}
+
+void BenchServer::accept_loop(int listen_fd, bool tls) {
+    while (!stopping_) {
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;
+        }
+        std::lock_guard<std::mutex> lock(mtx_);
+        open_fds_.insert(fd);
+        ++active_;
+        std::thread(&BenchServer::serve, this, fd, tls).detach();
+    }
+}
+
+std::string BenchServer::page(const std::string& id) const {
+    std::string out = page_parts_[0];
+    for (size_t i = 1; i < page_parts_.size(); ++i) out += id + page_parts_[i];
+    return out;
+}
+
+void BenchServer::serve(int fd, bool tls) {
+    ++counters.connections;
+    timeval tv = {10, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    // Headers and body are separate writes; don't let Nagle's algorithm show up in the latencies.
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    SSL* ssl = nullptr;
+    bool ok = true;
+    if (tls) {
+        ssl = SSL_new(ssl_ctx_);
+        SSL_set_fd(ssl, fd);
+        ok = SSL_accept(ssl) == 1;
+        if (ok) ++(SSL_session_reused(ssl) ? counters.resumed_handshakes : counters.full_handshakes);
+    }
+
+    auto receive = [&](char* buf, int n) { return ssl ? SSL_read(ssl, buf, n) : (int)recv(fd, buf, n, 0); };
+    auto send_all = [&](const char* data, size_t len) {
+        while (len > 0) {
+            int n = ssl ? SSL_write(ssl, data, (int)std::min<size_t>(len, 1 << 20))
+                        : (int)send(fd, data, len, MSG_NOSIGNAL);
+            if (n <= 0) return false;
+            counters.bytes_sent += n;
+            data += n;
+            len -= n;
+        }
+        return true;
+    };
+    auto send_media = [&](long long first, long long count) {
+        while (count > 0) {
+            size_t offset = (size_t)(first % (long long)media_block_.size());
+            size_t n = (size_t)std::min<long long>(count, (long long)(media_block_.size() - offset));
+            if (!send_all(media_block_.data() + offset, n)) return false;
+            first += n;
+            count -= n;
+        }
+        return true;
+    };
+
+    std::string in;
+    char buf[16384];
+    while (ok && !stopping_) {
+        size_t end;
+        while ((end = in.find("\r\n\r\n")) == std::string::npos) {
+            int n = receive(buf, sizeof(buf));
+            if (n <= 0) break;
+            in.append(buf, n);
+        }
+        if (end == std::string::npos) break;
+
+        std::istringstream head(in.substr(0, end));
+        in.erase(0, end + 4);
+        std::string method, path, version, line, range;
+        head >> method >> path >> version;
+        bool keep_alive = true;
+        std::getline(head, line);
+        while (std::getline(head, line)) {
+            size_t colon = line.find(':');
+            if (colon == std::string::npos) continue;
+            std::string name = lower(line.substr(0, colon));
+            std::string value = line.substr(colon + 1);
+            value.erase(0, value.find_first_not_of(' '));
+            if (!value.empty() && value.back() == '\r') value.pop_back();
+            if (name == "range") range = value;
+            if (name == "connection" && lower(value) == "close") keep_alive = false;
+        }
+        ++counters.requests;
+
+        std::string headers = keep_alive ? "" : "Connection: close\r\n";
+        bool head_only = method == "HEAD";
+        std::vector<std::string> parts;
+        std::istringstream segments(path);
+        for (std::string part; std::getline(segments, part, '/');) {
+            if (!part.empty()) parts.push_back(part);
+        }
+
+        if (parts.size() >= 2 && parts[0] == "pin") {
+            std::string body = page(parts[1]);
+            std::string response = "HTTP/1.1 200 OK\r\nContent-Type: text/html; charset=utf-8\r\nContent-Length: " +
+                                   std::to_string(body.size()) + "\r\n" + headers + "\r\n";
+            ok = send_all(response.data(), response.size()) && (head_only || send_all(body.data(), body.size()));
+        } else if (parts.size() >= 3 && parts[0] == "chunked" && parts[1] == "pin") {
+            std::string body = page(parts[2]);
+            std::string response = "HTTP/1.1 200 OK\r\nContent-Type: text/html; charset=utf-8\r\n"
+                                   "Transfer-Encoding: chunked\r\n" + headers + "\r\n";
+            ok = send_all(response.data(), response.size());
+            for (size_t pos = 0; ok && !head_only && pos < body.size(); pos += 8192) {
+                size_t n = std::min<size_t>(8192, body.size() - pos);
+                char size_line[32];
+                snprintf(size_line, sizeof(size_line), "%zx\r\n", n);
+                ok = send_all(size_line, strlen(size_line)) && send_all(body.data() + pos, n) && send_all("\r\n", 2);
+            }
+            if (ok && !head_only) ok = send_all("0\r\n\r\n", 5);
+        } else if (parts.size() >= 3 && parts[0] == "redirect") {
+            int left = std::atoi(parts[1].c_str());
+            // Relative locations, so the client has to keep the port.
+            std::string location = left > 0 ? "/redirect/" + std::to_string(left - 1) + "/" + parts[2]
+                                             : "/pin/" + parts[2] + "/";
+            std::string response = "HTTP/1.1 302 Found\r\nLocation: " + location + "\r\nContent-Length: 0\r\n" + headers + "\r\n";
+            ok = send_all(response.data(), response.size());
+        } else if (parts.size() >= 2 && parts[0] == "media") {
+            long long size = std::atoll(parts[1].c_str());
+            long long first = 0, last = size - 1;
+            bool partial = false;
+            if (!range.empty() && sscanf(range.c_str(), "bytes=%lld-%lld", &first, &last) >= 1) {
+                partial = true;
+                if (last >= size || range.back() == '-') last = size - 1;
+            }
+            if (partial && (first > last || first >= size)) {
+                std::string response = "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */" +
+                                       std::to_string(size) + "\r\nContent-Length: 0\r\n" + headers + "\r\n";
+                ok = send_all(response.data(), response.size());
+            } else {
+                long long count = last - first + 1;
+                std::string response = std::string(partial ? "HTTP/1.1 206 Partial Content" : "HTTP/1.1 200 OK") +
+                                       "\r\nContent-Type: video/mp4\r\nAccept-Ranges: bytes\r\nETag: \"bench\"\r\n"
+                                       "Content-Length: " + std::to_string(count) + "\r\n";
+                if (partial) {
+                    response += "Content-Range: bytes " + std::to_string(first) + "-" + std::to_string(last) + "/" +
+                                std::to_string(size) + "\r\n";
+                }
+                response += headers + "\r\n";
+                ok = send_all(response.data(), response.size()) && (head_only || send_media(first, count));
+            }
+        } else {
+            std::string response = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n" + headers + "\r\n";
+            ok = send_all(response.data(), response.size());
+        }
+        if (!keep_alive) break;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        open_fds_.erase(fd);
+    }
+    if (ssl) {
+        SSL_shutdown(ssl);
+        SSL_free(ssl);
+    }
+    close(fd);
+    std::lock_guard<std::mutex> lock(mtx_);
+    --active_;
+    idle_cv_.notify_all();
+}
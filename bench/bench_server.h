@@ -0,0 +1,69 @@
+#ifndef BENCH_SERVER_H
+#define BENCH_SERVER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include <openssl/ssl.h>
+
+// What the server saw, so the benchmarks can report handshakes and connection reuse.
+struct ServerCounters {
+    std::atomic<long long> connections{0};
+    std::atomic<long long> full_handshakes{0};
+    std::atomic<long long> resumed_handshakes{0};
+    std::atomic<long long> requests{0};
+    std::atomic<long long> bytes_sent{0};
+};
+
+// Loopback HTTP/1.1 server for the benchmarks: one HTTPS port with a self-signed
+// certificate generated at startup, one plain HTTP port, a thread per connection and
+// keep-alive. It offers no ALPN, so clients stay on HTTP/1.1.
+//
+//   /pin/<id>/               Pin page built from the fixtures, with Content-Length
+//   /chunked/pin/<id>/       The same page, chunked
+//   /redirect/<n>/<id>       <n> redirects, then /pin/<id>/
+//   /media/<bytes>/<name>    <bytes> of binary data; HEAD and Range are supported
+//
+// Media URLs in the pages point back at the HTTPS port, sized `media_size`.
+class BenchServer {
+public:
+    BenchServer(const std::string& fixture_dir, int related_pins, long long media_size);
+    ~BenchServer();
+
+    // Loads the fixtures and starts listening on ephemeral ports. False on failure.
+    bool start();
+    void stop();
+
+    int https_port() const { return https_port_; }
+    int http_port() const { return http_port_; }
+
+    ServerCounters counters;
+
+private:
+    void accept_loop(int listen_fd, bool tls);
+    void serve(int fd, bool tls);
+    std::string page(const std::string& id) const;
+
+    std::string fixture_dir_;
+    int related_pins_;
+    long long media_size_;
+    std::vector<std::string> page_parts_;  // The expanded page, split where the pin ID goes
+    std::string media_block_;              // Random bytes served cyclically as media
+
+    SSL_CTX* ssl_ctx_ = nullptr;
+    int https_fd_ = -1, http_fd_ = -1;
+    int https_port_ = 0, http_port_ = 0;
+    std::thread https_thread_, http_thread_;
+
+    std::atomic<bool> stopping_{false};
+    std::mutex mtx_;
+    std::condition_variable idle_cv_;
+    std::set<int> open_fds_;
+    int active_ = 0;  // Connection threads still running
+};
+
+#endif
@@ -0,0 +1,182 @@
+// Micro-benchmark for parser.cpp over a directory of saved pin pages. Every page is first
+// checked against the original parser (reference_parser.cpp): the results must be byte
+// for byte the same, on the whole page and on truncated copies of it. Then each parser
+// runs the page repeatedly and one JSON line per page and parser goes to stdout (a
+// readable table to stderr), with ns/page, GB/s and heap allocations per call.
+
+#include "parser.h"
+#include "reference_parser.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <dirent.h>
+#include <fstream>
+#include <functional>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Every allocation in the process goes through here, so a parser call can be measured by
+// reading the counter before and after it.
+static std::atomic<long long> g_allocations{0};
+
+void* operator new(size_t size) {
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+using Clock = std::chrono::steady_clock;
+
+// Results of the timed calls end up here, so the optimizer cannot drop them.
+static volatile size_t g_sink;
+
+struct Page {
+    std::string name;
+    std::string html;
+};
+
+struct Parser {
+    std::string name;
+    // Runs the parser on the page and returns the total length of what it found.
+    std::function<size_t(const std::string&)> run;
+};
+
+static std::vector<Page> load_corpus(const std::string& dir) {
+    std::vector<Page> pages;
+    DIR* d = opendir(dir.c_str());
+    if (!d) return pages;
+    while (dirent* e = readdir(d)) {
+        std::string name = e->d_name;
+        if (name.size() < 5 || name.compare(name.size() - 5, 5, ".html") != 0) continue;
+        std::ifstream in(dir + "/" + name, std::ios::binary);
+        std::ostringstream ss;
+        ss << in.rdbuf();
+        pages.push_back({name, ss.str()});
+    }
+    closedir(d);
+    std::sort(pages.begin(), pages.end(), [](const Page& a, const Page& b) { return a.name < b.name; });
+    return pages;
+}
+
+// Compares the current parser with the reference on `html`. Prints the first difference.
+static bool same_results(const std::string& name, const std::string& html) {
+    std::string video = find_video_url(html), ref_video = reference_find_video_url(html);
+    std::string thumb = find_thumbnail_url(html), ref_thumb = reference_find_thumbnail_url(html);
+    MediaFields fields = find_media_fields(html);
+
+    const char* what = nullptr;
+    if (video != ref_video) what = "find_video_url";
+    else if (thumb != ref_thumb) what = "find_thumbnail_url";
+    else if (fields.video_url != ref_video) what = "find_media_fields video";
+    else if (fields.thumbnail_url != ref_thumb) what = "find_media_fields thumbnail";
+    if (!what) return true;
+
+    fprintf(stderr, "MISMATCH %s (%zu bytes): %s\n  video:     \"%s\"\n  reference: \"%s\"\n  thumbnail: \"%s\"\n"
+            "  reference: \"%s\"\n",
+            name.c_str(), html.size(), what, video.c_str(), ref_video.c_str(), thumb.c_str(), ref_thumb.c_str());
+    return false;
+}
+
+static bool verify(const Page& page) {
+    if (!same_results(page.name, page.html)) return false;
+    // Cut pages end in the middle of anchors, markers and URLs, which is where a faster
+    // parser is most likely to disagree.
+    for (size_t len = 0; len < page.html.size(); len += 61) {
+        if (!same_results(page.name + " cut", page.html.substr(0, len))) return false;
+    }
+    return true;
+}
+
+static void usage(const char* program) {
+    fprintf(stderr,
+            "Usage: %s [--corpus <dir>] [--quick] [--only <parser>]\n"
+            "  --corpus <dir>   Directory of saved pin pages, *.html (default: bench/corpus)\n"
+            "  --quick          Shorter runs, for a smoke test\n"
+            "  --only <name>    Run a single parser: reference, current or single_pass\n",
+            program);
+}
+
+int main(int argc, char* argv[]) {
+    std::string corpus = "bench/corpus";
+    std::string only;
+    bool quick = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--corpus" && i + 1 < argc) corpus = argv[++i];
+        else if (arg == "--only" && i + 1 < argc) only = argv[++i];
+        else if (arg == "--quick") quick = true;
+        else {
+            usage(argv[0]);
+            return arg == "-h" || arg == "--help" ? 0 : 1;
+        }
+    }
+
+    std::vector<Page> pages = load_corpus(corpus);
+    if (pages.empty()) {
+        fprintf(stderr, "No *.html pages in %s\n", corpus.c_str());
+        return 1;
+    }
+
+    int mismatches = 0;
+    for (const auto& page : pages) {
+        if (!verify(page)) ++mismatches;
+    }
+    if (mismatches) {
+        fprintf(stderr, "%d of %zu pages differ from the reference parser.\n", mismatches, pages.size());
+        return 1;
+    }
+
+    std::vector<Parser> parsers = {
+        {"reference",
+         [](const std::string& html) {
+             return reference_find_video_url(html).size() + reference_find_thumbnail_url(html).size();
+         }},
+        {"current", [](const std::string& html) { return find_video_url(html).size() + find_thumbnail_url(html).size(); }},
+        {"single_pass",
+         [](const std::string& html) {
+             MediaFields f = find_media_fields(html);
+             return f.video_url.size() + f.thumbnail_url.size();
+         }},
+    };
+
+    const double min_seconds = quick ? 0.02 : 0.25;
+    fprintf(stderr, "%-30s %-12s %9s %10s %8s %12s\n", "page", "parser", "KB", "ns/page", "GB/s", "allocs/call");
+    for (const auto& page : pages) {
+        for (const auto& p : parsers) {
+            if (!only.empty() && p.name != only) continue;
+
+            // The first call may build lookup tables; count the allocations of the second.
+            size_t found = p.run(page.html);
+            long long before = g_allocations.load();
+            p.run(page.html);
+            long long allocs = g_allocations.load() - before;
+
+            // Doubles the batch until it runs long enough to time reliably.
+            long long calls = 0;
+            double seconds = 0;
+            for (long long batch = 1; seconds < min_seconds; batch *= 2) {
+                auto start = Clock::now();
+                for (long long i = 0; i < batch; ++i) g_sink += p.run(page.html);
+                seconds += std::chrono::duration<double>(Clock::now() - start).count();
+                calls += batch;
+            }
+            double ns = seconds * 1e9 / calls;
+            double gbps = page.html.size() / ns;
+
+            printf("{\"page\":\"%s\",\"parser\":\"%s\",\"bytes\":%zu,\"calls\":%lld,\"ns_per_page\":%.1f,"
+                   "\"gb_per_s\":%.3f,\"allocations_per_call\":%lld,\"found_bytes\":%zu}\n",
+                   page.name.c_str(), p.name.c_str(), page.html.size(), calls, ns, gbps, allocs, found);
+            fflush(stdout);
+            fprintf(stderr, "%-30s %-12s %9.1f %10.0f %8.2f %12lld\n", page.name.c_str(), p.name.c_str(),
+                    page.html.size() / 1024.0, ns, gbps, allocs);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,12 @@
+#ifndef REFERENCE_PARSER_H
+#define REFERENCE_PARSER_H
+
+#include <string>
+
+// The original std::string::find parser, kept unchanged as the oracle for parser_bench:
+// find_video_url() and find_thumbnail_url() must return exactly what these return.
+std::string reference_find_video_url(const std::string& html_content);
+
+std::string reference_find_thumbnail_url(const std::string& html_content);
+
+#endif
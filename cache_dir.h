@@ -0,0 +1,29 @@
+#ifndef CACHE_DIR_H
+#define CACHE_DIR_H
+
+#include <string>
+#include <cerrno>
+#include <cstdlib>
+#include <sys/stat.h>
+
+// Directory for files kept between runs: $PINOADER_CACHE_DIR, else
+// $XDG_CACHE_HOME/pinoader, else ~/.cache/pinoader. Created on first use, private (0700):
+// it holds TLS session secrets. Returns an empty string if no usable directory exists.
+inline std::string cache_dir() {
+    std::string dir;
+    if (const char* env = getenv("PINOADER_CACHE_DIR")) dir = env;
+    else if (const char* xdg = getenv("XDG_CACHE_HOME")) dir = std::string(xdg) + "/pinoader";
+    else if (const char* home = getenv("HOME")) dir = std::string(home) + "/.cache/pinoader";
+    if (dir.empty()) return "";
+
+    for (size_t pos = 1; pos <= dir.size(); ++pos) {
+        if (pos == dir.size() || dir[pos] == '/') {
+            std::string prefix = dir.substr(0, pos);
+            mode_t mode = pos == dir.size() ? 0700 : 0755;
+            if (mkdir(prefix.c_str(), mode) != 0 && errno != EEXIST) return "";
+        }
+    }
+    return dir;
+}
+
+#endif
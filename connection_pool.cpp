@@ -0,0 +1,139 @@
+#include "connection_pool.h"
+#include "http_internal.h"
+#include "logger.h"
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+// False if the server closed the connection while it sat in the pool. Readable data is
+// allowed: TLS 1.3 session tickets can arrive after the handshake.
+static bool still_open(const Connection& c) {
+    if (c.is_closed) return false;
+    char buf[1];
+    int r = recv(c.socket_fd, buf, 1, MSG_PEEK | MSG_DONTWAIT);
+    return r > 0 || (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+ConnectionPool::ConnectionPool() = default;
+
+ConnectionPool::~ConnectionPool() = default;
+
+void ConnectionPool::set_limits(int max_idle_per_host, int max_idle, double idle_timeout_s) {
+    max_idle_per_host_ = std::max(1, max_idle_per_host);
+    max_idle_ = std::max(1, max_idle);
+    idle_timeout_ms_ = (long long)(idle_timeout_s * 1000);
+}
+
+double ConnectionPool::idle_timeout_s() const {
+    return idle_timeout_ms_ / 1000.0;
+}
+
+std::unique_ptr<Connection> ConnectionPool::check_out(const std::string& key, std::chrono::milliseconds prefetch_wait) {
+    auto oldest = Clock::now() - std::chrono::milliseconds(idle_timeout_ms_.load());
+    // Closed outside the lock: the TLS close_notify is a write.
+    std::vector<std::unique_ptr<Connection>> stale;
+    std::unique_ptr<Connection> found;
+    {
+        Shard& s = shard(key);
+        std::unique_lock<std::mutex> lock(s.mtx);
+        if (prefetch_wait.count() > 0) {
+            s.prefetch_done.wait_for(lock, prefetch_wait, [&] { return !s.prefetching.count(key); });
+        }
+        auto it = s.hosts.find(key);
+        if (it != s.hosts.end()) {
+            auto& idle = it->second;
+            while (!found && !idle.empty()) {
+                std::unique_ptr<Connection> c = std::move(idle.back());
+                idle.pop_back();
+                --idle_;
+                if (c->idle_since < oldest || !still_open(*c)) stale.push_back(std::move(c));
+                else found = std::move(c);
+            }
+            if (idle.empty()) s.hosts.erase(it);
+        }
+    }
+    evictions_ += stale.size();
+    if (found) ++hits_;
+    else ++misses_;
+    return found;
+}
+
+void ConnectionPool::check_in(const std::string& key, std::unique_ptr<Connection> conn) {
+    if (!conn || conn->is_closed) return;
+    conn->idle_since = Clock::now();
+    std::unique_ptr<Connection> closed;
+    {
+        Shard& s = shard(key);
+        std::lock_guard<std::mutex> lock(s.mtx);
+        if (idle_ >= max_idle_) {
+            closed = std::move(conn);
+        } else {
+            auto& idle = s.hosts[key];
+            if ((int)idle.size() >= max_idle_per_host_) {
+                closed = std::move(idle.front());
+                idle.pop_front();
+                --idle_;
+            }
+            idle.push_back(std::move(conn));
+            ++idle_;
+        }
+    }
+    if (closed) ++evictions_;
+}
+
+bool ConnectionPool::begin_prefetch(const std::string& key) {
+    Shard& s = shard(key);
+    std::lock_guard<std::mutex> lock(s.mtx);
+    if (s.hosts.count(key)) return false;
+    return s.prefetching.insert(key).second;
+}
+
+void ConnectionPool::end_prefetch(const std::string& key) {
+    Shard& s = shard(key);
+    {
+        std::lock_guard<std::mutex> lock(s.mtx);
+        s.prefetching.erase(key);
+    }
+    s.prefetch_done.notify_all();
+}
+
+int ConnectionPool::evict_idle() {
+    auto oldest = Clock::now() - std::chrono::milliseconds(idle_timeout_ms_.load());
+    std::vector<std::unique_ptr<Connection>> stale;
+    for (Shard& s : shards_) {
+        std::lock_guard<std::mutex> lock(s.mtx);
+        for (auto it = s.hosts.begin(); it != s.hosts.end();) {
+            auto& idle = it->second;
+            for (auto c = idle.begin(); c != idle.end();) {
+                if ((*c)->idle_since < oldest || !still_open(**c)) {
+                    stale.push_back(std::move(*c));
+                    c = idle.erase(c);
+                    --idle_;
+                } else {
+                    ++c;
+                }
+            }
+            if (idle.empty()) it = s.hosts.erase(it);
+            else ++it;
+        }
+    }
+    evictions_ += stale.size();
+    return (int)stale.size();
+}
+
+void ConnectionPool::clear() {
+    for (Shard& s : shards_) {
+        std::lock_guard<std::mutex> lock(s.mtx);
+        s.hosts.clear();
+    }
+    idle_ = 0;
+}
+
+PoolStats ConnectionPool::stats() const {
+    PoolStats st;
+    st.hits = hits_;
+    st.misses = misses_;
+    st.evictions = evictions_;
+    st.idle = idle_;
+    return st;
+}
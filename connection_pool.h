@@ -0,0 +1,77 @@
+#ifndef CONNECTION_POOL_H
+#define CONNECTION_POOL_H
+
+#include "http_client.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+struct Connection;
+
+// Idle HTTP/1.1 connections, keyed by "host:port". The keys are spread over shards with a
+// lock each, so threads checking connections out and back in for different hosts do not
+// wait for each other. A host keeps its connections oldest first; check_out() hands out the
+// newest, the one the server is least likely to have closed. Safe to call from several threads.
+class ConnectionPool {
+public:
+    ConnectionPool();
+    ~ConnectionPool();
+    ConnectionPool(const ConnectionPool&) = delete;
+    ConnectionPool& operator=(const ConnectionPool&) = delete;
+
+    // Defaults: 8 idle connections per host, 256 in all, closed after 60 s idle.
+    void set_limits(int max_idle_per_host, int max_idle, double idle_timeout_s);
+    double idle_timeout_s() const;
+
+    // An idle connection to `key` that is still open, or nullptr. If a prefetch to `key` is
+    // connecting, waits up to `prefetch_wait` for it first instead of opening a second connection.
+    std::unique_ptr<Connection> check_out(const std::string& key,
+                                          std::chrono::milliseconds prefetch_wait = std::chrono::milliseconds(0));
+
+    // Keeps `conn` for reuse. At the per-host cap the host's oldest connection is closed to
+    // make room; at the global cap `conn` itself is closed.
+    void check_in(const std::string& key, std::unique_ptr<Connection> conn);
+
+    // Marks a prefetch to `key` as connecting. False if one already is or `key` has an idle
+    // connection. end_prefetch() wakes the check_out() calls waiting for it.
+    bool begin_prefetch(const std::string& key);
+    void end_prefetch(const std::string& key);
+
+    // Closes the connections idle for longer than the timeout and those the server closed.
+    // Returns how many.
+    int evict_idle();
+
+    void clear();
+
+    PoolStats stats() const;
+
+private:
+    static const size_t SHARDS = 16;
+
+    struct Shard {
+        std::mutex mtx;
+        std::unordered_map<std::string, std::deque<std::unique_ptr<Connection>>> hosts;
+        std::unordered_set<std::string> prefetching;
+        std::condition_variable prefetch_done;
+    };
+
+    Shard& shard(const std::string& key) { return shards_[std::hash<std::string>()(key) % SHARDS]; }
+
+    Shard shards_[SHARDS];
+    std::atomic<int> idle_{0};
+    std::atomic<int> max_idle_per_host_{8};
+    std::atomic<int> max_idle_{256};
+    std::atomic<long long> idle_timeout_ms_{60000};
+    std::atomic<long long> hits_{0};
+    std::atomic<long long> misses_{0};
+    std::atomic<long long> evictions_{0};
+};
+
+#endif
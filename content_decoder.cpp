@@ -0,0 +1,138 @@
+#include "content_decoder.h"
+#include <cctype>
+#include <zlib.h>
+#ifdef HAVE_BROTLI
+#include <brotli/decode.h>
+#endif
+
+const char* accepted_encodings() {
+#ifdef HAVE_BROTLI
+    return "gzip, deflate, br";
+#else
+    return "gzip, deflate";
+#endif
+}
+
+ContentDecoder::ContentDecoder() = default;
+
+ContentDecoder::~ContentDecoder() {
+    if (zlib_) inflateEnd(zlib_.get());
+#ifdef HAVE_BROTLI
+    if (brotli_) BrotliDecoderDestroyInstance(brotli_);
+#endif
+}
+
+bool ContentDecoder::start(const std::string& encoding) {
+    std::string name;
+    for (char c : encoding) {
+        if (c != ' ' && c != '\t') name += (char)std::tolower((unsigned char)c);
+    }
+
+    if (name.empty() || name == "identity") return true;
+    if (name == "gzip" || name == "x-gzip" || name == "deflate") {
+        zlib_ = std::make_unique<z_stream>();
+        // 15 + 32 detects the gzip and zlib headers; a raw deflate stream is retried below.
+        if (inflateInit2(zlib_.get(), 15 + 32) != Z_OK) {
+            zlib_.reset();
+            return false;
+        }
+        kind_ = name == "deflate" ? Kind::DEFLATE : Kind::GZIP;
+        return true;
+    }
+#ifdef HAVE_BROTLI
+    if (name == "br") {
+        brotli_ = BrotliDecoderCreateInstance(nullptr, nullptr, nullptr);
+        if (!brotli_) return false;
+        kind_ = Kind::BROTLI;
+        return true;
+    }
+#endif
+    return false;
+}
+
+bool ContentDecoder::feed(const char* data, size_t len, const std::function<bool(const char*, size_t)>& out) {
+    if (finished_ || len == 0) return true;
+    if (kind_ == Kind::BROTLI) return feed_brotli(data, len, out);
+    return feed_zlib(data, len, out);
+}
+
+bool ContentDecoder::feed_zlib(const char* data, size_t len, const std::function<bool(const char*, size_t)>& out) {
+    z_stream* zs = zlib_.get();
+    if (member_end_) {
+        member_end_ = false;
+        if ((unsigned char)data[0] != 0x1f) {
+            finished_ = true;
+            return true;
+        }
+        if (inflateReset(zs) != Z_OK) return false;
+    }
+    zs->next_in = (Bytef*)data;
+    zs->avail_in = (uInt)len;
+    char buf[16384];
+
+    while (zs->avail_in > 0 && !finished_) {
+        zs->next_out = (Bytef*)buf;
+        zs->avail_out = sizeof(buf);
+        int ret = inflate(zs, Z_NO_FLUSH);
+
+        if (ret == Z_DATA_ERROR && kind_ == Kind::DEFLATE && !raw_deflate_ && zs->total_out == 0) {
+            // Not a zlib header: start over on the same bytes as raw deflate.
+            raw_deflate_ = true;
+            if (inflateReset2(zs, -15) != Z_OK) return false;
+            zs->next_in = (Bytef*)data;
+            zs->avail_in = (uInt)len;
+            continue;
+        }
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) return false;
+
+        size_t produced = sizeof(buf) - zs->avail_out;
+        if (produced > 0 && !out(buf, produced)) {
+            stopped_ = true;
+            return false;
+        }
+        if (ret == Z_STREAM_END) {
+            // gzip allows several members back to back.
+            if (kind_ == Kind::GZIP && zs->avail_in == 0) {
+                member_end_ = true;  // Decided by the first byte of the next chunk
+            } else if (kind_ == Kind::GZIP && (unsigned char)zs->next_in[0] == 0x1f) {
+                if (inflateReset(zs) != Z_OK) return false;
+            } else {
+                finished_ = true;
+            }
+        } else if (ret == Z_BUF_ERROR && produced == 0) {
+            break;
+        }
+    }
+    return true;
+}
+
+bool ContentDecoder::feed_brotli(const char* data, size_t len, const std::function<bool(const char*, size_t)>& out) {
+#ifdef HAVE_BROTLI
+    const uint8_t* next_in = (const uint8_t*)data;
+    size_t avail_in = len;
+    uint8_t buf[16384];
+
+    while (true) {
+        uint8_t* next_out = buf;
+        size_t avail_out = sizeof(buf);
+        BrotliDecoderResult ret = BrotliDecoderDecompressStream(brotli_, &avail_in, &next_in, &avail_out, &next_out, nullptr);
+        if (ret == BROTLI_DECODER_RESULT_ERROR) return false;
+
+        size_t produced = sizeof(buf) - avail_out;
+        if (produced > 0 && !out((const char*)buf, produced)) {
+            stopped_ = true;
+            return false;
+        }
+        if (ret == BROTLI_DECODER_RESULT_SUCCESS) {
+            finished_ = true;
+            return true;
+        }
+        if (ret == BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT) return true;
+    }
+#else
+    (void)data;
+    (void)len;
+    (void)out;
+    return false;
+#endif
+}
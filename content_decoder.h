@@ -0,0 +1,50 @@
+#ifndef CONTENT_DECODER_H
+#define CONTENT_DECODER_H
+
+#include <string>
+#include <memory>
+#include <functional>
+
+struct z_stream_s;
+struct BrotliDecoderStateStruct;
+
+// Accept-Encoding value for page requests: everything ContentDecoder understands.
+// Media requests send no Accept-Encoding and stay identity-encoded.
+const char* accepted_encodings();
+
+// Incremental decoder for a Content-Encoding: gzip, deflate and, when built with
+// libbrotlidec, br. Compressed chunks go in as they arrive (after any chunked framing has
+// been removed) and the plain bytes come out through a callback.
+class ContentDecoder {
+public:
+    ContentDecoder();
+    ~ContentDecoder();
+    ContentDecoder(const ContentDecoder&) = delete;
+    ContentDecoder& operator=(const ContentDecoder&) = delete;
+
+    // Prepares for a Content-Encoding header value. Returns false for encodings it cannot
+    // decode. For identity (or an empty value) it returns true and stays inactive.
+    bool start(const std::string& encoding);
+    bool active() const { return kind_ != Kind::NONE; }
+
+    // Decodes `len` bytes and hands the output to `out`. Returns false if the data is corrupt
+    // or `out` returned false; check stopped() to tell the two apart.
+    bool feed(const char* data, size_t len, const std::function<bool(const char*, size_t)>& out);
+    bool stopped() const { return stopped_; }
+
+private:
+    enum class Kind { NONE, GZIP, DEFLATE, BROTLI };
+
+    bool feed_zlib(const char* data, size_t len, const std::function<bool(const char*, size_t)>& out);
+    bool feed_brotli(const char* data, size_t len, const std::function<bool(const char*, size_t)>& out);
+
+    Kind kind_ = Kind::NONE;
+    std::unique_ptr<z_stream_s> zlib_;
+    BrotliDecoderStateStruct* brotli_ = nullptr;
+    bool raw_deflate_ = false;  // "deflate" sent without the zlib header, as some servers do
+    bool member_end_ = false;   // A gzip member ended with the last chunk; another may follow
+    bool finished_ = false;     // End of the compressed stream; anything after it is ignored
+    bool stopped_ = false;
+};
+
+#endif
@@ -0,0 +1,750 @@
+#include "http_client.h"
+#include "http_internal.h"
+#include "logger.h"
+#include "media_store.h"
+#include "trace.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+// Ranges smaller than this are not worth an extra connection and TLS handshake.
+static const long long MIN_SEGMENT_SIZE = 1 << 20;
+
+// How much data is written between two updates of the .part.meta sidecar.
+static const long long COMMIT_INTERVAL = 4 << 20;
+
+// Bytes between two DownloadOptions::progress calls.
+static const long long PROGRESS_INTERVAL = 1 << 20;
+
+// Value for If-Range: a strong ETag if there is one, otherwise Last-Modified.
+static std::string range_validator(const std::string& etag, const std::string& last_modified) {
+    if (!etag.empty() && etag.rfind("W/", 0) != 0) return etag;
+    return last_modified;
+}
+
+// A byte range of the output. `done` bytes starting at `first` are on disk.
+// `last` is -1 while the size of a single-stream download is still unknown; such a segment is
+// never complete, it only becomes so once the body ended cleanly and `last` is recorded.
+struct Segment {
+    long long first = 0;
+    long long last = -1;
+    long long done = 0;
+};
+
+// Progress of an interrupted download, kept in "<output>.part.meta" next to "<output>.part".
+struct PartState {
+    std::string url;
+    std::string etag;
+    std::string last_modified;
+    long long size = -1;
+    std::vector<Segment> segments;
+
+    std::string meta_path;
+    int fd = -1;  // The part file, synced before the sidecar is rewritten
+    std::mutex mtx;
+    std::mutex save_mtx;  // One save() at a time; `mtx` is only held while the counts are read
+    // If-None-Match/If-Modified-Since for the first request of a fresh download of a stored URL.
+    std::string conditional;
+
+    std::string validator() const { return range_validator(etag, last_modified); }
+
+    // The part file is preallocated, so its size says nothing about what reached the disk.
+    // Instead the counts are read first and the file is synced before they are written:
+    // after a crash the sidecar never claims bytes that were not on disk.
+    bool save() {
+        std::lock_guard<std::mutex> save_lock(save_mtx);
+        std::ostringstream text;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            text << "url " << url << "\n";
+            if (!etag.empty()) text << "etag " << etag << "\n";
+            if (!last_modified.empty()) text << "last-modified " << last_modified << "\n";
+            text << "size " << size << "\n";
+            for (const auto& s : segments) text << "segment " << s.first << " " << s.last << " " << s.done << "\n";
+        }
+        if (fd >= 0 && fdatasync(fd) != 0) return false;
+        std::string tmp = meta_path + ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::trunc);
+            out << text.str();
+            if (!out) return false;
+        }
+        return rename(tmp.c_str(), meta_path.c_str()) == 0;
+    }
+
+    bool load() {
+        std::ifstream in(meta_path);
+        if (!in) return false;
+        std::string line;
+        while (std::getline(in, line)) {
+            size_t space = line.find(' ');
+            if (space == std::string::npos) continue;
+            std::string key = line.substr(0, space);
+            std::string val = line.substr(space + 1);
+            if (key == "url") url = val;
+            else if (key == "etag") etag = val;
+            else if (key == "last-modified") last_modified = val;
+            else if (key == "size") size = std::atoll(val.c_str());
+            else if (key == "segment") {
+                Segment s;
+                std::istringstream fields(val);
+                if (fields >> s.first >> s.last >> s.done) segments.push_back(s);
+            }
+        }
+        return !url.empty() && !segments.empty();
+    }
+
+    long long committed() {
+        std::lock_guard<std::mutex> lock(mtx);
+        long long total = 0;
+        for (const auto& s : segments) total += s.done;
+        return total;
+    }
+};
+
+enum class SegmentStatus { DONE, FAILED, CHANGED, NOT_MODIFIED };
+
+// One request on either a stream of the host's HTTP/2 connection or a pooled HTTP/1.1
+// connection, so the download logic does not depend on what the server negotiated.
+struct Exchange {
+    std::unique_ptr<HostPermit> permit;
+    std::shared_ptr<H2Connection> h2;
+    std::shared_ptr<H2Stream> h2_stream;
+    std::unique_ptr<Connection> conn;
+    std::unique_ptr<BufferedStream> stream;
+    HttpResponse response;
+    ResponseHead head;
+    bool truncated = false;  // The body was cut short (detectable on HTTP/2 and with chunked framing)
+    bool write_failed = false;  // Writing the body to the file failed, whatever the framing
+    bool zero_copy = false;  // kTLS is active, so the body is spliced into the file
+    long long chunk_left = 0;  // Chunked HTTP/1.1 body: data bytes left in the current chunk
+    bool body_done = false;    // Chunked HTTP/1.1 body: the last chunk has been read
+
+    ~Exchange() {
+        if (h2_stream) h2->close_stream(*h2_stream);
+    }
+
+    // Sends the request and reads the response head. `extra_headers` are "Name: value\r\n" lines.
+    // The connection is always kept alive: the response says where its body ends unless the
+    // server closes the connection after it. Without `multiplex` the request gets an HTTP/1.1
+    // connection of its own even if the host speaks HTTP/2: the Range segments of one download
+    // are meant to run over separate TCP connections, not share one congestion window.
+    bool start(const std::string& method, const std::string& host, int port, const std::string& path,
+               const std::string& extra_headers, bool multiplex = true) {
+        permit = std::make_unique<HostPermit>(g_state.limiter, host);
+        if (multiplex) h2 = g_state.get_h2_connection(host, port);
+        if (h2) {
+            Span ttfb("ttfb");
+            h2_stream = h2->open_stream(method, authority("https", host, port), path, h2_header_list(extra_headers));
+            if (!h2_stream) return false;
+            permit->sent();
+            if (!h2->wait_headers(*h2_stream, response)) return false;
+            permit->response(response.status_code, retry_after(response));
+            auto it = response.headers.find("content-length");
+            if (it != response.headers.end()) head.content_length = std::atoll(it->second.c_str());
+            return true;
+        }
+
+        std::string request = build_request(method, authority("https", host, port), path, extra_headers);
+        bool sent = false;
+        conn = g_state.get_connection(host, port, true, &request, &sent);
+        if (!conn) return false;
+        Span ttfb("ttfb");
+        if (!sent && !send_request(conn.get(), request)) return false;
+        permit->sent();
+        stream = std::make_unique<BufferedStream>(conn.get());
+        zero_copy = stream->ktls_recv();
+        if (!read_response_head(*stream, response, head)) return false;
+        permit->response(response.status_code, retry_after(response));
+        return true;
+    }
+
+    std::string body_path() const {
+        if (h2_stream) return "HTTP/2 stream, buffered";
+        if (zero_copy) return "kTLS + splice, zero-copy";
+        return g_state.ktls ? "buffered, kTLS not active on this connection" : "buffered";
+    }
+
+    // With a chunked HTTP/1.1 body: the number of data bytes that can be read before the next
+    // chunk header, reading that header if needed. 0 at the end of the body.
+    long long chunk_available() {
+        if (chunk_left > 0 || body_done) return chunk_left;
+        chunk_left = stream->next_chunk();
+        if (chunk_left < 0) {
+            chunk_left = 0;
+            truncated = true;
+        }
+        body_done = chunk_left == 0;
+        return chunk_left;
+    }
+
+    // For a body without a length, read until it stopped: true if it stopped at its real end
+    // (the last chunk, END_STREAM, or a clean close of the connection).
+    bool ended_cleanly() const {
+        if (h2_stream || head.chunked) return !truncated;
+        return stream && stream->clean_eof;
+    }
+
+    // Length of the body, -1 if it is chunked or ends with the connection.
+    long long body_length() const {
+        return !h2_stream && head.chunked ? -1 : head.content_length;
+    }
+
+    // True once a body with a known end (Content-Length, chunked or HTTP/2) has been read
+    // completely after `received` bytes. Reads the final chunk of a chunked body if only it is left.
+    bool read_complete(long long received) {
+        if (h2_stream) return body_length() < 0 ? !truncated : received == body_length();
+        if (head.chunked) return chunk_available() == 0 && body_done && !truncated;
+        return received == head.content_length;
+    }
+
+    // Writes up to `n` body bytes at `offset` in `fd`. Returns the number of bytes written.
+    long long read_to_fd(int fd, off_t offset, long long n) {
+        if (!h2_stream && head.chunked) {
+            long long written = 0;
+            while (written < n) {
+                long long want = std::min(chunk_available(), n - written);
+                if (want <= 0) break;
+                long long got = zero_copy ? stream->splice_to_fd(fd, offset + written, want)
+                                          : stream->read_to_fd(fd, offset + written, want);
+                chunk_left -= got;
+                written += got;
+                if (got < want) {
+                    truncated = true;
+                    write_failed = stream->write_error;
+                    break;
+                }
+            }
+            return written;
+        }
+        if (!h2_stream) {
+            long long written = zero_copy ? stream->splice_to_fd(fd, offset, n) : stream->read_to_fd(fd, offset, n);
+            write_failed = stream->write_error;
+            return written;
+        }
+
+        char buf[16384];
+        long long written = 0;
+        while (written < n) {
+            int r = h2->read(*h2_stream, buf, (int)std::min<long long>(sizeof(buf), n - written));
+            if (r <= 0) {
+                truncated = r < 0;
+                break;
+            }
+            for (int done = 0; done < r;) {
+                ssize_t w = timed_pwrite(fd, buf + done, r - done, offset + written + done);
+                if (w <= 0) {
+                    truncated = write_failed = true;
+                    return written + done;
+                }
+                done += w;
+            }
+            written += r;
+        }
+        return written;
+    }
+
+    // Hands up to `n` body bytes (-1: all of them) to `sink`. Returns the number delivered;
+    // `stopped` is set if the sink returned false.
+    long long read_to_sink(const BodyCallback& sink, long long n, bool& stopped) {
+        long long delivered = 0;
+        auto counted = [&](const char* data, size_t len) {
+            delivered += len;
+            stopped = !sink(data, len);
+            return !stopped;
+        };
+        if (!h2_stream && head.chunked) {
+            while (n < 0 || delivered < n) {
+                long long want = chunk_available();
+                if (n >= 0) want = std::min(want, n - delivered);
+                if (want <= 0) break;
+                long long before = delivered;
+                bool more = stream->read_to_sink(want, counted);
+                chunk_left -= delivered - before;
+                if (!more) break;
+                if (delivered - before < want) {
+                    truncated = true;
+                    break;
+                }
+            }
+            return delivered;
+        }
+        if (!h2_stream) {
+            stream->read_to_sink(n, counted);
+            return delivered;
+        }
+
+        char buf[16384];
+        while (n < 0 || delivered < n) {
+            int r = h2->read(*h2_stream, buf, (int)(n < 0 ? sizeof(buf) : std::min<long long>(sizeof(buf), n - delivered)));
+            if (r <= 0) {
+                truncated = r < 0;
+                break;
+            }
+            if (!counted(buf, r)) break;
+        }
+        return delivered;
+    }
+
+    // Called once the whole body was read: hands the connection back for reuse.
+    void finish() {
+        if (h2_stream) {
+            h2->close_stream(*h2_stream);
+            h2_stream.reset();
+        } else if (!head.connection_close && !stream->error) {
+            g_state.release_connection(std::move(conn));
+        }
+    }
+};
+
+struct RangeSupport {
+    bool not_modified = false;  // 304 to the conditional headers
+    bool accept_ranges = false;
+    long long size = -1;
+    std::string etag;
+    std::string last_modified;
+};
+
+// Asks the server for the size of the resource and whether it serves byte ranges.
+static RangeSupport probe_ranges(const std::string& host, int port, const std::string& path,
+                                 const std::string& conditional) {
+    Span span("probe");
+    RangeSupport result;
+    Exchange exchange;
+    if (!exchange.start("HEAD", host, port, path, conditional)) return result;
+
+    HttpResponse& response = exchange.response;
+    result.not_modified = response.status_code == 304;
+    if (response.status_code == 200) {
+        result.size = exchange.head.content_length;
+        result.accept_ranges = response.headers.count("accept-ranges") &&
+                               to_lower(response.headers["accept-ranges"]).find("bytes") != std::string::npos;
+        result.etag = response.headers["etag"];
+        result.last_modified = response.headers["last-modified"];
+    }
+
+    // A HEAD response carries no body, so the connection is immediately reusable.
+    exchange.finish();
+    return result;
+}
+
+// Parses "bytes <first>-<last>/<total>". Total is -1 when the server sends "*".
+static bool parse_content_range(const std::string& value, long long& first, long long& total) {
+    long long last = 0;
+    total = -1;
+    if (sscanf(value.c_str(), "bytes %lld-%lld/%lld", &first, &last, &total) >= 2) return true;
+    return false;
+}
+
+// Like Exchange::read_to_fd(), but through user space so the bytes also go to `digest`.
+static long long read_hashed(Exchange& exchange, int fd, off_t offset, long long n, Sha256& digest) {
+    long long written = 0;
+    bool stopped = false;
+    exchange.read_to_sink([&](const char* data, size_t len) {
+        for (size_t done = 0; done < len;) {
+            ssize_t w = timed_pwrite(fd, data + done, len - done, offset + written + done);
+            if (w <= 0) {
+                exchange.write_failed = true;
+                return false;
+            }
+            done += w;
+        }
+        digest.update(data, len);
+        written += len;
+        return true;
+    }, n, stopped);
+    return written;
+}
+
+// Fetches the missing part of one segment into `fd`. Every attempt continues from the
+// last committed byte, validated with If-Range so a changed resource is never spliced in.
+// With `digest` (a single segment) the bytes are hashed in order as they are written, unless
+// the body is spliced with kTLS: zero-copy wins and `digest` is reset for hashing the file later.
+static SegmentStatus download_segment(const std::string& host, int port, const std::string& path, int fd,
+                                      PartState& state, size_t index, const DownloadOptions& options,
+                                      std::unique_ptr<Sha256>* digest = nullptr) {
+    for (int attempt = 0; attempt < 3; ++attempt) {
+        Segment seg;
+        {
+            std::lock_guard<std::mutex> lock(state.mtx);
+            seg = state.segments[index];
+        }
+        long long offset = seg.first + seg.done;
+        if (seg.last >= 0 && offset > seg.last) return SegmentStatus::DONE;
+
+        std::string extra;
+        bool ranged = offset > 0 || seg.last >= 0;
+        if (ranged) {
+            extra = "Range: bytes=" + std::to_string(offset) + "-" + (seg.last >= 0 ? std::to_string(seg.last) : "") + "\r\n";
+            if (!state.validator().empty()) extra += "If-Range: " + state.validator() + "\r\n";
+        } else {
+            extra = state.conditional;
+        }
+
+        Exchange exchange;
+        if (!exchange.start("GET", host, port, path, extra, state.segments.size() == 1)) continue;
+        HttpResponse& response = exchange.response;
+
+        if (response.status_code == 304 && !ranged && !state.conditional.empty()) {
+            exchange.finish();
+            return SegmentStatus::NOT_MODIFIED;
+        } else if (response.status_code == 206) {
+            long long range_first = -1, total = -1;
+            if (!parse_content_range(response.headers["content-range"], range_first, total) || range_first != offset) {
+                log_debug("[downloader] Server answered with an unexpected range: " + response.headers["content-range"]);
+                return SegmentStatus::FAILED;
+            }
+            std::lock_guard<std::mutex> lock(state.mtx);
+            if (state.size >= 0 && total >= 0 && total != state.size) {
+                // Same validator, different length: not the file the part holds.
+                return SegmentStatus::CHANGED;
+            }
+            if (state.size < 0 && total >= 0) {
+                state.size = total;
+                state.segments[index].last = total - 1;
+                seg.last = total - 1;
+            }
+        } else if (response.status_code == 200) {
+            if (offset != 0 || state.segments.size() != 1) {
+                // If-Range did not match: the file on the server is not the one we started.
+                return SegmentStatus::CHANGED;
+            }
+            std::lock_guard<std::mutex> lock(state.mtx);
+            state.etag = response.headers["etag"];
+            state.last_modified = response.headers["last-modified"];
+            state.size = exchange.body_length();
+            state.segments[index].last = seg.last = state.size >= 0 ? state.size - 1 : -1;
+        } else if (response.status_code == 416 && state.size >= 0 && offset == state.size) {
+            return SegmentStatus::DONE;
+        } else if (is_overload_status(response.status_code) && attempt < 2) {
+            double delay = std::max(backoff_delay(attempt), retry_after(response));
+            log_debug("[downloader] HTTP " + std::to_string(response.status_code) + ". Retrying in " +
+                      std::to_string((int)(delay * 1000)) + " ms.");
+            trace_count("retries");
+            exchange.permit.reset();  // Do not hold a slot while waiting
+            std::this_thread::sleep_for(std::chrono::duration<double>(std::min(delay, 60.0)));
+            continue;
+        } else {
+            log_debug("[downloader] Unexpected response: HTTP " + std::to_string(response.status_code));
+            return SegmentStatus::FAILED;
+        }
+        state.save();
+
+        long long wanted = (seg.last >= 0) ? seg.last - offset + 1 : -1;
+        long long length = exchange.body_length();
+        if (length >= 0 && (wanted < 0 || length < wanted)) wanted = length;
+
+        if (digest && *digest && exchange.zero_copy) digest->reset();
+        bool hashed = digest && *digest;
+        log_debug("[downloader] Body path: " + (hashed ? std::string("buffered, hashed") : exchange.body_path()) + ".");
+        Span transfer("transfer");
+        long long start = offset;
+        long long since_commit = 0;
+        while (wanted < 0 || offset - start < wanted) {
+            long long chunk = options.progress ? PROGRESS_INTERVAL : COMMIT_INTERVAL;
+            long long left = (wanted < 0) ? chunk : std::min(chunk, wanted - (offset - start));
+            long long written = hashed ? read_hashed(exchange, fd, offset, left, **digest)
+                                       : exchange.read_to_fd(fd, offset, left);
+            offset += written;
+            since_commit += written;
+            long long done = 0, size = -1;
+            {
+                std::lock_guard<std::mutex> lock(state.mtx);
+                state.segments[index].done = offset - seg.first;
+                for (const auto& s : state.segments) done += s.done;
+                size = state.size;
+            }
+            if (options.progress) options.progress(done, size);
+            if (since_commit >= COMMIT_INTERVAL) {
+                state.save();
+                since_commit = 0;
+            }
+            if (written < left) break;
+        }
+        state.save();
+
+        long long received = offset - start;
+        transfer.arg("bytes", received);
+        transfer.end();
+        if (exchange.write_failed) {
+            // A short file must never be taken for the end of an open-ended body.
+            log_error("Could not write to the file at byte " + std::to_string(offset) + ".");
+            return SegmentStatus::FAILED;
+        }
+        if (wanted < 0 && exchange.ended_cleanly()) {
+            // No length up front: the last chunk, or the end of the stream, ends the body.
+            if (exchange.read_complete(received)) exchange.finish();
+            {
+                std::lock_guard<std::mutex> lock(state.mtx);
+                state.size = offset;
+                state.segments[index].last = offset - 1;
+            }
+            state.save();
+            return SegmentStatus::DONE;
+        }
+        if (received == wanted) {
+            if (exchange.read_complete(received)) exchange.finish();
+            if (seg.last < 0 || offset > seg.last) return SegmentStatus::DONE;
+        }
+        log_debug("[downloader] Connection dropped at byte " + std::to_string(offset) + ". Resuming.");
+    }
+    return SegmentStatus::FAILED;
+}
+
+// Splits a fresh download into ranges, or into one open-ended segment when ranges are not used.
+// False if the probe was answered with 304: the stored copy is current.
+static bool plan_segments(const std::string& host, int port, const std::string& path,
+                          const DownloadOptions& options, PartState& state) {
+    state.segments.clear();
+    if (options.segments > 1) {
+        RangeSupport ranges = probe_ranges(host, port, path, state.conditional);
+        if (ranges.not_modified) return false;
+        if (ranges.accept_ranges && ranges.size > 0) {
+            long long by_size = ranges.size / MIN_SEGMENT_SIZE;
+            int count = (int)std::max(1LL, std::min<long long>(options.segments, by_size));
+            log_debug("[downloader] Server accepts ranges, size " + std::to_string(ranges.size) +
+                      " bytes. Downloading in " + std::to_string(count) + " segments.");
+            state.size = ranges.size;
+            state.etag = ranges.etag;
+            state.last_modified = ranges.last_modified;
+            long long segment_size = (ranges.size + count - 1) / count;
+            for (long long first = 0; first < ranges.size; first += segment_size) {
+                Segment s;
+                s.first = first;
+                s.last = std::min(ranges.size, first + segment_size) - 1;
+                state.segments.push_back(s);
+            }
+            state.conditional.clear();
+            return true;
+        }
+        log_debug("[downloader] Server does not support ranges. Falling back to a single stream.");
+    }
+    state.segments.push_back(Segment());
+    return true;
+}
+
+// Opens "<output>.part", resuming when the sidecar belongs to the same URL and can be validated.
+static int open_part_file(const std::string& part_path, const std::string& url, PartState& state, bool& resumed) {
+    resumed = false;
+    struct stat st;
+    if (state.load() && state.url == url && !state.validator().empty() && stat(part_path.c_str(), &st) == 0) {
+        // save() syncs the file before the sidecar, so the counts can be trusted; what is
+        // checked here is that the sidecar describes this file: the validator above, and a
+        // file and segments within the total length recorded with it.
+        bool consistent = state.size < 0 || st.st_size <= state.size;
+        for (auto& s : state.segments) {
+            if (s.first < 0 || s.done < 0 || (state.size >= 0 && s.first + s.done > state.size)) consistent = false;
+            // Only a single stream may have an open end, and no segment holds more than its range.
+            if (s.last < 0 ? state.segments.size() > 1 : s.done > s.last - s.first + 1) consistent = false;
+            if (s.first + s.done > st.st_size) {
+                if (state.segments.size() > 1) consistent = false;
+                else s.done = std::max(0LL, (long long)st.st_size - s.first);
+            }
+        }
+        if (consistent) {
+            int fd = open(part_path.c_str(), O_WRONLY);
+            if (fd >= 0) {
+                resumed = true;
+                return fd;
+            }
+        }
+    }
+
+    state.url = url;
+    state.etag.clear();
+    state.last_modified.clear();
+    state.size = -1;
+    state.segments.clear();
+    return open(part_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+}
+
+bool download_file(const std::string& url, const std::string& output_path,
+                   const DownloadOptions& options, DownloadStats* stats) {
+    log_normal("[downloader] Destination: " + output_path);
+    std::string protocol, host, path;
+    int port;
+    if (!parse_url(url, protocol, host, path, port) || protocol != "https") return false;
+
+    const std::string part_path = output_path + ".part";
+    Span span("download");
+    span.arg("url", url);
+
+    StoredMedia stored;
+    bool use_store = media_store_enabled();
+    bool have_stored = use_store && media_store_lookup(url, stored);
+
+    for (int restart = 0; restart < 2; ++restart) {
+        PartState state;
+        state.meta_path = part_path + ".meta";
+        bool resumed = false;
+        int fd = open_part_file(part_path, url, state, resumed);
+        if (fd < 0) return false;
+        state.fd = fd;
+
+        bool not_modified = false;
+        if (resumed) {
+            log_normal("[downloader] Resuming from " + std::to_string(state.committed()) + " bytes.");
+        } else {
+            if (have_stored) state.conditional = conditional_headers(stored);
+            not_modified = !plan_segments(host, port, path, options, state);
+            if (!not_modified && state.size > 0 && posix_fallocate(fd, 0, state.size) != 0 &&
+                ftruncate(fd, state.size) != 0) {
+                close(fd);
+                return false;
+            }
+        }
+        state.save();
+
+        // A single stream is hashed as it is written; only bytes from an earlier run are read back.
+        std::unique_ptr<Sha256> digest;
+        if (use_store && state.segments.size() == 1) {
+            digest = std::make_unique<Sha256>();
+            if (resumed && !hash_file(part_path, state.committed(), *digest)) digest.reset();
+        }
+
+        std::vector<SegmentStatus> results(state.segments.size(), SegmentStatus::FAILED);
+        if (not_modified) {
+            results.assign(1, SegmentStatus::NOT_MODIFIED);
+        } else if (state.segments.size() == 1) {
+            results[0] = download_segment(host, port, path, fd, state, 0, options, &digest);
+        } else {
+            std::vector<std::thread> threads;
+            std::shared_ptr<Trace> trace = current_trace_shared();
+            for (size_t i = 0; i < state.segments.size(); ++i) {
+                threads.emplace_back([&, i]() {
+                    TraceScope scope(trace);
+                    results[i] = download_segment(host, port, path, fd, state, i, options);
+                });
+            }
+            for (auto& t : threads) t.join();
+        }
+        state.fd = -1;
+        close(fd);
+
+        if (results[0] == SegmentStatus::NOT_MODIFIED) {
+            unlink(part_path.c_str());
+            unlink(state.meta_path.c_str());
+            if (media_store_place(stored, output_path)) {
+                log_normal("[downloader] Not modified. Using the stored copy.");
+                if (stats) {
+                    stats->bytes = stored.size;
+                    stats->status_code = 304;
+                    stats->from_store = true;
+                }
+                span.arg("bytes", 0LL);
+                return true;
+            }
+            log_debug("[store] Could not place the stored copy. Downloading again.");
+            have_stored = false;
+            continue;
+        }
+
+        if (std::count(results.begin(), results.end(), SegmentStatus::CHANGED) > 0) {
+            log_normal("[downloader] File changed on the server. Restarting download.");
+            unlink(part_path.c_str());
+            unlink(state.meta_path.c_str());
+            continue;
+        }
+
+        long long committed = state.committed();
+        span.arg("bytes", committed);
+        span.arg("segments", (long long)state.segments.size());
+        if (stats) {
+            stats->bytes = committed;
+            stats->segments = (int)state.segments.size();
+        }
+        if (std::count(results.begin(), results.end(), SegmentStatus::DONE) != (long)results.size()) {
+            log_debug("[downloader] Download incomplete. Partial data kept in " + part_path);
+            return false;
+        }
+        if (state.size < 0) {
+            log_error("Downloaded " + std::to_string(committed) + " bytes but the size of the file is unknown.");
+            return false;
+        }
+        if (committed != state.size) {
+            log_error("Downloaded " + std::to_string(committed) + " bytes but expected " + std::to_string(state.size) + ".");
+            return false;
+        }
+
+        if (rename(part_path.c_str(), output_path.c_str()) != 0) return false;
+        unlink(state.meta_path.c_str());
+        if (use_store) {
+            // Segments complete out of order, so a segmented or spliced download is hashed from the file.
+            if (!digest) {
+                digest = std::make_unique<Sha256>();
+                if (!hash_file(output_path, -1, *digest)) digest.reset();
+            }
+            if (digest) media_store_add(url, state.etag, state.last_modified, digest->hex_digest(), output_path);
+        }
+        if (stats) stats->status_code = 200;
+        return true;
+    }
+    return false;
+}
+
+bool download_to_sink(const std::string& url, const BodyCallback& sink, DownloadStats* stats) {
+    std::string protocol, host, path;
+    int port;
+    if (!parse_url(url, protocol, host, path, port) || protocol != "https") return false;
+    Span span("download");
+    span.arg("url", url);
+
+    // Bytes already handed to the sink cannot be taken back, so a dropped connection is only
+    // resumed with a Range validated by If-Range.
+    long long offset = 0;
+    std::string validator;
+    for (int attempt = 0; attempt < 3; ++attempt) {
+        std::string extra;
+        if (offset > 0) extra = "Range: bytes=" + std::to_string(offset) + "-\r\n" + "If-Range: " + validator + "\r\n";
+
+        Exchange exchange;
+        if (!exchange.start("GET", host, port, path, extra)) continue;
+        HttpResponse& response = exchange.response;
+
+        if (is_overload_status(response.status_code) && attempt < 2) {
+            double delay = std::max(backoff_delay(attempt), retry_after(response));
+            log_debug("[downloader] HTTP " + std::to_string(response.status_code) + ". Retrying in " +
+                      std::to_string((int)(delay * 1000)) + " ms.");
+            trace_count("retries");
+            exchange.permit.reset();  // Do not hold a slot while waiting
+            std::this_thread::sleep_for(std::chrono::duration<double>(std::min(delay, 60.0)));
+            continue;
+        }
+        long long range_first = -1, total = -1;
+        if (offset == 0 && response.status_code == 200) {
+            validator = range_validator(response.headers["etag"], response.headers["last-modified"]);
+        } else if (offset == 0 || response.status_code != 206 ||
+                   !parse_content_range(response.headers["content-range"], range_first, total) || range_first != offset) {
+            log_debug("[downloader] Unexpected response: HTTP " + std::to_string(response.status_code));
+            return false;
+        }
+
+        Span transfer("transfer");
+        long long wanted = exchange.body_length();
+        bool stopped = false;
+        long long received = exchange.read_to_sink(sink, wanted, stopped);
+        offset += received;
+        transfer.arg("bytes", received);
+        transfer.end();
+        if (stats) stats->bytes = offset;
+        if (stopped) {
+            log_debug("[downloader] The sink stopped the download at byte " + std::to_string(offset) + ".");
+            return false;
+        }
+
+        if (wanted < 0 ? exchange.ended_cleanly() : received == wanted) {
+            if (exchange.read_complete(received)) exchange.finish();
+            span.arg("bytes", offset);
+            if (stats) stats->status_code = 200;
+            return true;
+        }
+        if (validator.empty()) break;
+        log_debug("[downloader] Connection dropped at byte " + std::to_string(offset) + ". Resuming.");
+    }
+    return false;
+}
@@ -0,0 +1,291 @@
+#include "hls.h"
+#include "http_internal.h"
+#include "logger.h"
+#include "trace.h"
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Segments downloaded ahead of the one being written, per worker. Bounds the memory held
+// when an early segment is slow.
+static const int WINDOW_PER_WORKER = 2;
+static const int SEGMENT_ATTEMPTS = 2;
+
+bool is_hls_url(const std::string& url) {
+    size_t end = url.find_first_of("?#");
+    std::string path = url.substr(0, end);
+    return path.size() >= 5 && path.compare(path.size() - 5, 5, ".m3u8") == 0;
+}
+
+// Resolves a playlist URI against the URL of the playlist.
+static std::string resolve_uri(const std::string& base, const std::string& uri) {
+    if (uri.compare(0, 7, "http://") == 0 || uri.compare(0, 8, "https://") == 0) return uri;
+    size_t scheme_end = base.find("://");
+    if (scheme_end == std::string::npos) return uri;
+    if (uri.compare(0, 2, "//") == 0) return base.substr(0, scheme_end + 1) + uri;
+    size_t path_start = base.find('/', scheme_end + 3);
+    if (!uri.empty() && uri[0] == '/') return base.substr(0, path_start) + uri;
+    std::string dir = base.substr(0, base.find_first_of("?#"));
+    if (path_start == std::string::npos) return dir + "/" + uri;
+    return dir.substr(0, dir.rfind('/') + 1) + uri;
+}
+
+// `BANDWIDTH=1280000,CODECS="avc1.4d401f,mp4a.40.2",AUDIO="aac"`: quoted values may hold commas.
+static std::map<std::string, std::string> parse_attributes(const std::string& list) {
+    std::map<std::string, std::string> attrs;
+    size_t i = 0;
+    while (i < list.size()) {
+        size_t eq = list.find('=', i);
+        if (eq == std::string::npos) break;
+        std::string name = list.substr(i, eq - i);
+        std::string value;
+        i = eq + 1;
+        if (i < list.size() && list[i] == '"') {
+            size_t close = list.find('"', i + 1);
+            if (close == std::string::npos) close = list.size();
+            value = list.substr(i + 1, close - i - 1);
+            i = close + 1;
+        } else {
+            size_t comma = list.find(',', i);
+            if (comma == std::string::npos) comma = list.size();
+            value = list.substr(i, comma - i);
+            i = comma;
+        }
+        attrs[name] = value;
+        if (i < list.size() && list[i] == ',') ++i;
+    }
+    return attrs;
+}
+
+static std::vector<std::string> playlist_lines(const std::string& text) {
+    std::vector<std::string> lines;
+    std::istringstream in(text);
+    std::string line;
+    while (std::getline(in, line)) {
+        while (!line.empty() && (line.back() == '\r' || line.back() == ' ')) line.pop_back();
+        if (!line.empty()) lines.push_back(line);
+    }
+    return lines;
+}
+
+static bool starts_with(const std::string& s, const char* prefix) {
+    return s.compare(0, strlen(prefix), prefix) == 0;
+}
+
+// Sum of the EXTINF durations of a media playlist.
+static long long playlist_duration_ms(const std::vector<std::string>& lines) {
+    double seconds = 0;
+    for (const auto& line : lines) {
+        if (starts_with(line, "#EXTINF:")) seconds += std::atof(line.c_str() + 8);
+    }
+    return (long long)(seconds * 1000);
+}
+
+// The media playlist of a master playlist, chosen with `policy`. Empty if no rendition fits.
+static std::string select_rendition(const std::vector<std::string>& lines, const std::string& base,
+                                    const QualityPolicy& policy) {
+    std::set<std::string> separate_audio;
+    for (const auto& line : lines) {
+        if (!starts_with(line, "#EXT-X-MEDIA:")) continue;
+        auto attrs = parse_attributes(line.substr(13));
+        if (attrs["TYPE"] == "AUDIO" && !attrs["URI"].empty()) separate_audio.insert(attrs["GROUP-ID"]);
+    }
+
+    std::vector<VideoVariant> renditions;
+    for (size_t i = 0; i + 1 < lines.size(); ++i) {
+        if (!starts_with(lines[i], "#EXT-X-STREAM-INF:") || lines[i + 1][0] == '#') continue;
+        auto attrs = parse_attributes(lines[i].substr(18));
+        if (separate_audio.count(attrs["AUDIO"])) {
+            log_debug("[hls] Skipping " + lines[i + 1] + ": its audio is a separate stream.");
+            continue;
+        }
+        VideoVariant v;
+        v.name = lines[i + 1];
+        v.url = resolve_uri(base, lines[i + 1]);
+        v.bitrate = std::atoll(attrs["BANDWIDTH"].c_str());
+        sscanf(attrs["RESOLUTION"].c_str(), "%dx%d", &v.width, &v.height);
+        renditions.push_back(v);
+    }
+    // The master playlist gives no duration. For a byte budget it is read from the first
+    // media playlist (the renditions of a stream share it), and BANDWIDTH times it is
+    // the estimate: BANDWIDTH is the peak rate, so the estimate errs on the large side.
+    if (policy.kind == QualityPolicy::MAX_BYTES && !renditions.empty()) {
+        std::string final_url;
+        long long duration_ms = playlist_duration_ms(playlist_lines(fetch_url(renditions[0].url, final_url)));
+        for (auto& v : renditions) v.duration_ms = duration_ms;
+    }
+    int chosen = select_variant(renditions, policy, false);
+    if (chosen < 0) return "";
+    const VideoVariant& v = renditions[chosen];
+    log_debug("[hls] Rendition " + std::to_string(v.width) + "x" + std::to_string(v.height) + ", " +
+              std::to_string(v.bitrate) + " bit/s: " + v.url);
+    return v.url;
+}
+
+// The segment URLs of a media playlist, the init segment first if there is one.
+// False for the features this downloader does not handle.
+static bool parse_media_playlist(const std::vector<std::string>& lines, const std::string& base,
+                                 std::vector<std::string>& segments) {
+    bool next_is_segment = false;
+    for (const auto& line : lines) {
+        if (starts_with(line, "#EXT-X-KEY:")) {
+            if (parse_attributes(line.substr(11))["METHOD"] != "NONE") {
+                log_error("Encrypted HLS streams are not supported.");
+                return false;
+            }
+        } else if (starts_with(line, "#EXT-X-BYTERANGE:")) {
+            log_error("Byte-range HLS playlists are not supported.");
+            return false;
+        } else if (starts_with(line, "#EXT-X-MAP:")) {
+            auto attrs = parse_attributes(line.substr(11));
+            if (!segments.empty() || attrs.count("BYTERANGE")) {
+                log_error("Unsupported EXT-X-MAP in the playlist.");
+                return false;
+            }
+            segments.push_back(resolve_uri(base, attrs["URI"]));
+        } else if (starts_with(line, "#EXTINF:")) {
+            next_is_segment = true;
+        } else if (line[0] != '#' && next_is_segment) {
+            segments.push_back(resolve_uri(base, line));
+            next_is_segment = false;
+        }
+    }
+    return !segments.empty();
+}
+
+// Segments fetched by the workers and written in order by the calling thread.
+struct SegmentQueue {
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::vector<std::string> data;
+    std::vector<char> done;
+    size_t next = 0;      // Next segment a worker takes
+    size_t written = 0;   // Segments in the file
+    bool failed = false;
+};
+
+static bool fetch_segment(const std::string& url, std::string& data) {
+    for (int attempt = 0; attempt < SEGMENT_ATTEMPTS; ++attempt) {
+        data.clear();
+        if (download_to_sink(url, [&](const char* p, size_t len) { data.append(p, len); return true; })) return true;
+        log_debug("[hls] Segment failed: " + url + (attempt + 1 < SEGMENT_ATTEMPTS ? ". Retrying." : "."));
+    }
+    return false;
+}
+
+bool download_hls(const std::string& playlist_url, const std::string& output_path, const DownloadOptions& options,
+                  const QualityPolicy& policy, DownloadStats* stats) {
+    log_normal("[downloader] Destination: " + output_path);
+    Span span("hls");
+    span.arg("url", playlist_url);
+
+    std::string url = playlist_url, final_url;
+    std::string text = fetch_url(url, final_url);
+    std::vector<std::string> lines = playlist_lines(text);
+    if (lines.empty() || lines[0] != "#EXTM3U") {
+        log_error("Not an HLS playlist: " + playlist_url);
+        return false;
+    }
+    bool master = std::any_of(lines.begin(), lines.end(), [](const std::string& l) {
+        return starts_with(l, "#EXT-X-STREAM-INF:");
+    });
+    if (master) {
+        url = select_rendition(lines, final_url, policy);
+        if (url.empty()) {
+            log_error("No rendition of " + playlist_url + " can be downloaded.");
+            return false;
+        }
+        lines = playlist_lines(fetch_url(url, final_url));
+    }
+    std::vector<std::string> segments;
+    if (!parse_media_playlist(lines, final_url, segments)) return false;
+
+    const std::string part_path = output_path + ".part";
+    // A .part.meta left by an interrupted progressive download does not describe this file.
+    unlink((part_path + ".meta").c_str());
+    int fd = open(part_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+
+    size_t parallel = std::min(segments.size(), (size_t)std::max(4, options.segments));
+    size_t window = parallel * WINDOW_PER_WORKER;
+    log_debug("[hls] " + std::to_string(segments.size()) + " segments, " + std::to_string(parallel) + " at a time.");
+
+    SegmentQueue q;
+    q.data.resize(segments.size());
+    q.done.resize(segments.size(), 0);
+    std::shared_ptr<Trace> trace = current_trace_shared();
+    std::vector<std::thread> workers;
+    for (size_t w = 0; w < parallel; ++w) {
+        workers.emplace_back([&] {
+            TraceScope scope(trace);
+            while (true) {
+                size_t i;
+                {
+                    std::unique_lock<std::mutex> lock(q.mtx);
+                    q.cv.wait(lock, [&] { return q.failed || q.next >= segments.size() || q.next < q.written + window; });
+                    if (q.failed || q.next >= segments.size()) return;
+                    i = q.next++;
+                }
+                std::string data;
+                bool ok = fetch_segment(segments[i], data);
+                std::lock_guard<std::mutex> lock(q.mtx);
+                if (ok) {
+                    q.data[i] = std::move(data);
+                    q.done[i] = 1;
+                } else {
+                    q.failed = true;
+                }
+                q.cv.notify_all();
+            }
+        });
+    }
+
+    long long bytes = 0;
+    bool write_failed = false;
+    for (size_t i = 0; i < segments.size(); ++i) {
+        std::string data;
+        {
+            std::unique_lock<std::mutex> lock(q.mtx);
+            q.cv.wait(lock, [&] { return q.failed || q.done[i]; });
+            if (!q.done[i]) break;
+            data = std::move(q.data[i]);
+        }
+        if (timed_pwrite(fd, data.data(), data.size(), bytes) != (ssize_t)data.size()) write_failed = true;
+        bytes += data.size();
+        {
+            std::lock_guard<std::mutex> lock(q.mtx);
+            q.written = i + 1;
+            if (write_failed) q.failed = true;
+        }
+        q.cv.notify_all();
+        if (write_failed) break;
+        if (options.progress) options.progress(bytes, -1);
+    }
+    for (auto& t : workers) t.join();
+    close(fd);
+
+    span.arg("bytes", bytes);
+    span.arg("segments", (long long)segments.size());
+    if (stats) {
+        stats->bytes = bytes;
+        stats->segments = (int)segments.size();
+    }
+    if (q.failed || q.written != segments.size()) {
+        log_error(write_failed ? "Failed to write " + part_path + "." : "[hls] A segment could not be downloaded.");
+        unlink(part_path.c_str());
+        return false;
+    }
+    if (rename(part_path.c_str(), output_path.c_str()) != 0) return false;
+    if (stats) stats->status_code = 200;
+    return true;
+}
@@ -0,0 +1,22 @@
+#ifndef HLS_H
+#define HLS_H
+
+#include <string>
+#include "http_client.h"
+#include "quality.h"
+
+// True if `url` names an HLS playlist (.m3u8).
+bool is_hls_url(const std::string& url);
+
+// Downloads the HLS stream at `playlist_url` to `output_path`. A master playlist is narrowed
+// to one rendition with `policy` (renditions whose audio is a separate stream are skipped:
+// there is nothing here to mux it back in); for a byte budget a rendition's size is estimated
+// from its BANDWIDTH and the duration of the media playlist. The media segments are fetched in parallel over
+// pooled connections, max(4, options.segments) at a time, and appended to the file in
+// playlist order, after the EXT-X-MAP init segment if there is one. MPEG-TS segments are
+// concatenated as they are. Encrypted and byte-range playlists are not supported.
+// An interrupted download starts over: there is no resuming across runs.
+bool download_hls(const std::string& playlist_url, const std::string& output_path, const DownloadOptions& options,
+                  const QualityPolicy& policy, DownloadStats* stats = nullptr);
+
+#endif
@@ -0,0 +1,139 @@
+#include "host_limiter.h"
+#include "logger.h"
+#include "trace.h"
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <random>
+
+// A response this much slower than the baseline (and at least LATENCY_SLACK slower) counts
+// as the host queueing our requests.
+static const double LATENCY_FACTOR = 2.0;
+static const double LATENCY_SLACK = 0.05;
+
+// Longest Retry-After pause honoured; hosts asking for more are not waited for.
+static const double MAX_PAUSE = 60;
+
+void HostLimiter::set_max(int max) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    max_ = std::max(1, max);
+}
+
+void HostLimiter::acquire(const std::string& host) {
+    std::unique_lock<std::mutex> lock(mtx_);
+    Host& h = hosts_[host];
+    ++h.waiting;
+    while (true) {
+        auto now = Clock::now();
+        if (now < h.paused_until) {
+            cv_.wait_until(lock, h.paused_until);
+        } else if (h.in_flight >= (int)std::min<double>(h.limit, max_)) {
+            cv_.wait(lock);
+        } else {
+            break;
+        }
+    }
+    --h.waiting;
+    ++h.in_flight;
+    h.last_used = Clock::now();
+}
+
+void HostLimiter::release(const std::string& host, int status, double latency_s, double retry_after_s) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    Host& h = hosts_[host];
+    --h.in_flight;
+    h.last_used = Clock::now();
+    cv_.notify_all();
+    if (status == 0) return;
+
+    if (is_overload_status(status)) {
+        if (retry_after_s > 0) {
+            auto until = Clock::now() + std::chrono::duration_cast<Clock::duration>(
+                                            std::chrono::duration<double>(std::min(retry_after_s, MAX_PAUSE)));
+            h.paused_until = std::max(h.paused_until, until);
+        }
+        decrease(h, host, 0.5, "HTTP " + std::to_string(status));
+        return;
+    }
+
+    if (h.baseline_s == 0 || latency_s < h.baseline_s) {
+        h.baseline_s = latency_s;
+    } else {
+        // Drift up slowly, so a host that got slower for good becomes the new normal.
+        h.baseline_s += (latency_s - h.baseline_s) * 0.02;
+    }
+    if (latency_s > h.baseline_s * LATENCY_FACTOR && latency_s - h.baseline_s > LATENCY_SLACK) {
+        char why[64];
+        snprintf(why, sizeof(why), "latency %.0f ms, usually %.0f ms", latency_s * 1000, h.baseline_s * 1000);
+        decrease(h, host, 0.9, why);
+        return;
+    }
+
+    // One more slot per full window of responses; one per response during slow start.
+    if (h.limit < max_) h.limit = std::min<double>(max_, h.limit + (h.slow_start ? 1 : 1 / h.limit));
+}
+
+void HostLimiter::expire(std::chrono::steady_clock::duration idle) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto now = Clock::now();
+    for (auto it = hosts_.begin(); it != hosts_.end();) {
+        const Host& h = it->second;
+        bool idle_host = h.in_flight == 0 && h.waiting == 0 && now >= h.paused_until && now - h.last_used >= idle;
+        it = idle_host ? hosts_.erase(it) : std::next(it);
+    }
+}
+
+void HostLimiter::decrease(Host& h, const std::string& host, double factor, const std::string& why) {
+    // The responses to requests sent before the last cut carry the same signal; one
+    // cut per round trip is enough.
+    auto now = Clock::now();
+    auto window = std::chrono::duration<double>(std::max(2 * h.baseline_s, 0.5));
+    if (now - h.last_decrease < window) return;
+    h.last_decrease = now;
+    h.slow_start = false;
+    h.limit = std::max(1.0, h.limit * factor);
+    trace_count("throttled");
+    log_debug("[http] " + host + ": " + why + ". Limiting to " + std::to_string((int)h.limit) +
+              " requests in flight.");
+}
+
+HostPermit::HostPermit(HostLimiter& limiter, const std::string& host) : limiter_(limiter), host_(host) {
+    Span span("queue");
+    limiter_.acquire(host_);
+    start_ = std::chrono::steady_clock::now();
+}
+
+HostPermit::~HostPermit() {
+    limiter_.release(host_, status_, latency_s_, retry_after_s_);
+}
+
+void HostPermit::sent() {
+    start_ = std::chrono::steady_clock::now();
+}
+
+void HostPermit::response(int status, double retry_after_s) {
+    status_ = status;
+    retry_after_s_ = retry_after_s;
+    latency_s_ = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+}
+
+bool is_overload_status(int status) {
+    return status == 429 || status == 502 || status == 503 || status == 504;
+}
+
+double parse_retry_after(const std::string& value) {
+    if (value.empty()) return 0;
+    if (value.find_first_not_of("0123456789 ") == std::string::npos) return std::atof(value.c_str());
+
+    // "Sun, 06 Nov 1994 08:49:37 GMT"
+    struct tm tm = {};
+    if (!strptime(value.c_str(), "%a, %d %b %Y %H:%M:%S", &tm)) return 0;
+    double delay = difftime(timegm(&tm), time(nullptr));
+    return delay > 0 ? delay : 0;
+}
+
+double backoff_delay(int attempt) {
+    static thread_local std::mt19937 gen(std::random_device{}());
+    double delay = std::min(30.0, 0.5 * (1 << std::min(attempt, 6)));
+    return delay / 2 + std::uniform_real_distribution<double>(0, delay / 2)(gen);
+}
@@ -0,0 +1,90 @@
+#ifndef HOST_LIMITER_H
+#define HOST_LIMITER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+
+// Adaptive limit on the requests in flight to each host. The limit grows while responses
+// come back quickly (doubling per round trip at first, then by one per round trip) and is
+// cut when the host pushes back: halved on 429 and 5xx overload responses, reduced by a
+// tenth when the time to first byte climbs well above the host's usual latency. A
+// Retry-After pauses every request to the host until it has passed.
+// So the request rate settles near the highest one the host tolerates, whatever the
+// number of workers. Safe to call from several threads.
+class HostLimiter {
+public:
+    // Upper bound for every host. Default 32.
+    void set_max(int max);
+
+    // Waits until `host` is not paused and has a free slot.
+    void acquire(const std::string& host);
+
+    // Frees the slot. `status` is 0 if no response arrived, in which case the limit is
+    // left alone; `latency_s` is the time from writing the request to the response head.
+    void release(const std::string& host, int status, double latency_s, double retry_after_s);
+
+    // Forgets the hosts nothing was sent to for `idle`, so a long-running process does not
+    // keep every host it ever saw. A forgotten host starts over at the initial limit.
+    void expire(std::chrono::steady_clock::duration idle);
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Host {
+        double limit = 4;
+        int in_flight = 0;
+        int waiting = 0;           // Threads in acquire()
+        bool slow_start = true;    // Until the first sign of overload
+        double baseline_s = 0;     // Usual time to first byte, tracking the fastest responses
+        Clock::time_point paused_until;
+        Clock::time_point last_decrease;
+        Clock::time_point last_used;
+    };
+
+    void decrease(Host& h, const std::string& host, double factor, const std::string& why);
+
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::map<std::string, Host> hosts_;
+    int max_ = 32;
+};
+
+// Holds a slot of `limiter` for one request. Call sent() once the request is written and
+// response() once the response head has arrived; the slot itself is held until the permit
+// is destroyed, i.e. the body is read.
+class HostPermit {
+public:
+    HostPermit(HostLimiter& limiter, const std::string& host);
+    ~HostPermit();
+    HostPermit(const HostPermit&) = delete;
+    HostPermit& operator=(const HostPermit&) = delete;
+
+    // Starts the latency clock, so connecting and waiting for a pooled connection do not
+    // count as the host being slow.
+    void sent();
+    void response(int status, double retry_after_s);
+
+private:
+    HostLimiter& limiter_;
+    std::string host_;
+    std::chrono::steady_clock::time_point start_;
+    int status_ = 0;
+    double latency_s_ = 0;
+    double retry_after_s_ = 0;
+};
+
+// 429 and the 5xx statuses that mean "busy, try again later".
+bool is_overload_status(int status);
+
+// Seconds to wait from a Retry-After value, either delta-seconds or an HTTP date.
+// 0 when the header is missing or cannot be parsed.
+double parse_retry_after(const std::string& value);
+
+// Delay before retry number `attempt` (0 for the first): exponential from 0.5 s, capped
+// at 30 s, half of it random so clients that failed together do not retry together.
+double backoff_delay(int attempt);
+
+#endif
@@ -0,0 +1,217 @@
+#include "hpack.h"
+#include <cstdint>
+
+static const std::pair<const char*, const char*> STATIC_TABLE[] = {
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"}, {":path", "/index.html"},
+    {":scheme", "http"}, {":scheme", "https"}, {":status", "200"}, {":status", "204"}, {":status", "206"},
+    {":status", "304"}, {":status", "400"}, {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"}, {"accept-language", ""}, {"accept-ranges", ""}, {"accept", ""},
+    {"access-control-allow-origin", ""}, {"age", ""}, {"allow", ""}, {"authorization", ""},
+    {"cache-control", ""}, {"content-disposition", ""}, {"content-encoding", ""}, {"content-language", ""},
+    {"content-length", ""}, {"content-location", ""}, {"content-range", ""}, {"content-type", ""},
+    {"cookie", ""}, {"date", ""}, {"etag", ""}, {"expect", ""}, {"expires", ""}, {"from", ""}, {"host", ""},
+    {"if-match", ""}, {"if-modified-since", ""}, {"if-none-match", ""}, {"if-range", ""},
+    {"if-unmodified-since", ""}, {"last-modified", ""}, {"link", ""}, {"location", ""}, {"max-forwards", ""},
+    {"proxy-authenticate", ""}, {"proxy-authorization", ""}, {"range", ""}, {"referer", ""}, {"refresh", ""},
+    {"retry-after", ""}, {"server", ""}, {"set-cookie", ""}, {"strict-transport-security", ""},
+    {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""}, {"via", ""}, {"www-authenticate", ""},
+};
+static const size_t STATIC_TABLE_SIZE = sizeof(STATIC_TABLE) / sizeof(STATIC_TABLE[0]);
+
+// Code lengths of the HPACK Huffman code (RFC 7541 Appendix B) for symbols 0-255 and EOS.
+// The code is canonical, so the codes themselves follow from the lengths.
+static const unsigned char HUFFMAN_LENGTHS[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6, 5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5, 6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23, 24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23, 21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25, 19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23, 26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+static const int HUFFMAN_EOS = 256;
+
+struct HuffmanTable {
+    uint32_t first[31] = {};   // First code of each length
+    int count[31] = {};        // Number of codes of each length
+    int offset[31] = {};       // Index of the first symbol of each length in `symbols`
+    int symbols[257] = {};     // Symbols ordered by (length, value)
+
+    HuffmanTable() {
+        for (int s = 0; s < 257; ++s) ++count[HUFFMAN_LENGTHS[s]];
+        uint32_t code = 0;
+        int index = 0;
+        for (int len = 1; len <= 30; ++len) {
+            first[len] = code;
+            offset[len] = index;
+            for (int s = 0; s < 257; ++s) {
+                if (HUFFMAN_LENGTHS[s] == len) symbols[index++] = s;
+            }
+            code = (code + count[len]) << 1;
+        }
+    }
+};
+
+static bool huffman_decode(const unsigned char* data, size_t len, std::string& out) {
+    static const HuffmanTable table;
+    uint32_t code = 0;
+    int bits = 0;
+    for (size_t i = 0; i < len; ++i) {
+        for (int b = 7; b >= 0; --b) {
+            code = (code << 1) | ((data[i] >> b) & 1);
+            ++bits;
+            if (bits > 30) return false;
+            if (code - table.first[bits] < (uint32_t)table.count[bits]) {
+                int sym = table.symbols[table.offset[bits] + (code - table.first[bits])];
+                if (sym == HUFFMAN_EOS) return false;
+                out += (char)sym;
+                code = 0;
+                bits = 0;
+            }
+        }
+    }
+    // Padding must be a prefix of EOS (all ones) and shorter than a byte.
+    return bits < 8 && code == (1u << bits) - 1;
+}
+
+static bool decode_int(const std::string& in, size_t& pos, int prefix_bits, uint64_t& value) {
+    if (pos >= in.size()) return false;
+    uint64_t mask = (1u << prefix_bits) - 1;
+    value = (unsigned char)in[pos++] & mask;
+    if (value < mask) return true;
+    int shift = 0;
+    while (true) {
+        if (pos >= in.size() || shift > 56) return false;
+        unsigned char byte = in[pos++];
+        value += (uint64_t)(byte & 0x7f) << shift;
+        shift += 7;
+        if (!(byte & 0x80)) return true;
+    }
+}
+
+static bool decode_string(const std::string& in, size_t& pos, std::string& out) {
+    if (pos >= in.size()) return false;
+    bool huffman = (unsigned char)in[pos] & 0x80;
+    uint64_t len;
+    if (!decode_int(in, pos, 7, len) || len > in.size() - pos) return false;
+    if (huffman) {
+        if (!huffman_decode((const unsigned char*)in.data() + pos, len, out)) return false;
+    } else {
+        out.assign(in, pos, len);
+    }
+    pos += len;
+    return true;
+}
+
+static void encode_int(std::string& out, unsigned char flags, int prefix_bits, uint64_t value) {
+    uint64_t mask = (1u << prefix_bits) - 1;
+    if (value < mask) {
+        out += (char)(flags | value);
+        return;
+    }
+    out += (char)(flags | mask);
+    value -= mask;
+    while (value >= 128) {
+        out += (char)(0x80 | (value & 0x7f));
+        value >>= 7;
+    }
+    out += (char)value;
+}
+
+static void encode_string(std::string& out, const std::string& s) {
+    encode_int(out, 0x00, 7, s.size());
+    out += s;
+}
+
+void HpackEncoder::encode(const HeaderList& headers, std::string& out) const {
+    for (const auto& h : headers) {
+        size_t name_index = 0;
+        size_t full_index = 0;
+        for (size_t i = 0; i < STATIC_TABLE_SIZE; ++i) {
+            if (h.first != STATIC_TABLE[i].first) continue;
+            if (!name_index) name_index = i + 1;
+            if (h.second == STATIC_TABLE[i].second) { full_index = i + 1; break; }
+        }
+
+        if (full_index) {
+            encode_int(out, 0x80, 7, full_index);
+        } else if (name_index) {
+            encode_int(out, 0x00, 4, name_index);
+            encode_string(out, h.second);
+        } else {
+            out += (char)0x00;
+            encode_string(out, h.first);
+            encode_string(out, h.second);
+        }
+    }
+}
+
+bool HpackDecoder::lookup(size_t index, std::pair<std::string, std::string>& entry) const {
+    if (index == 0) return false;
+    if (index <= STATIC_TABLE_SIZE) {
+        entry = {STATIC_TABLE[index - 1].first, STATIC_TABLE[index - 1].second};
+        return true;
+    }
+    index -= STATIC_TABLE_SIZE + 1;
+    if (index >= dynamic_.size()) return false;
+    entry = dynamic_[index];
+    return true;
+}
+
+void HpackDecoder::evict() {
+    while (size_ > capacity_ && !dynamic_.empty()) {
+        size_ -= dynamic_.back().first.size() + dynamic_.back().second.size() + 32;
+        dynamic_.pop_back();
+    }
+}
+
+void HpackDecoder::insert(const std::pair<std::string, std::string>& entry) {
+    size_t entry_size = entry.first.size() + entry.second.size() + 32;
+    if (entry_size > capacity_) {
+        dynamic_.clear();
+        size_ = 0;
+        return;
+    }
+    dynamic_.push_front(entry);
+    size_ += entry_size;
+    evict();
+}
+
+bool HpackDecoder::decode(const std::string& block, HeaderList& out) {
+    size_t pos = 0;
+    while (pos < block.size()) {
+        unsigned char byte = block[pos];
+        uint64_t index;
+        std::pair<std::string, std::string> entry;
+
+        if (byte & 0x80) {
+            // Indexed header field
+            if (!decode_int(block, pos, 7, index) || !lookup(index, entry)) return false;
+            out.push_back(entry);
+        } else if ((byte & 0xe0) == 0x20) {
+            // Dynamic table size update
+            uint64_t new_size;
+            if (!decode_int(block, pos, 5, new_size) || new_size > max_size_) return false;
+            capacity_ = new_size;
+            evict();
+        } else {
+            // Literal: with incremental indexing (01), without indexing (0000) or never indexed (0001)
+            bool indexing = (byte & 0xc0) == 0x40;
+            int prefix = indexing ? 6 : 4;
+            if (!decode_int(block, pos, prefix, index)) return false;
+            if (index) {
+                if (!lookup(index, entry)) return false;
+                entry.second.clear();
+            } else if (!decode_string(block, pos, entry.first)) {
+                return false;
+            }
+            if (!decode_string(block, pos, entry.second)) return false;
+            if (indexing) insert(entry);
+            out.push_back(entry);
+        }
+    }
+    return true;
+}
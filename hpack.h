@@ -0,0 +1,39 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <utility>
+
+using HeaderList = std::vector<std::pair<std::string, std::string>>;
+
+// HPACK (RFC 7541) header compression for HTTP/2.
+// The encoder only emits literals without indexing, so it never touches the peer's
+// dynamic table. The decoder implements the full format, including Huffman strings.
+class HpackEncoder {
+public:
+    // Appends the encoded block to `out`. Names must be lowercase.
+    void encode(const HeaderList& headers, std::string& out) const;
+};
+
+class HpackDecoder {
+public:
+    explicit HpackDecoder(size_t max_table_size = 4096) : max_size_(max_table_size), capacity_(max_table_size) {}
+
+    // Decodes one complete header block. Returns false on a compression error,
+    // which is fatal for the whole connection.
+    bool decode(const std::string& block, HeaderList& out);
+
+private:
+    bool lookup(size_t index, std::pair<std::string, std::string>& entry) const;
+    void insert(const std::pair<std::string, std::string>& entry);
+    void evict();
+
+    size_t max_size_;
+    size_t capacity_;
+    size_t size_ = 0;
+    std::deque<std::pair<std::string, std::string>> dynamic_;
+};
+
+#endif
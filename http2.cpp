@@ -0,0 +1,502 @@
+#include "http2.h"
+#include "http_internal.h"
+#include "logger.h"
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+
+enum FrameType : uint8_t {
+    FRAME_DATA = 0x0,
+    FRAME_HEADERS = 0x1,
+    FRAME_PRIORITY = 0x2,
+    FRAME_RST_STREAM = 0x3,
+    FRAME_SETTINGS = 0x4,
+    FRAME_PUSH_PROMISE = 0x5,
+    FRAME_PING = 0x6,
+    FRAME_GOAWAY = 0x7,
+    FRAME_WINDOW_UPDATE = 0x8,
+    FRAME_CONTINUATION = 0x9,
+};
+
+static const uint8_t FLAG_END_STREAM = 0x1;
+static const uint8_t FLAG_ACK = 0x1;
+static const uint8_t FLAG_END_HEADERS = 0x4;
+static const uint8_t FLAG_PADDED = 0x8;
+static const uint8_t FLAG_PRIORITY = 0x20;
+
+static const uint16_t SETTINGS_ENABLE_PUSH = 0x2;
+static const uint16_t SETTINGS_MAX_CONCURRENT_STREAMS = 0x3;
+static const uint16_t SETTINGS_INITIAL_WINDOW_SIZE = 0x4;
+
+static const uint32_t ERROR_PROTOCOL = 0x1;
+static const uint32_t ERROR_CANCEL = 0x8;
+static const uint32_t ERROR_COMPRESSION = 0x9;
+
+// Receive windows. Large enough that a single stream is never limited by flow control
+// on a fast link; they are refilled as the caller consumes data.
+static const uint32_t STREAM_WINDOW = 16 << 20;
+static const uint32_t CONNECTION_WINDOW = 64 << 20;
+static const uint32_t DEFAULT_WINDOW = 65535;
+
+// Same idle limit as the SO_RCVTIMEO of HTTP/1.1 connections.
+static const auto READ_TIMEOUT = std::chrono::seconds(10);
+
+static void put_u32(std::string& out, uint32_t v) {
+    out += (char)(v >> 24);
+    out += (char)(v >> 16);
+    out += (char)(v >> 8);
+    out += (char)v;
+}
+
+static uint32_t get_u32(const std::string& in, size_t pos) {
+    return ((uint32_t)(unsigned char)in[pos] << 24) | ((uint32_t)(unsigned char)in[pos + 1] << 16) |
+           ((uint32_t)(unsigned char)in[pos + 2] << 8) | (uint32_t)(unsigned char)in[pos + 3];
+}
+
+static void put_setting(std::string& out, uint16_t id, uint32_t value) {
+    out += (char)(id >> 8);
+    out += (char)id;
+    put_u32(out, value);
+}
+
+HeaderList h2_header_list(const std::string& header_lines) {
+    HeaderList headers;
+    size_t pos = 0;
+    while (pos < header_lines.size()) {
+        size_t eol = header_lines.find("\r\n", pos);
+        if (eol == std::string::npos) eol = header_lines.size();
+        std::string line = header_lines.substr(pos, eol - pos);
+        pos = eol + 2;
+
+        size_t colon = line.find(':');
+        if (colon == std::string::npos) continue;
+        std::string name = to_lower(line.substr(0, colon));
+        size_t val_start = line.find_first_not_of(' ', colon + 1);
+        std::string value = (val_start == std::string::npos) ? "" : line.substr(val_start);
+        if (name == "connection" || name == "keep-alive" || name == "host" || name == "transfer-encoding") continue;
+        headers.emplace_back(name, value);
+    }
+    return headers;
+}
+
+H2Connection::H2Connection(std::unique_ptr<Connection> conn) : conn_(std::move(conn)) {}
+
+H2Connection::~H2Connection() {
+    stop_ = true;
+    if (reader_.joinable()) reader_.join();
+}
+
+bool H2Connection::start() {
+    int flags = fcntl(conn_->socket_fd, F_GETFL, 0);
+    fcntl(conn_->socket_fd, F_SETFL, flags | O_NONBLOCK);
+
+    std::string settings;
+    put_setting(settings, SETTINGS_ENABLE_PUSH, 0);
+    put_setting(settings, SETTINGS_INITIAL_WINDOW_SIZE, STREAM_WINDOW);
+    std::string window;
+    put_u32(window, CONNECTION_WINDOW - DEFAULT_WINDOW);
+
+    if (!write_all("PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n") ||
+        !write_frame(FRAME_SETTINGS, 0, 0, settings) ||
+        !write_frame(FRAME_WINDOW_UPDATE, 0, 0, window)) {
+        return false;
+    }
+
+    reader_ = std::thread(&H2Connection::reader_loop, this);
+    return true;
+}
+
+bool H2Connection::usable() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return !dead_ && !goaway_ && next_stream_id_ < 0x7fffffff;
+}
+
+double H2Connection::idle_seconds() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (!streams_.empty()) return 0;
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - idle_since_).count();
+}
+
+bool H2Connection::write_all(const std::string& data) {
+    std::lock_guard<std::mutex> lock(io_mtx_);
+    size_t pos = 0;
+    while (pos < data.size()) {
+        int n = SSL_write(conn_->ssl, data.data() + pos, data.size() - pos);
+        if (n > 0) {
+            pos += n;
+            continue;
+        }
+        int err = SSL_get_error(conn_->ssl, n);
+        if (err != SSL_ERROR_WANT_WRITE && err != SSL_ERROR_WANT_READ) return false;
+        pollfd p = {conn_->socket_fd, (short)(err == SSL_ERROR_WANT_WRITE ? POLLOUT : POLLIN), 0};
+        if (poll(&p, 1, 10000) <= 0) return false;
+    }
+    return true;
+}
+
+bool H2Connection::write_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const std::string& payload) {
+    std::string frame;
+    frame.reserve(9 + payload.size());
+    frame += (char)(payload.size() >> 16);
+    frame += (char)(payload.size() >> 8);
+    frame += (char)payload.size();
+    frame += (char)type;
+    frame += (char)flags;
+    put_u32(frame, stream_id & 0x7fffffff);
+    frame += payload;
+    return write_all(frame);
+}
+
+void H2Connection::send_window_update(uint32_t stream_id, uint32_t increment) {
+    std::string payload;
+    put_u32(payload, increment);
+    write_frame(FRAME_WINDOW_UPDATE, 0, stream_id, payload);
+}
+
+void H2Connection::fail_all(const std::string& reason) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (!dead_) log_debug("[http2] Connection to " + conn_->host + " lost: " + reason);
+    dead_ = true;
+    // A stream that got END_STREAM has its whole response buffered already.
+    for (auto& kv : streams_) {
+        if (!kv.second->ended) kv.second->failed = true;
+    }
+    cv_.notify_all();
+}
+
+std::shared_ptr<H2Stream> H2Connection::open_stream(const std::string& method, const std::string& authority,
+                                                    const std::string& path, const HeaderList& extra) {
+    HeaderList headers = {
+        {":method", method},
+        {":scheme", "https"},
+        {":authority", authority},
+        {":path", path},
+        {"user-agent", get_random_user_agent()},
+    };
+    headers.insert(headers.end(), extra.begin(), extra.end());
+    std::string block;
+    HpackEncoder().encode(headers, block);
+
+    auto stream = std::make_shared<H2Stream>();
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        if (!cv_.wait_for(lock, READ_TIMEOUT, [&] { return dead_ || goaway_ || streams_.size() < peer_max_streams_; })) return nullptr;
+    }
+
+    // Stream IDs must reach the wire in increasing order, so allocation and the HEADERS
+    // frame happen under the I/O lock.
+    std::lock_guard<std::mutex> io_lock(io_mtx_);
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (dead_ || goaway_ || next_stream_id_ >= 0x7fffffff) return nullptr;
+        stream->id = next_stream_id_;
+        next_stream_id_ += 2;
+        streams_[stream->id] = stream;
+    }
+
+    std::string frame;
+    frame += (char)(block.size() >> 16);
+    frame += (char)(block.size() >> 8);
+    frame += (char)block.size();
+    frame += (char)FRAME_HEADERS;
+    frame += (char)(FLAG_END_HEADERS | FLAG_END_STREAM);
+    put_u32(frame, stream->id);
+    frame += block;
+
+    size_t pos = 0;
+    while (pos < frame.size()) {
+        int n = SSL_write(conn_->ssl, frame.data() + pos, frame.size() - pos);
+        if (n > 0) {
+            pos += n;
+            continue;
+        }
+        int err = SSL_get_error(conn_->ssl, n);
+        pollfd p = {conn_->socket_fd, (short)(err == SSL_ERROR_WANT_WRITE ? POLLOUT : POLLIN), 0};
+        if ((err != SSL_ERROR_WANT_WRITE && err != SSL_ERROR_WANT_READ) || poll(&p, 1, 10000) <= 0) {
+            std::lock_guard<std::mutex> lock(mtx_);
+            dead_ = true;
+            streams_.erase(stream->id);
+            return nullptr;
+        }
+    }
+    return stream;
+}
+
+bool H2Connection::wait_headers(H2Stream& stream, HttpResponse& response) {
+    std::unique_lock<std::mutex> lock(mtx_);
+    cv_.wait_for(lock, READ_TIMEOUT, [&] { return stream.headers_done || stream.failed; });
+    if (!stream.headers_done || stream.failed) return false;
+    response = stream.response;
+    return true;
+}
+
+int H2Connection::read(H2Stream& stream, char* buf, int n) {
+    uint32_t stream_update = 0;
+    uint32_t conn_update = 0;
+    int copied = 0;
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        cv_.wait_for(lock, READ_TIMEOUT, [&] { return stream.data_pos < stream.data.size() || stream.ended || stream.failed; });
+        size_t avail = stream.data.size() - stream.data_pos;
+        if (avail == 0) return (stream.ended && !stream.failed) ? 0 : -1;
+
+        copied = (int)std::min<size_t>(avail, n);
+        memcpy(buf, stream.data.data() + stream.data_pos, copied);
+        stream.data_pos += copied;
+        if (stream.data_pos == stream.data.size()) {
+            stream.data.clear();
+            stream.data_pos = 0;
+        } else if (stream.data_pos > (1 << 20)) {
+            stream.data.erase(0, stream.data_pos);
+            stream.data_pos = 0;
+        }
+
+        stream.unacked += copied;
+        conn_unacked_ += copied;
+        if (!stream.ended && stream.unacked >= STREAM_WINDOW / 2) {
+            stream_update = stream.unacked;
+            stream.unacked = 0;
+        }
+        if (conn_unacked_ >= CONNECTION_WINDOW / 2) {
+            conn_update = conn_unacked_;
+            conn_unacked_ = 0;
+        }
+    }
+    if (stream_update) send_window_update(stream.id, stream_update);
+    if (conn_update) send_window_update(0, conn_update);
+    return copied;
+}
+
+void H2Connection::close_stream(H2Stream& stream) {
+    bool cancel = false;
+    uint32_t conn_update = 0;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (!streams_.erase(stream.id)) return;
+        if (streams_.empty()) idle_since_ = std::chrono::steady_clock::now();
+        cancel = !stream.ended && !stream.failed;
+        // Buffered but unread data still counts against the connection window.
+        conn_unacked_ += stream.data.size() - stream.data_pos;
+        if (conn_unacked_ >= CONNECTION_WINDOW / 2) {
+            conn_update = conn_unacked_;
+            conn_unacked_ = 0;
+        }
+        cv_.notify_all();
+    }
+    if (cancel) {
+        std::string payload;
+        put_u32(payload, ERROR_CANCEL);
+        write_frame(FRAME_RST_STREAM, 0, stream.id, payload);
+    }
+    if (conn_update) send_window_update(0, conn_update);
+}
+
+void H2Connection::reader_loop() {
+    std::string in;
+    char buf[16384];
+
+    while (!stop_) {
+        bool pending;
+        {
+            std::lock_guard<std::mutex> lock(io_mtx_);
+            pending = SSL_pending(conn_->ssl) > 0;
+        }
+        if (!pending) {
+            pollfd p = {conn_->socket_fd, POLLIN, 0};
+            int r = poll(&p, 1, 200);
+            if (r == 0 || (r < 0 && errno == EINTR)) continue;
+            if (r < 0) { fail_all("poll failed"); return; }
+        }
+
+        bool eof = false;
+        {
+            std::lock_guard<std::mutex> lock(io_mtx_);
+            while (true) {
+                int n = SSL_read(conn_->ssl, buf, sizeof(buf));
+                if (n > 0) {
+                    in.append(buf, n);
+                    continue;
+                }
+                int err = SSL_get_error(conn_->ssl, n);
+                if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) eof = true;
+                break;
+            }
+        }
+
+        size_t pos = 0;
+        while (in.size() - pos >= 9) {
+            uint32_t len = ((uint32_t)(unsigned char)in[pos] << 16) | ((uint32_t)(unsigned char)in[pos + 1] << 8) |
+                           (uint32_t)(unsigned char)in[pos + 2];
+            if (in.size() - pos < 9 + len) break;
+            uint8_t type = in[pos + 3];
+            uint8_t flags = in[pos + 4];
+            uint32_t stream_id = get_u32(in, pos + 5) & 0x7fffffff;
+            handle_frame(type, flags, stream_id, in.substr(pos + 9, len));
+            pos += 9 + len;
+        }
+        in.erase(0, pos);
+
+        if (eof) {
+            fail_all("connection closed");
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (dead_) return;
+    }
+}
+
+void H2Connection::handle_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const std::string& payload) {
+    if (continuation_stream_ && type != FRAME_CONTINUATION) {
+        fail_all("expected CONTINUATION frame");
+        return;
+    }
+
+    switch (type) {
+    case FRAME_DATA: {
+        size_t start = 0, end = payload.size();
+        if ((flags & FLAG_PADDED) && !payload.empty()) {
+            start = 1;
+            size_t pad = (unsigned char)payload[0];
+            end = (pad < payload.size()) ? payload.size() - pad : 1;
+        }
+        uint32_t conn_update = 0;
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            auto it = streams_.find(stream_id);
+            // Padding, and data for streams we already closed, are consumed immediately.
+            conn_unacked_ += payload.size() - (end - start);
+            if (it == streams_.end()) {
+                conn_unacked_ += end - start;
+            } else {
+                it->second->data.append(payload, start, end - start);
+                if (flags & FLAG_END_STREAM) it->second->ended = true;
+                cv_.notify_all();
+            }
+            if (conn_unacked_ >= CONNECTION_WINDOW / 2) {
+                conn_update = conn_unacked_;
+                conn_unacked_ = 0;
+            }
+        }
+        if (conn_update) send_window_update(0, conn_update);
+        break;
+    }
+    case FRAME_HEADERS: {
+        size_t start = 0, end = payload.size();
+        if (flags & FLAG_PADDED) {
+            if (payload.empty()) { fail_all("malformed HEADERS frame"); return; }
+            start = 1;
+            size_t pad = (unsigned char)payload[0];
+            if (pad >= payload.size()) { fail_all("malformed HEADERS frame"); return; }
+            end -= pad;
+        }
+        if (flags & FLAG_PRIORITY) start += 5;
+        if (start > end) { fail_all("malformed HEADERS frame"); return; }
+        header_block_.assign(payload, start, end - start);
+        if (flags & FLAG_END_HEADERS) {
+            handle_header_block(stream_id, flags & FLAG_END_STREAM);
+        } else {
+            continuation_stream_ = stream_id;
+            continuation_end_stream_ = flags & FLAG_END_STREAM;
+        }
+        break;
+    }
+    case FRAME_CONTINUATION:
+        if (stream_id != continuation_stream_) {
+            fail_all("unexpected CONTINUATION frame");
+            return;
+        }
+        header_block_ += payload;
+        if (flags & FLAG_END_HEADERS) {
+            continuation_stream_ = 0;
+            handle_header_block(stream_id, continuation_end_stream_);
+        }
+        break;
+    case FRAME_RST_STREAM: {
+        std::lock_guard<std::mutex> lock(mtx_);
+        auto it = streams_.find(stream_id);
+        if (it != streams_.end()) {
+            it->second->failed = true;
+            cv_.notify_all();
+        }
+        break;
+    }
+    case FRAME_SETTINGS:
+        if (flags & FLAG_ACK) break;
+        for (size_t i = 0; i + 6 <= payload.size(); i += 6) {
+            uint16_t id = ((unsigned char)payload[i] << 8) | (unsigned char)payload[i + 1];
+            uint32_t value = get_u32(payload, i + 2);
+            if (id == SETTINGS_MAX_CONCURRENT_STREAMS) {
+                std::lock_guard<std::mutex> lock(mtx_);
+                peer_max_streams_ = value;
+                cv_.notify_all();
+            }
+        }
+        write_frame(FRAME_SETTINGS, FLAG_ACK, 0, "");
+        break;
+    case FRAME_PING:
+        if (!(flags & FLAG_ACK)) write_frame(FRAME_PING, FLAG_ACK, 0, payload);
+        break;
+    case FRAME_GOAWAY: {
+        uint32_t last_stream = payload.size() >= 4 ? get_u32(payload, 0) & 0x7fffffff : 0;
+        std::lock_guard<std::mutex> lock(mtx_);
+        goaway_ = true;
+        for (auto& kv : streams_) {
+            if (kv.first > last_stream) kv.second->failed = true;
+        }
+        cv_.notify_all();
+        break;
+    }
+    case FRAME_PUSH_PROMISE: {
+        // Push is disabled in our SETTINGS, so receiving one is a protocol error.
+        std::string payload_out;
+        put_u32(payload_out, 0);
+        put_u32(payload_out, ERROR_PROTOCOL);
+        write_frame(FRAME_GOAWAY, 0, 0, payload_out);
+        fail_all("unexpected PUSH_PROMISE");
+        break;
+    }
+    default:
+        // PRIORITY, WINDOW_UPDATE (we never send DATA) and unknown extension frames.
+        break;
+    }
+}
+
+void H2Connection::handle_header_block(uint32_t stream_id, bool end_stream) {
+    // Every header block must go through the decoder to keep its dynamic table in sync,
+    // even for streams that were already closed.
+    HeaderList headers;
+    if (!decoder_.decode(header_block_, headers)) {
+        std::string payload;
+        put_u32(payload, 0);
+        put_u32(payload, ERROR_COMPRESSION);
+        write_frame(FRAME_GOAWAY, 0, 0, payload);
+        fail_all("header compression error");
+        return;
+    }
+    header_block_.clear();
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto it = streams_.find(stream_id);
+    if (it == streams_.end()) return;
+    H2Stream& stream = *it->second;
+
+    if (!stream.headers_done) {
+        int status = 0;
+        HttpResponse response;
+        for (const auto& h : headers) {
+            if (h.first == ":status") status = std::atoi(h.second.c_str());
+            else if (!h.first.empty() && h.first[0] != ':') response.headers[h.first] = h.second;
+        }
+        // Informational (1xx) responses are followed by the real one.
+        if (status >= 100 && status < 200) return;
+        response.status_code = status;
+        stream.response = response;
+        stream.headers_done = true;
+    }
+    if (end_stream) stream.ended = true;
+    cv_.notify_all();
+}
@@ -0,0 +1,99 @@
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include "hpack.h"
+#include "http_client.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+struct Connection;
+
+// One request/response exchange on an HTTP/2 connection.
+struct H2Stream {
+    uint32_t id = 0;
+    HttpResponse response;      // Status and headers, valid once `headers_done` is set
+    bool headers_done = false;
+    bool ended = false;         // END_STREAM received
+    bool failed = false;        // Reset by the server, refused after GOAWAY, or connection lost
+    std::string data;           // Received body bytes not yet consumed
+    size_t data_pos = 0;
+    uint32_t unacked = 0;       // Consumed bytes not yet returned to the server in a WINDOW_UPDATE
+};
+
+// A multiplexed HTTP/2 client connection (RFC 7540) over TLS negotiated with ALPN "h2".
+// Thread-safe: any number of threads can open and read streams concurrently. A reader
+// thread owns the socket's receive side and dispatches frames to the streams; writers
+// and the reader share the SSL object under one I/O lock.
+// Only bodiless requests (GET/HEAD) are supported, so the send-side flow-control window
+// is never consumed. The receive windows are large and refilled as the caller consumes
+// data, so a slow consumer throttles the server instead of growing the buffers.
+class H2Connection {
+public:
+    explicit H2Connection(std::unique_ptr<Connection> conn);
+    ~H2Connection();
+
+    // Sends the connection preface and SETTINGS, and starts the reader thread.
+    bool start();
+
+    // False once the connection failed, received GOAWAY or ran out of stream IDs.
+    bool usable();
+
+    // Seconds since the last stream was closed; 0 while a stream is open.
+    double idle_seconds();
+
+    // Sends a request. `extra` holds additional (lowercase) request headers.
+    std::shared_ptr<H2Stream> open_stream(const std::string& method, const std::string& authority,
+                                          const std::string& path, const HeaderList& extra = HeaderList());
+
+    // Blocks until the response headers arrive. False if the stream failed or timed out.
+    bool wait_headers(H2Stream& stream, HttpResponse& response);
+
+    // Reads up to `n` body bytes. Returns 0 at the end of the body and -1 on error or timeout.
+    int read(H2Stream& stream, char* buf, int n);
+
+    // Forgets the stream, cancelling it with RST_STREAM if the body was not fully received.
+    void close_stream(H2Stream& stream);
+
+private:
+    void reader_loop();
+    void handle_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const std::string& payload);
+    void handle_header_block(uint32_t stream_id, bool end_stream);
+    bool write_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const std::string& payload);
+    bool write_all(const std::string& data);
+    void send_window_update(uint32_t stream_id, uint32_t increment);
+    void fail_all(const std::string& reason);
+
+    std::unique_ptr<Connection> conn_;
+    std::thread reader_;
+    std::atomic<bool> stop_{false};
+
+    std::mutex io_mtx_;              // Guards the SSL object. Taken before mtx_ when both are needed.
+    std::mutex mtx_;                 // Guards everything below
+    std::condition_variable cv_;
+    std::map<uint32_t, std::shared_ptr<H2Stream>> streams_;
+    uint32_t next_stream_id_ = 1;
+    uint32_t peer_max_streams_ = 100;
+    uint32_t conn_unacked_ = 0;
+    bool dead_ = false;
+    bool goaway_ = false;
+    std::chrono::steady_clock::time_point idle_since_ = std::chrono::steady_clock::now();
+
+    // Touched only by the reader thread.
+    HpackDecoder decoder_;
+    std::string header_block_;
+    uint32_t continuation_stream_ = 0;
+    bool continuation_end_stream_ = false;
+};
+
+// Converts "Name: value\r\n" request header lines into an HTTP/2 header list,
+// lowercasing names and dropping connection-specific headers.
+HeaderList h2_header_list(const std::string& header_lines);
+
+#endif
@@ -1,20 +1,21 @@
 #include "http_client.h"
+#include "http_internal.h"
 #include "logger.h"
+#include "cache_dir.h"
+#include "content_decoder.h"
+#include "trace.h"
 #include <sstream>
 #include <vector>
-#include <fstream>
 #include <algorithm>
 #include <random>
-#include <cstring>
-#include <map>
-#include <memory>
-#include <sys/types.h>
-#include <sys/socket.h>
+#include <thread>
 #include <netdb.h>
-#include <unistd.h>
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
-#include <openssl/ssl.h>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <poll.h>
 #include <openssl/err.h>
 
 const std::vector<std::string> USER_AGENTS = {
@@ -29,184 +30,500 @@ std::string get_random_user_agent() {
     return ua; 
 }
 
-struct Connection {
-    int socket_fd = -1;
-    SSL* ssl = nullptr;
-    std::string host;
-    int port = 0;
-    bool is_closed = false;
+GlobalState g_state;
 
-    ~Connection() { close_conn(); }
+// getaddrinfo() does not expose record TTLs, so resolved addresses are trusted this long.
+static const long long DNS_TTL = 300;
 
-    void close_conn() {
-        if (ssl) { SSL_shutdown(ssl); SSL_free(ssl); ssl = nullptr; }
-        if (socket_fd != -1) { close(socket_fd); socket_fd = -1; }
-        is_closed = true;
+static std::string session_key(const std::string& host, SSL_SESSION* session) {
+    const unsigned char* alpn = nullptr;
+    size_t len = 0;
+    SSL_SESSION_get0_alpn_selected(session, &alpn, &len);
+    return len ? host + "/" + std::string((const char*)alpn, len) : host;
+}
+
+static int nosignal_write(BIO* bio, const char* data, int len) {
+    BIO_clear_retry_flags(bio);
+    ssize_t n = send(BIO_get_fd(bio, nullptr), data, len, MSG_NOSIGNAL);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) BIO_set_retry_write(bio);
+    return (int)n;
+}
+
+static long nosignal_ctrl(BIO* bio, int cmd, long num, void* ptr) {
+    switch (cmd) {
+        case BIO_C_SET_FD:
+            BIO_set_data(bio, (void*)(intptr_t)*(int*)ptr);
+            BIO_set_init(bio, 1);
+            return 1;
+        case BIO_C_GET_FD:
+            if (ptr) *(int*)ptr = (int)(intptr_t)BIO_get_data(bio);
+            return (int)(intptr_t)BIO_get_data(bio);
+        case BIO_CTRL_FLUSH:
+            return 1;
+        default:
+            (void)num;
+            return 0;
     }
-};
+}
 
-struct GlobalState {
-    SSL_CTX* ssl_ctx = nullptr;
-    std::map<std::string, std::unique_ptr<Connection>> pool;
-    std::map<std::string, std::string> dns_cache;
-    std::map<std::string, SSL_SESSION*> session_cache;
-
-    GlobalState() {
-        SSL_library_init();
-        ssl_ctx = SSL_CTX_new(TLS_client_method());
-        if (ssl_ctx) {
-            SSL_CTX_set_default_verify_paths(ssl_ctx);
-            SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_CLIENT);
-            SSL_CTX_set_mode(ssl_ctx, SSL_MODE_RELEASE_BUFFERS); 
+static const BIO_METHOD* nosignal_method() {
+    static BIO_METHOD* method = [] {
+        BIO_METHOD* m = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK | BIO_TYPE_DESCRIPTOR,
+                                     "socket, send() without SIGPIPE");
+        if (m) {
+            BIO_meth_set_write(m, nosignal_write);
+            BIO_meth_set_ctrl(m, nosignal_ctrl);
         }
+        return m;
+    }();
+    return method;
+}
+
+bool ssl_set_socket(SSL* ssl, int fd) {
+    const BIO_METHOD* method = nosignal_method();
+    BIO* rbio = BIO_new_socket(fd, BIO_NOCLOSE);
+    BIO* wbio = method ? BIO_new(method) : nullptr;
+    if (!rbio || !wbio) {
+        BIO_free(rbio);
+        BIO_free(wbio);
+        return false;
     }
+    BIO_set_fd(wbio, fd, BIO_NOCLOSE);
+    SSL_set_bio(ssl, rbio, wbio);
+    return true;
+}
+
+int on_new_session(SSL* ssl, SSL_SESSION* session) {
+    const char* host = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+    if (!host || !SSL_SESSION_is_resumable(session)) return 0;
+    g_state.store_session(session_key(host, session), session);
+    return 1;
+}
+
+void GlobalState::store_session(const std::string& host, SSL_SESSION* session) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (session_cache.count(host)) SSL_SESSION_free(session_cache[host]);
+    session_cache[host] = session;
+    persist_dirty = true;
+}
 
-    ~GlobalState() {
-        pool.clear();
-        for (auto& kv : session_cache) SSL_SESSION_free(kv.second);
-        if (ssl_ctx) SSL_CTX_free(ssl_ctx);
+void GlobalState::save_session(SSL* ssl, const std::string& host) {
+    if (!ssl) return;
+    SSL_SESSION* sess = SSL_get1_session(ssl);
+    if (!sess) return;
+    // A TLS 1.3 session only becomes resumable once its ticket arrives; on_new_session()
+    // stores it then.
+    if (!SSL_SESSION_is_resumable(sess)) {
+        SSL_SESSION_free(sess);
+        return;
     }
+    store_session(session_key(host, sess), sess);
+}
 
-    Connection* get_connection(const std::string& host, int port, bool use_ssl);
-    void save_session(Connection* conn);
-};
+void GlobalState::resume_session(SSL* ssl, const std::string& host, bool offer_h2) {
+    std::lock_guard<std::mutex> lock(mtx);
+    load_persistent();
+    for (const std::string& key : {offer_h2 ? host + "/h2" : "", host + "/http/1.1", host}) {
+        auto it = session_cache.find(key);
+        if (!key.empty() && it != session_cache.end()) {
+            SSL_set_session(ssl, it->second);
+            return;
+        }
+    }
+}
 
-static GlobalState g_state;
+// RFC 8305 "Connection Attempt Delay".
+static const auto ATTEMPT_DELAY = std::chrono::milliseconds(250);
+static const auto CONNECT_TIMEOUT = std::chrono::seconds(10);
+// How long an address that failed to connect is tried only after the others.
+static const auto ADDR_COOLDOWN = std::chrono::seconds(60);
+// The limiter forgets hosts nothing was sent to for this long.
+static const auto LIMITER_IDLE = std::chrono::minutes(10);
 
-struct BufferedStream {
-    Connection* conn;
-    char buffer[16384];
-    int pos = 0;
-    int end = 0;
-    bool error = false;
+bool make_sockaddr(const std::string& ip, int port, sockaddr_storage& addr, socklen_t& len) {
+    addr = sockaddr_storage();
+    auto* v4 = (sockaddr_in*)&addr;
+    auto* v6 = (sockaddr_in6*)&addr;
+    if (inet_pton(AF_INET, ip.c_str(), &v4->sin_addr) == 1) {
+        v4->sin_family = AF_INET;
+        v4->sin_port = htons(port);
+        len = sizeof(sockaddr_in);
+        return true;
+    }
+    if (inet_pton(AF_INET6, ip.c_str(), &v6->sin6_addr) == 1) {
+        v6->sin6_family = AF_INET6;
+        v6->sin6_port = htons(port);
+        len = sizeof(sockaddr_in6);
+        return true;
+    }
+    return false;
+}
 
-    BufferedStream(Connection* c) : conn(c) {}
+std::vector<std::string> GlobalState::resolve(const std::string& host, int port) {
+    Span span("dns");
+    span.arg("host", host);
+    std::vector<std::string> addrs;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        load_persistent();
+        auto it = dns_cache.find(host);
+        if (it != dns_cache.end() && it->second.expires > time(nullptr)) addrs = it->second.addrs;
+    }
+    span.arg("cached", !addrs.empty());
 
-    int fill() {
-        if (pos < end) {
-            memmove(buffer, buffer + pos, end - pos);
-            end -= pos;
-        } else {
-            end = 0;
-        }
-        pos = 0;
+    if (addrs.empty()) {
+        addrinfo hints = {}, *result;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_ADDRCONFIG;
+        if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &result) != 0) return addrs;
 
-        int r = 0;
-        if (conn->ssl) {
-            r = SSL_read(conn->ssl, buffer + end, sizeof(buffer) - end);
-        } else {
-            r = recv(conn->socket_fd, buffer + end, sizeof(buffer) - end, 0);
+        // Interleave the families, starting with the one getaddrinfo() put first.
+        std::vector<std::string> families[2];
+        int first_family = result->ai_family;
+        for (addrinfo* ai = result; ai; ai = ai->ai_next) {
+            char ip[INET6_ADDRSTRLEN];
+            const void* raw = ai->ai_family == AF_INET6 ? (const void*)&((sockaddr_in6*)ai->ai_addr)->sin6_addr
+                                                        : (const void*)&((sockaddr_in*)ai->ai_addr)->sin_addr;
+            if (!inet_ntop(ai->ai_family, raw, ip, sizeof(ip))) continue;
+            auto& list = families[ai->ai_family == first_family ? 0 : 1];
+            if (std::find(list.begin(), list.end(), ip) == list.end()) list.push_back(ip);
         }
-
-        if (r <= 0) {
-            error = true;
-            conn->close_conn();
-        } else {
-            end += r;
+        freeaddrinfo(result);
+        for (size_t i = 0; i < std::max(families[0].size(), families[1].size()); ++i) {
+            if (i < families[0].size()) addrs.push_back(families[0][i]);
+            if (i < families[1].size()) addrs.push_back(families[1][i]);
         }
-        return r;
-    }
-
-    std::string read_line() {
-        std::string line;
-        while (!error) {
-            if (pos >= end) if (fill() <= 0) break;
-            
-            char* newline = (char*)memchr(buffer + pos, '\n', end - pos);
-            if (newline) {
-                int len = newline - (buffer + pos) + 1;
-                line.append(buffer + pos, len);
-                pos += len;
-                return line;
+        if (addrs.empty()) return addrs;
+
+        std::lock_guard<std::mutex> lock(mtx);
+        dns_cache[host] = {addrs, (long long)time(nullptr) + DNS_TTL};
+        persist_dirty = true;
+    }
+
+    std::lock_guard<std::mutex> lock(mtx);
+    auto now = std::chrono::steady_clock::now();
+    std::stable_partition(addrs.begin(), addrs.end(), [&](const std::string& addr) {
+        auto it = addr_down_until.find(addr);
+        return it == addr_down_until.end() || it->second <= now;
+    });
+    return addrs;
+}
+
+void GlobalState::mark_address(const std::string& host, const std::string& addr, bool reachable) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (!reachable) {
+        addr_down_until[addr] = std::chrono::steady_clock::now() + ADDR_COOLDOWN;
+        return;
+    }
+    addr_down_until.erase(addr);
+    auto it = dns_cache.find(host);
+    if (it == dns_cache.end()) return;
+    auto& addrs = it->second.addrs;
+    auto pos = std::find(addrs.begin(), addrs.end(), addr);
+    if (pos != addrs.end() && pos != addrs.begin()) {
+        std::rotate(addrs.begin(), pos, pos + 1);
+        persist_dirty = true;
+    }
+}
+
+int GlobalState::connect_host(const std::string& host, int port) {
+    using Clock = std::chrono::steady_clock;
+    std::vector<std::string> addrs = resolve(host, port);
+    if (addrs.empty()) {
+        log_debug("[http] Could not resolve " + host);
+        return -1;
+    }
+    Span span("tcp");
+    span.arg("host", host);
+
+    struct Attempt {
+        int fd;
+        std::string addr;
+    };
+    std::vector<Attempt> attempts;
+    size_t next = 0;
+    int winner = -1;
+    std::string winner_addr;
+    auto deadline = Clock::now() + CONNECT_TIMEOUT;
+    auto next_start = Clock::now();
+
+    auto failed = [&](const std::string& addr, int err) {
+        log_debug("[http] Connecting to " + host + " at " + addr + " failed: " + strerror(err));
+        mark_address(host, addr, false);
+    };
+
+    while (winner < 0) {
+        auto now = Clock::now();
+        if (now >= deadline) break;
+
+        // Start the next address when the delay is up, or at once if nothing is pending.
+        if (next < addrs.size() && (now >= next_start || attempts.empty())) {
+            const std::string& addr = addrs[next++];
+            sockaddr_storage sa;
+            socklen_t len;
+            if (!make_sockaddr(addr, port, sa, len)) continue;
+            int fd = socket(sa.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd < 0) continue;
+            if (connect(fd, (sockaddr*)&sa, len) == 0) {
+                winner = fd;
+                winner_addr = addr;
+                break;
             }
-            line.append(buffer + pos, end - pos);
-            pos = end;
+            if (errno != EINPROGRESS) {
+                failed(addr, errno);
+                close(fd);
+                continue;
+            }
+            attempts.push_back({fd, addr});
+            next_start = now + ATTEMPT_DELAY;
+            continue;
         }
-        return line;
-    }
-
-    void read_exact(std::string& out, long n) {
-        long target = out.size() + n;
-        out.reserve(target);
-        while (n > 0 && !error) {
-            if (pos >= end) if (fill() <= 0) break;
-            
-            int avail = end - pos;
-            int to_copy = (avail < n) ? avail : n;
-            out.append(buffer + pos, to_copy);
-            pos += to_copy;
-            n -= to_copy;
+        if (attempts.empty()) break;
+
+        auto wake = next < addrs.size() ? std::min(next_start, deadline) : deadline;
+        long wait_ms = std::chrono::duration_cast<std::chrono::milliseconds>(wake - now).count() + 1;
+        std::vector<pollfd> fds;
+        for (const auto& a : attempts) fds.push_back({a.fd, POLLOUT, 0});
+        if (poll(fds.data(), fds.size(), (int)wait_ms) <= 0) continue;
+
+        for (size_t i = 0; i < fds.size(); ++i) {
+            if (!fds[i].revents) continue;
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err == 0 && winner < 0) {
+                winner = fds[i].fd;
+                winner_addr = attempts[i].addr;
+            } else if (err != 0) {
+                failed(attempts[i].addr, err);
+                close(fds[i].fd);
+            } else {
+                continue;
+            }
+            attempts[i].fd = -1;
         }
+        attempts.erase(std::remove_if(attempts.begin(), attempts.end(), [](const Attempt& a) { return a.fd < 0; }),
+                       attempts.end());
+    }
+
+    // Attempts that lost the race are not held against their address; ones still
+    // pending at the deadline are.
+    for (const auto& a : attempts) {
+        if (winner < 0) failed(a.addr, ETIMEDOUT);
+        close(a.fd);
+    }
+    if (winner < 0) return -1;
+
+    mark_address(host, winner_addr, true);
+    span.arg("addr", winner_addr);
+    span.arg("attempts", (long long)next);
+    if (next > 1) log_debug("[http] Connected to " + host + " at " + winner_addr + " after trying " +
+                            std::to_string(next) + " addresses.");
+    fcntl(winner, F_SETFL, fcntl(winner, F_GETFL) & ~O_NONBLOCK);
+    return winner;
+}
+
+static long long session_expiry(SSL_SESSION* session) {
+    return (long long)SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session);
+}
+
+static std::string to_hex(const unsigned char* data, size_t len) {
+    static const char digits[] = "0123456789abcdef";
+    std::string out;
+    out.reserve(len * 2);
+    for (size_t i = 0; i < len; ++i) {
+        out += digits[data[i] >> 4];
+        out += digits[data[i] & 0xf];
+    }
+    return out;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+static bool from_hex(const std::string& hex, std::string& out) {
+    if (hex.size() % 2) return false;
+    out.clear();
+    for (size_t i = 0; i < hex.size(); i += 2) {
+        int hi = hex_value(hex[i]), lo = hex_value(hex[i + 1]);
+        if (hi < 0 || lo < 0) return false;
+        out += (char)(hi << 4 | lo);
     }
+    return true;
+}
 
-    bool read_to_file(std::ofstream& outfile) {
-        if (pos < end) {
-            outfile.write(buffer + pos, end - pos);
-            pos = end;
+// Reads "<cache_dir()>/network". Lines are "addrs <host> <expires> <ip>..." or
+// "session <host>[/<alpn>] <expires> <hex DER>". Expired entries are skipped.
+static void read_network_file(const std::string& path, std::map<std::string, GlobalState::DnsEntry>& dns,
+                              std::map<std::string, SSL_SESSION*>& sessions) {
+    std::ifstream in(path);
+    std::string line;
+    long long now = time(nullptr);
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string kind, host;
+        fields >> kind >> host;
+        if (kind == "addrs") {
+            GlobalState::DnsEntry entry;
+            std::string addr;
+            if (!(fields >> entry.expires) || entry.expires <= now) continue;
+            while (fields >> addr) entry.addrs.push_back(addr);
+            if (!entry.addrs.empty()) dns[host] = entry;
+        } else if (kind == "session") {
+            long long expires = 0;
+            std::string hex, der;
+            if (!(fields >> expires >> hex) || expires <= now || !from_hex(hex, der)) continue;
+            const unsigned char* p = (const unsigned char*)der.data();
+            SSL_SESSION* session = d2i_SSL_SESSION(nullptr, &p, (long)der.size());
+            if (!session) continue;
+            if (sessions.count(host)) SSL_SESSION_free(sessions[host]);
+            sessions[host] = session;
         }
-        while (true) {
-            int r = (conn->ssl) ? SSL_read(conn->ssl, buffer, sizeof(buffer)) : recv(conn->socket_fd, buffer, sizeof(buffer), 0);
-            if (r <= 0) break;
-            outfile.write(buffer, r);
+    }
+}
+
+static std::string network_file_path() {
+    std::string dir = cache_dir();
+    return dir.empty() ? "" : dir + "/network";
+}
+
+void GlobalState::load_persistent() {
+    if (persist_loaded || !persist) return;
+    persist_loaded = true;
+    std::string path = network_file_path();
+    if (path.empty()) return;
+
+    std::map<std::string, DnsEntry> dns;
+    std::map<std::string, SSL_SESSION*> sessions;
+    read_network_file(path, dns, sessions);
+    for (auto& kv : dns) dns_cache.emplace(kv.first, kv.second);
+    for (auto& kv : sessions) {
+        if (session_cache.count(kv.first)) SSL_SESSION_free(kv.second);
+        else session_cache[kv.first] = kv.second;
+    }
+    log_debug("[http] Loaded " + std::to_string(sessions.size()) + " TLS sessions and " +
+              std::to_string(dns.size()) + " DNS entries from " + path);
+}
+
+// Merges `own_dns` and `own_sessions` into the network file at `path`. Other processes may
+// have saved since this one loaded, so this happens under a lock; what this process learned wins.
+static bool write_network_file(const std::string& path, const std::map<std::string, GlobalState::DnsEntry>& own_dns,
+                               const std::map<std::string, SSL_SESSION*>& own_sessions) {
+    int lock_fd = open((path + ".lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock_fd < 0) return false;
+    flock(lock_fd, LOCK_EX);
+
+    std::map<std::string, GlobalState::DnsEntry> dns;
+    std::map<std::string, SSL_SESSION*> sessions;
+    read_network_file(path, dns, sessions);
+    for (const auto& kv : own_dns) dns[kv.first] = kv.second;
+    for (const auto& kv : own_sessions) {
+        if (sessions.count(kv.first)) SSL_SESSION_free(sessions[kv.first]);
+        sessions.erase(kv.first);
+    }
+
+    std::ostringstream out;
+    long long now = time(nullptr);
+    for (const auto& kv : dns) {
+        if (kv.second.expires <= now) continue;
+        out << "addrs " << kv.first << " " << kv.second.expires;
+        for (const auto& addr : kv.second.addrs) out << " " << addr;
+        out << "\n";
+    }
+    auto write_session = [&](const std::string& host, SSL_SESSION* session) {
+        int len = i2d_SSL_SESSION(session, nullptr);
+        if (len <= 0 || session_expiry(session) <= now) return;
+        std::vector<unsigned char> der(len);
+        unsigned char* p = der.data();
+        i2d_SSL_SESSION(session, &p);
+        out << "session " << host << " " << session_expiry(session) << " " << to_hex(der.data(), der.size()) << "\n";
+    };
+    for (const auto& kv : sessions) {
+        write_session(kv.first, kv.second);
+        SSL_SESSION_free(kv.second);
+    }
+    for (const auto& kv : own_sessions) write_session(kv.first, kv.second);
+
+    // The sessions hold resumption secrets: the file is created private, and O_EXCL does not
+    // follow a link planted at the temporary name.
+    std::string tmp = path + ".tmp";
+    unlink(tmp.c_str());
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    bool ok = fd >= 0;
+    if (ok) {
+        std::string data = out.str();
+        ok = write(fd, data.data(), data.size()) == (ssize_t)data.size();
+        close(fd);
+        ok = ok && rename(tmp.c_str(), path.c_str()) == 0;
+        if (!ok) unlink(tmp.c_str());
+    }
+    close(lock_fd);
+    return ok;
+}
+
+void GlobalState::save_persistent() {
+    // A snapshot is taken under `mtx`; the file I/O and the flock() wait happen outside it.
+    std::map<std::string, DnsEntry> dns;
+    std::map<std::string, SSL_SESSION*> sessions;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!persist || !persist_dirty) return;
+        persist_dirty = false;
+        dns = dns_cache;
+        for (const auto& kv : session_cache) {
+            SSL_SESSION_up_ref(kv.second);
+            sessions[kv.first] = kv.second;
         }
-        return true;
     }
-};
+    std::string path = network_file_path();
+    if (!path.empty() && !write_network_file(path, dns, sessions)) {
+        std::lock_guard<std::mutex> lock(mtx);
+        persist_dirty = true;
+    }
+    for (const auto& kv : sessions) SSL_SESSION_free(kv.second);
+}
 
-void GlobalState::save_session(Connection* conn) {
-    if (!conn || !conn->ssl) return;
-    SSL_SESSION* sess = SSL_get1_session(conn->ssl);
-    if (sess) {
-        if (session_cache.count(conn->host)) SSL_SESSION_free(session_cache[conn->host]);
-        session_cache[conn->host] = sess;
+void save_network_cache() {
+    {
+        std::unique_lock<std::mutex> lock(g_state.mtx);
+        g_state.prefetch_cv.wait(lock, [] { return g_state.prefetch_threads == 0; });
     }
+    g_state.save_persistent();
+}
+
+void set_network_cache_enabled(bool enabled) {
+    std::lock_guard<std::mutex> lock(g_state.mtx);
+    g_state.persist = enabled;
 }
 
-Connection* GlobalState::get_connection(const std::string& host, int port, bool use_ssl) {
+std::unique_ptr<Connection> GlobalState::get_connection(const std::string& host, int port, bool use_ssl,
+                                                     const std::string* early_request, bool* request_sent) {
+    if (request_sent) *request_sent = false;
     std::string key = host + ":" + std::to_string(port);
-    
-    if (pool.count(key)) {
-        Connection* c = pool[key].get();
-        if (!c->is_closed) {
-            char buf[1];
-            int r = recv(c->socket_fd, buf, 1, MSG_PEEK | MSG_DONTWAIT);
-            if (r == 0) {
-                c->close_conn();
-            } else if (r < 0 && (errno != EAGAIN && errno != EWOULDBLOCK)) {
-                c->close_conn();
-            } else {
-                return c;
-            }
-        }
-        pool.erase(key);
+    Span span("connect");
+    span.arg("host", host);
+
+    if (std::unique_ptr<Connection> c = pool.check_out(key, CONNECT_TIMEOUT)) {
+        span.arg("reused", 1);
+        trace_count("connections_reused");
+        return c;
     }
 
+    return open_connection(host, port, use_ssl, false, early_request, request_sent);
+}
+
+std::unique_ptr<Connection> GlobalState::open_connection(const std::string& host, int port, bool use_ssl, bool offer_h2,
+                                                      const std::string* early_request, bool* request_sent) {
+    if (request_sent) *request_sent = false;
     auto conn = std::make_unique<Connection>();
     conn->host = host;
     conn->port = port;
 
-    std::string ip;
-    if (dns_cache.count(host)) {
-        ip = dns_cache[host];
-    } else {
-        addrinfo hints = {}, *addrs;
-        hints.ai_family = AF_INET;
-        hints.ai_socktype = SOCK_STREAM;
-        if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addrs) != 0) return nullptr;
-        
-        char ip_str[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &((sockaddr_in*)addrs->ai_addr)->sin_addr, ip_str, INET_ADDRSTRLEN);
-        ip = std::string(ip_str);
-        dns_cache[host] = ip;
-        freeaddrinfo(addrs);
-    }
-
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    inet_pton(AF_INET, ip.c_str(), &server_addr.sin_addr);
-
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    int sock = connect_host(host, port);
     if (sock < 0) return nullptr;
 
     int flag = 1;
@@ -215,31 +532,213 @@ Connection* GlobalState::get_connection(const std::string& host, int port, bool
     setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
     setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
 
-    if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        close(sock); return nullptr;
-    }
-
     conn->socket_fd = sock;
+    trace_count("connections_opened");
 
     if (use_ssl) {
+        Span span("tls");
+        span.arg("host", host);
         conn->ssl = SSL_new(ssl_ctx);
-        SSL_set_fd(conn->ssl, sock);
+        if (!conn->ssl || !ssl_set_socket(conn->ssl, sock)) return nullptr;
         SSL_set_tlsext_host_name(conn->ssl, host.c_str());
-        
-        if (session_cache.count(host)) {
-            SSL_set_session(conn->ssl, session_cache[host]);
+        if (ktls) SSL_set_options(conn->ssl, SSL_OP_ENABLE_KTLS);
+        // HTTP/1.1 connections name their protocol too: early data is only allowed when the
+        // ALPN offer matches the one of the resumed session.
+        static const unsigned char h2_protos[] = "\x02h2\x08http/1.1";
+        static const unsigned char h1_protos[] = "\x08http/1.1";
+        if (offer_h2) SSL_set_alpn_protos(conn->ssl, h2_protos, sizeof(h2_protos) - 1);
+        else SSL_set_alpn_protos(conn->ssl, h1_protos, sizeof(h1_protos) - 1);
+        resume_session(conn->ssl, host, offer_h2);
+
+        bool early = false;
+        SSL_SESSION* session = SSL_get_session(conn->ssl);
+        if (early_request && session && SSL_SESSION_get_max_early_data(session) >= early_request->size()) {
+            size_t written = 0;
+            early = SSL_write_early_data(conn->ssl, early_request->data(), early_request->size(), &written) == 1 &&
+                    written == early_request->size();
+            if (!early) {
+                // The handshake is in an unknown state; start over without early data.
+                conn->close_conn();
+                return open_connection(host, port, use_ssl, offer_h2);
+            }
         }
 
         if (SSL_connect(conn->ssl) <= 0) {
             conn->close_conn();
             return nullptr;
         }
-        save_session(conn.get());
+        save_session(conn->ssl, host);
+        bool resumed = SSL_session_reused(conn->ssl);
+        if (resumed) log_debug("[http] Resumed TLS session with " + host);
+        span.arg("resumed", resumed);
+        trace_count(resumed ? "tls_resumed" : "tls_full");
+
+        if (early) {
+            bool accepted = SSL_get_early_data_status(conn->ssl) == SSL_EARLY_DATA_ACCEPTED;
+            log_debug(std::string("[http] Request to ") + host + " sent as TLS 1.3 early data" +
+                      (accepted ? "." : ", but the server rejected it. Resending."));
+            if (request_sent) *request_sent = accepted;
+            span.arg("early_data", accepted);
+        }
     }
 
-    Connection* ptr = conn.get();
-    pool[key] = std::move(conn);
-    return ptr;
+    return conn;
+}
+
+std::shared_ptr<H2Connection> GlobalState::get_h2_connection(const std::string& host, int port) {
+    std::string key = host + ":" + std::to_string(port);
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        if (!http2 || h1_only.count(key)) return nullptr;
+        auto it = h2_pool.find(key);
+        if (it != h2_pool.end() && it->second->usable()) return it->second;
+        h2_connect_cv.wait(lock, [&] { return !h2_connecting.count(key); });
+        if (h1_only.count(key)) return nullptr;
+        it = h2_pool.find(key);
+        if (it != h2_pool.end() && it->second->usable()) return it->second;
+        h2_connecting.insert(key);
+    }
+    // Lets the next waiter for this host in, whatever the outcome.
+    struct Connecting {
+        GlobalState& state;
+        const std::string& key;
+        ~Connecting() {
+            {
+                std::lock_guard<std::mutex> lock(state.mtx);
+                state.h2_connecting.erase(key);
+            }
+            state.h2_connect_cv.notify_all();
+        }
+    } connecting{*this, key};
+
+    Span span("connect");
+    span.arg("host", host);
+    span.arg("h2", 1);
+
+    std::unique_ptr<Connection> conn = open_connection(host, port, true, true);
+    if (!conn) return nullptr;
+
+    const unsigned char* alpn = nullptr;
+    unsigned int alpn_len = 0;
+    SSL_get0_alpn_selected(conn->ssl, &alpn, &alpn_len);
+    if (alpn_len != 2 || memcmp(alpn, "h2", 2) != 0) {
+        log_debug("[http] " + host + " does not support HTTP/2. Using HTTP/1.1.");
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            h1_only.insert(key);
+        }
+        release_connection(std::move(conn));
+        return nullptr;
+    }
+
+    auto h2 = std::make_shared<H2Connection>(std::move(conn));
+    if (!h2->start()) return nullptr;
+    log_debug("[http] Opened HTTP/2 connection to " + host + ".");
+    std::lock_guard<std::mutex> lock(mtx);
+    h2_pool[key] = h2;
+    return h2;
+}
+
+void set_http2_enabled(bool enabled) {
+    std::lock_guard<std::mutex> lock(g_state.mtx);
+    g_state.http2 = enabled;
+}
+
+void set_max_requests_per_host(int max) {
+    g_state.limiter.set_max(max);
+}
+
+void set_ktls_enabled(bool enabled) {
+    std::lock_guard<std::mutex> lock(g_state.mtx);
+    g_state.ktls = enabled;
+}
+
+void prefetch_host(const std::string& url, bool connect) {
+    std::string protocol, host, path;
+    int port;
+    if (!parse_url(url, protocol, host, path, port)) return;
+    std::string key = host + ":" + std::to_string(port);
+    bool use_ssl = protocol == "https";
+    bool h2 = false;
+    {
+        std::lock_guard<std::mutex> lock(g_state.mtx);
+        auto it = g_state.h2_pool.find(key);
+        if (it != g_state.h2_pool.end() && it->second->usable()) return;
+        if (g_state.h2_connecting.count(key)) return;
+        if (!connect) {
+            auto dns = g_state.dns_cache.find(host);
+            if (dns != g_state.dns_cache.end() && dns->second.expires > time(nullptr)) return;
+        }
+        h2 = use_ssl && g_state.http2 && !g_state.h1_only.count(key);
+        if (!g_state.pool.begin_prefetch(key)) return;
+        ++g_state.prefetch_threads;
+    }
+
+    std::shared_ptr<Trace> trace = current_trace_shared();
+    std::thread([=] {
+        TraceScope scope(trace);
+        Span span("prefetch");
+        span.arg("host", host);
+        if (!connect) {
+            g_state.resolve(host, port);
+        } else if (h2) {
+            // Falls back to HTTP/1.1 by itself and pools that connection.
+            if (g_state.get_h2_connection(host, port)) log_debug("[http] Prefetched HTTP/2 connection to " + host + ".");
+        } else if (auto conn = g_state.open_connection(host, port, use_ssl, false)) {
+            log_debug("[http] Prefetched connection to " + host + ".");
+            g_state.release_connection(std::move(conn));
+        }
+        span.end();
+        g_state.pool.end_prefetch(key);
+        std::lock_guard<std::mutex> lock(g_state.mtx);
+        --g_state.prefetch_threads;
+        g_state.prefetch_cv.notify_all();
+    }).detach();
+}
+
+void GlobalState::release_connection(std::unique_ptr<Connection> conn) {
+    if (!conn || conn->is_closed) return;
+    std::string key = conn->host + ":" + std::to_string(conn->port);
+    pool.check_in(key, std::move(conn));
+}
+
+int GlobalState::evict_idle() {
+    int n = pool.evict_idle();
+    // Closed outside the lock: the TLS close_notify is a write.
+    std::vector<std::shared_ptr<H2Connection>> closed_h2;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (auto it = h2_pool.begin(); it != h2_pool.end();) {
+            if (!it->second->usable() || it->second->idle_seconds() > pool.idle_timeout_s()) {
+                closed_h2.push_back(std::move(it->second));
+                it = h2_pool.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        auto now = std::chrono::steady_clock::now();
+        for (auto it = addr_down_until.begin(); it != addr_down_until.end();) {
+            it = it->second <= now ? addr_down_until.erase(it) : std::next(it);
+        }
+    }
+    limiter.expire(LIMITER_IDLE);
+    n += (int)closed_h2.size();
+    if (n > 0) log_debug("[http] Closed " + std::to_string(n) + " idle connections.");
+    return n;
+}
+
+int evict_idle_connections() {
+    int n = g_state.evict_idle();
+    g_state.save_persistent();
+    return n;
+}
+
+void set_connection_pool_limits(int max_idle_per_host, int max_idle, double idle_timeout_s) {
+    g_state.pool.set_limits(max_idle_per_host, max_idle, idle_timeout_s);
+}
+
+PoolStats connection_pool_stats() {
+    return g_state.pool.stats();
 }
 
 bool parse_url(const std::string& url, std::string& protocol, std::string& host, std::string& path, int& port) {
@@ -248,15 +747,38 @@ bool parse_url(const std::string& url, std::string& protocol, std::string& host,
     protocol = url.substr(0, protocol_pos);
     size_t host_start = protocol_pos + 3;
     size_t path_start = url.find('/', host_start);
+    std::string host_port;
     if (path_start == std::string::npos) {
-        host = url.substr(host_start);
+        host_port = url.substr(host_start);
         path = "/";
     } else {
-        host = url.substr(host_start, path_start - host_start);
+        host_port = url.substr(host_start, path_start - host_start);
         path = url.substr(path_start);
     }
+
     port = (protocol == "https") ? 443 : 80;
-    return true;
+    // An explicit port follows the last colon, or the closing bracket of an IPv6 literal.
+    size_t bracket = host_port.rfind(']');
+    size_t colon = host_port.rfind(':');
+    if (colon != std::string::npos && (bracket == std::string::npos || colon > bracket)) {
+        if (bracket == std::string::npos && host_port.find(':') != colon) return false;
+        std::string digits = host_port.substr(colon + 1);
+        if (digits.empty() || digits.size() > 5 || digits.find_first_not_of("0123456789") != std::string::npos) return false;
+        port = std::atoi(digits.c_str());
+        if (port == 0 || port > 65535) return false;
+        host_port.erase(colon);
+    }
+    if (!host_port.empty() && host_port.front() == '[' && host_port.back() == ']') {
+        host_port = host_port.substr(1, host_port.size() - 2);
+    }
+    host = host_port;
+    return !host.empty();
+}
+
+std::string authority(const std::string& protocol, const std::string& host, int port) {
+    std::string name = host.find(':') != std::string::npos ? "[" + host + "]" : host;
+    if (port == ((protocol == "https") ? 443 : 80)) return name;
+    return name + ":" + std::to_string(port);
 }
 
 std::string to_lower(std::string s) {
@@ -264,130 +786,254 @@ std::string to_lower(std::string s) {
     return s;
 }
 
-HttpResponse perform_request(const std::string& protocol, const std::string& host, const std::string& path, int port) {
+std::string build_request(const std::string& method, const std::string& host, const std::string& path,
+                          const std::string& extra_headers, bool keep_alive) {
+    return method + " " + path + " HTTP/1.1\r\nHost: " + host + "\r\nUser-Agent: " + get_random_user_agent() +
+           "\r\nConnection: " + (keep_alive ? "keep-alive" : "close") + "\r\n" + extra_headers + "\r\n";
+}
+
+bool send_request(Connection* conn, const std::string& req) {
+    int sent = (conn->ssl) ? SSL_write(conn->ssl, req.c_str(), req.length()) : send(conn->socket_fd, req.c_str(), req.length(), MSG_NOSIGNAL);
+    return sent > 0;
+}
+
+void parse_header_line(const std::string& line, HttpResponse& response, ResponseHead& head) {
+    auto colon = line.find(':');
+    if (colon == std::string::npos) return;
+
+    std::string key = to_lower(line.substr(0, colon));
+    size_t val_start = line.find_first_not_of(' ', colon + 1);
+    std::string val = (val_start == std::string::npos) ? "" : line.substr(val_start);
+    while (!val.empty() && (val.back() == '\r' || val.back() == '\n')) val.pop_back();
+    response.headers[key] = val;
+
+    if (key == "content-length") head.content_length = std::atoll(val.c_str());
+    if (key == "transfer-encoding" && val.find("chunked") != std::string::npos) head.chunked = true;
+    if (key == "connection" && val.find("close") != std::string::npos) head.connection_close = true;
+}
+
+bool read_response_head(BufferedStream& stream, HttpResponse& response, ResponseHead& head) {
+    std::string line = stream.read_line();
+    if (line.empty()) return false;
+
+    sscanf(line.c_str(), "HTTP/%*f %d", &response.status_code);
+
+    while (true) {
+        line = stream.read_line();
+        if (line == "\r\n" || line == "\n" || line.empty()) break;
+        parse_header_line(line, response, head);
+    }
+    return !stream.error;
+}
+
+// Small remainders are read and discarded after an early stop so the connection can be
+// reused; anything larger is cheaper to abandon by closing the connection.
+static const long long DRAIN_LIMIT = 64 * 1024;
+
+// Runs one GET on the shared HTTP/2 connection, passing the body to `deliver`. False if
+// the exchange did not complete, in which case the caller may fall back to HTTP/1.1.
+static bool perform_h2_request(H2Connection& h2, const std::string& host, const std::string& path,
+                               const std::string& extra_headers, HttpResponse& response, const BodyCallback& deliver,
+                               HostPermit& permit) {
+    Span ttfb("ttfb");
+    std::shared_ptr<H2Stream> stream = h2.open_stream("GET", host, path, h2_header_list(extra_headers));
+    if (!stream) return false;
+    permit.sent();
+
+    bool ok = h2.wait_headers(*stream, response);
+    if (ok) permit.response(response.status_code, retry_after(response));
+    ttfb.end();
+    Span transfer("transfer");
+    bool stopped = false;
+    char buf[16384];
+    int n = 0;
+    while (ok && (n = h2.read(*stream, buf, sizeof(buf))) > 0) {
+        if (!deliver(buf, n)) {
+            stopped = true;
+            break;
+        }
+    }
+    // Closing a stream that has not ended cancels it with RST_STREAM.
+    h2.close_stream(*stream);
+    return ok && (n == 0 || stopped);
+}
+
+// Sends a GET and reads the response. The body of a 200 response goes to `on_body` when
+// one is given; every other body is collected in the returned response.
+HttpResponse perform_request(const std::string& protocol, const std::string& host, const std::string& path, int port,
+                             const BodyCallback& on_body = nullptr) {
     HttpResponse response;
     bool use_ssl = (protocol == "https");
+    HostPermit permit(g_state.limiter, host);
+    long long received = 0;
+    bool stopped = false;
+    BodyCallback deliver_plain = [&](const char* data, size_t len) {
+        if (on_body && response.status_code == 200) {
+            if (!on_body(data, len)) stopped = true;
+            return !stopped;
+        }
+        response.body.append(data, len);
+        return true;
+    };
+
+    // Pages are requested compressed and decoded as they arrive, so callers only see plain text.
+    std::string accept_encoding = std::string("Accept-Encoding: ") + accepted_encodings() + "\r\n";
+    std::unique_ptr<ContentDecoder> decoder;
+    bool corrupt = false;
+    BodyCallback deliver = [&](const char* data, size_t len) {
+        received += len;
+        if (!decoder) {
+            decoder = std::make_unique<ContentDecoder>();
+            auto it = response.headers.find("content-encoding");
+            if (it != response.headers.end() && !decoder->start(it->second)) {
+                // Handing the raw bytes on would look like a garbled page.
+                log_error("[http] Unsupported Content-Encoding from " + host + ": " + it->second);
+                corrupt = stopped = true;
+                return false;
+            }
+        }
+        if (!decoder->active()) return deliver_plain(data, len);
+        if (decoder->feed(data, len, deliver_plain)) return true;
+        if (!decoder->stopped()) {
+            log_debug("[http] Corrupt compressed body from " + host + ".");
+            corrupt = stopped = true;
+        }
+        return false;
+    };
+
+    if (use_ssl) {
+        std::shared_ptr<H2Connection> h2 = g_state.get_h2_connection(host, port);
+        if (h2) {
+            bool ok = perform_h2_request(*h2, authority(protocol, host, port), path, accept_encoding, response, deliver,
+                                         permit);
+            if (corrupt) response.status_code = 0;
+            if (stopped && !corrupt) log_debug("[http] Stopped reading after " + std::to_string(received) + " bytes.");
+            // Once body bytes reached the caller the request cannot be repeated.
+            if (ok || received > 0) return response;
+            response = HttpResponse();
+        }
+    }
 
     for (int retry = 0; retry < 2; ++retry) {
-        Connection* conn = g_state.get_connection(host, port, use_ssl);
-        if (!conn) return response;
+        std::string request = build_request("GET", authority(protocol, host, port), path, accept_encoding);
+        bool sent = false;
+        std::unique_ptr<Connection> conn_holder = g_state.get_connection(host, port, use_ssl, &request, &sent);
+        if (!conn_holder) return response;
+        Connection* conn = conn_holder.get();
 
-        std::string req = "GET " + path + " HTTP/1.1\r\nHost: " + host + "\r\nUser-Agent: " + get_random_user_agent() + "\r\nConnection: keep-alive\r\n\r\n";
-        
-        int sent = (conn->ssl) ? SSL_write(conn->ssl, req.c_str(), req.length()) : send(conn->socket_fd, req.c_str(), req.length(), 0);
-        if (sent <= 0) {
+        Span ttfb("ttfb");
+        if (!sent && !send_request(conn, request)) {
             conn->close_conn();
             continue; 
         }
+        permit.sent();
 
         BufferedStream stream(conn);
-        std::string line = stream.read_line();
-        if (line.empty()) {
+        ResponseHead head;
+        if (!read_response_head(stream, response, head)) {
             conn->close_conn();
+            response = HttpResponse();
             continue;
         }
+        permit.response(response.status_code, retry_after(response));
+        ttfb.end();
 
-        sscanf(line.c_str(), "HTTP/%*f %d", &response.status_code);
-
-        long content_len = -1;
-        bool chunked = false;
-        bool connection_close = false;
-
-        while (true) {
-            line = stream.read_line();
-            if (line == "\r\n" || line == "\n" || line.empty()) break;
-            
-            auto colon = line.find(':');
-            if (colon != std::string::npos) {
-                std::string key = to_lower(line.substr(0, colon));
-                std::string val = line.substr(colon + 2);
-                while (!val.empty() && (val.back() == '\r' || val.back() == '\n')) val.pop_back();
-                response.headers[key] = val;
-
-                if (key == "content-length") content_len = std::stol(val);
-                if (key == "transfer-encoding" && val.find("chunked") != std::string::npos) chunked = true;
-                if (key == "connection" && val.find("close") != std::string::npos) connection_close = true;
-            }
+        Span transfer("transfer");
+        if (head.content_length >= 0) {
+            stream.read_to_sink(head.content_length, deliver);
+        } else if (head.chunked) {
+            long long size = 0;
+            while (!stopped && (size = stream.next_chunk()) > 0) stream.read_to_sink(size, deliver);
+            if (size < 0) head.connection_close = true;
+        } else {
+            stream.read_to_sink(-1, deliver);
+            head.connection_close = true;
         }
 
-        if (content_len >= 0) {
-            stream.read_exact(response.body, content_len);
-        } else if (chunked) {
-            while (true) {
-                std::string size_line = stream.read_line();
-                long chunk_size = 0;
-                try { chunk_size = std::stol(size_line, nullptr, 16); } catch(...) { break; }
-                if (chunk_size == 0) { stream.read_line(); break; } 
-                stream.read_exact(response.body, chunk_size);
-                stream.read_line(); 
-            }
-        } else {
-             while (true) {
-                char tmp[4096];
-                int r = (conn->ssl) ? SSL_read(conn->ssl, tmp, sizeof(tmp)) : recv(conn->socket_fd, tmp, sizeof(tmp), 0);
-                if (r <= 0) break;
-                response.body.append(tmp, r);
-             }
-             connection_close = true;
+        if (stopped) {
+            if (!corrupt) log_debug("[http] Stopped reading after " + std::to_string(received) + " bytes.");
+            long long left = head.content_length - received;
+            if (head.chunked || head.content_length < 0 || left > DRAIN_LIMIT) head.connection_close = true;
+            else stream.read_to_sink(left, [](const char*, size_t) { return true; });
         }
+        transfer.arg("bytes", received);
+        transfer.end();
 
-        if (connection_close) conn->close_conn();
+        if (head.connection_close || stream.error) conn->close_conn();
+        else g_state.release_connection(std::move(conn_holder));
+        if (corrupt) response.status_code = 0;
         return response;
     }
     return response;
 }
 
-std::string fetch_url(const std::string& initial_url, std::string& final_url, int max_redirects) {
+double retry_after(const HttpResponse& response) {
+    auto it = response.headers.find("retry-after");
+    return it == response.headers.end() ? 0 : parse_retry_after(it->second);
+}
+
+// Overloaded hosts get this many more tries, after backoff_delay() or the Retry-After they ask for.
+static const int MAX_RETRIES = 4;
+static const double MAX_RETRY_WAIT = 60;
+
+std::string absolute_location(const std::string& protocol, const std::string& authority, std::string loc) {
+    if (loc.find("http") != 0) {
+         if (!loc.empty() && loc.front() == '/') loc = protocol + "://" + authority + loc;
+         else loc = protocol + "://" + authority + "/" + loc;
+    }
+    return loc;
+}
+
+// Follows redirects up to the final 200 response. Its body goes to `on_body` if one is
+// given, otherwise into `body`.
+static bool fetch_final(const std::string& initial_url, std::string& final_url, std::string& body,
+                        const BodyCallback& on_body, int max_redirects) {
+    Span span("fetch");
     std::string current_url = initial_url;
     for (int i = 0; i < max_redirects; ++i) {
         final_url = current_url;
         std::string protocol, host, path;
         int port;
-        if (!parse_url(current_url, protocol, host, path, port)) return "";
+        if (!parse_url(current_url, protocol, host, path, port)) return false;
 
         log_debug("[http] Fetching: " + current_url);
-        HttpResponse res = perform_request(protocol, host, path, port);
+        Span hop("page");
+        hop.arg("url", current_url);
+        HttpResponse res;
+        for (int attempt = 0;; ++attempt) {
+            res = perform_request(protocol, host, path, port, on_body);
+            if (!is_overload_status(res.status_code) || attempt == MAX_RETRIES) break;
+            double delay = std::max(backoff_delay(attempt), retry_after(res));
+            if (delay > MAX_RETRY_WAIT) break;
+            log_debug("[http] HTTP " + std::to_string(res.status_code) + " from " + host + ". Retrying in " +
+                      std::to_string((int)(delay * 1000)) + " ms.");
+            trace_count("retries");
+            std::this_thread::sleep_for(std::chrono::duration<double>(delay));
+        }
+        hop.arg("status", res.status_code);
 
         if (res.status_code >= 300 && res.status_code < 400 && res.headers.count("location")) {
-            std::string loc = res.headers["location"];
-            if (loc.find("http") != 0) {
-                 if (loc.front() == '/') loc = protocol + "://" + host + loc;
-                 else loc = protocol + "://" + host + "/" + loc;
-            }
-            current_url = loc;
+            hop.rename("redirect");
+            trace_count("redirects");
+            current_url = absolute_location(protocol, authority(protocol, host, port), res.headers["location"]);
         } else if (res.status_code == 200) {
-            return res.body;
+            body = std::move(res.body);
+            return true;
         } else {
-            return "";
+            return false;
         }
     }
-    return "";
+    return false;
 }
 
-bool download_file(const std::string& url, const std::string& output_path) {
-    log_normal("[downloader] Destination: " + output_path);
-    std::string protocol, host, path;
-    int port;
-    if (!parse_url(url, protocol, host, path, port) || protocol != "https") return false;
-
-    Connection* conn = g_state.get_connection(host, port, true);
-    if (!conn) return false;
-
-    std::string req = "GET " + path + " HTTP/1.1\r\nHost: " + host + "\r\nConnection: close\r\nUser-Agent: " + get_random_user_agent() + "\r\n\r\n";
-    SSL_write(conn->ssl, req.c_str(), req.length());
-
-    BufferedStream stream(conn);
-    std::string line = stream.read_line();
-    if (line.empty()) return false;
-
-    while (true) {
-        line = stream.read_line();
-        if (line == "\r\n" || line == "\n" || line.empty()) break;
-    }
+std::string fetch_url(const std::string& initial_url, std::string& final_url, int max_redirects) {
+    std::string body;
+    fetch_final(initial_url, final_url, body, nullptr, max_redirects);
+    return body;
+}
 
-    std::ofstream outfile(output_path, std::ios::binary);
-    stream.read_to_file(outfile);
-    
-    conn->close_conn();
-    return true;
-}
\ No newline at end of file
+bool fetch_url_streaming(const std::string& initial_url, std::string& final_url,
+                         const BodyCallback& on_body, int max_redirects) {
+    std::string body;
+    return fetch_final(initial_url, final_url, body, on_body, max_redirects);
+}
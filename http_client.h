@@ -3,6 +3,7 @@
 
 #include <string>
 #include <map>
+#include <functional>
 
 struct HttpResponse {
     int status_code = 0;
@@ -14,6 +15,97 @@ bool parse_url(const std::string& url, std::string& protocol, std::string& host,
 
 std::string fetch_url(const std::string& initial_url, std::string& final_url, int max_redirects = 5);
 
-bool download_file(const std::string& url, const std::string& output_path);
+// Receives body bytes as they arrive. Returning false stops the transfer.
+using BodyCallback = std::function<bool(const char* data, size_t len)>;
+
+// Like fetch_url(), but hands the final page to `on_body` chunk by chunk instead of
+// collecting it. When the callback stops early, the connection is drained if little is
+// left and closed otherwise (HTTP/2: the stream is cancelled). False if no 200 was received.
+bool fetch_url_streaming(const std::string& initial_url, std::string& final_url,
+                         const BodyCallback& on_body, int max_redirects = 5);
+
+struct DownloadOptions {
+    // Number of parallel Range connections. 1 keeps the single-stream download.
+    int segments = 1;
+    // Called from the download threads with the bytes in the file so far and the total size
+    // (-1 while unknown), every megabyte or so.
+    std::function<void(long long done, long long total)> progress;
+};
+
+struct DownloadStats {
+    int status_code = 0;
+    long long bytes = 0;
+    int segments = 1;  // Number of ranges actually used
+    bool from_store = false;  // The server answered 304 and the stored copy was used
+};
+
+// Resolves the host of `url` and connects to it on a background thread, so that a later
+// request finds the address cached and a warm connection (the host's HTTP/2 connection, or an
+// idle HTTP/1.1 one in the pool). With `connect` false only the address is resolved.
+// Does nothing if the host already has a connection or one is being opened. Handshakes are
+// only shared per host, so a prefetch never delays a request to another host (the pin page
+// is fetched while the media CDN connections are being set up).
+void prefetch_host(const std::string& url, bool connect = true);
+
+// Upper bound for the adaptive number of requests in flight to one host (default 32). Below
+// it the limit follows what the host tolerates: it grows while responses are fast and drops
+// on 429/5xx overload responses or rising latency. Overloaded requests are retried with
+// jittered backoff, and a Retry-After pauses all requests to that host.
+void set_max_requests_per_host(int max);
+
+// HTTP/2 is negotiated with ALPN by default. Disabling it makes every request use HTTP/1.1.
+void set_http2_enabled(bool enabled);
+
+// TLS sessions and DNS answers are saved in the cache directory and reused by the next run,
+// which then resumes (and where possible sends its first request as TLS 1.3 early data)
+// instead of doing a full handshake. Disabling this keeps them in memory only.
+void set_network_cache_enabled(bool enabled);
+
+// Waits for background prefetches and writes the TLS sessions and DNS answers to the cache
+// directory. Call it before the process exits; nothing is saved at static destruction.
+// PinClient's destructor calls it.
+void save_network_cache();
+
+// download_file() keeps what it downloads in a content-addressed store in the cache directory
+// and revalidates it with If-None-Match/If-Modified-Since next time: on a 304 the stored copy
+// is linked to the output path instead. Identical content from different URLs is kept once.
+// Disabling this makes every download unconditional.
+void set_media_store_enabled(bool enabled);
+
+// Size limit for stored files that no output links to any more (default 1 GiB). The least
+// recently used are deleted first.
+void set_media_store_limit(long long bytes);
+
+// Asks OpenSSL to hand the TLS session to the kernel (kTLS) after the handshake. Downloads
+// over HTTP/1.1 then splice() the body from the socket into the file without copying it
+// through user space. Connections the kernel cannot offload keep the buffered path.
+void set_ktls_enabled(bool enabled);
+
+struct PoolStats {
+    long long hits = 0;       // Requests that reused an idle HTTP/1.1 connection
+    long long misses = 0;     // Requests that found none and opened one
+    long long evictions = 0;  // Idle connections closed: timed out, closed by the server or over a cap
+    int idle = 0;             // Idle connections in the pool now
+};
+
+// Idle HTTP/1.1 connections kept for reuse: at most `max_idle_per_host` per host and
+// `max_idle` in all (defaults 8 and 256), each for up to `idle_timeout_s` (default 60).
+// Also the idle time after which evict_idle_connections() closes an HTTP/2 connection.
+void set_connection_pool_limits(int max_idle_per_host, int max_idle, double idle_timeout_s);
+
+PoolStats connection_pool_stats();
+
+// For long-running processes: closes pooled connections (HTTP/1.1 and HTTP/2) idle for longer
+// than the pool's timeout, and saves new TLS sessions and DNS answers to the cache directory
+// instead of waiting for exit. Returns the number of connections closed.
+int evict_idle_connections();
+
+bool download_file(const std::string& url, const std::string& output_path,
+                   const DownloadOptions& options = DownloadOptions(), DownloadStats* stats = nullptr);
+
+// Streams the body of `url` to `sink` instead of a file: one stream, no .part file. A dropped
+// connection is resumed with a validated Range. Returning false from the sink cancels the
+// download, and the function then returns false.
+bool download_to_sink(const std::string& url, const BodyCallback& sink, DownloadStats* stats = nullptr);
 
 #endif
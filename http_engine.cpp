@@ -0,0 +1,501 @@
+#include "http_engine.h"
+#include "http_client.h"
+#include "http_internal.h"
+#include "logger.h"
+#include "content_decoder.h"
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+
+using Clock = std::chrono::steady_clock;
+
+// A connect that has not completed by then moves on to the host's next address, if any.
+static const auto ADDRESS_TIMEOUT = std::chrono::seconds(2);
+
+struct HttpEngine::EngineConn {
+    int fd = -1;
+    SSL* ssl = nullptr;
+    std::string key;
+
+    ~EngineConn() {
+        if (ssl) { SSL_shutdown(ssl); SSL_free(ssl); }
+        if (fd != -1) close(fd);
+    }
+};
+
+struct HttpEngine::Transfer {
+    enum class State { CONNECTING, HANDSHAKE, SENDING, HEAD, BODY, DONE };
+    enum class Chunk { SIZE, DATA, DATA_END, TRAILER };
+
+    AsyncRequest req;
+    AsyncResponse res;
+    Clock::time_point deadline;
+    int redirects = 0;
+
+    std::string url;
+    std::string protocol, host, path;
+    int port = 0;
+
+    std::unique_ptr<EngineConn> conn;
+    bool reused = false;
+    std::vector<std::string> addrs;  // Left to try for this connection, in order
+    std::string addr;                // Being connected to
+    Clock::time_point connect_deadline;
+    unsigned watched = 0;
+    State state = State::CONNECTING;
+
+    // Per-attempt state, reset for every hop and every retry.
+    std::string out;
+    size_t out_pos = 0;
+    std::string in;
+    bool got_bytes = false;
+    HttpResponse head_response;
+    ResponseHead head;
+    long long remaining = -1;
+    Chunk chunk = Chunk::SIZE;
+    long long chunk_left = 0;
+    bool discard = false;
+    std::string redirect_to;
+    int file_fd = -1;
+    std::unique_ptr<ContentDecoder> decoder;  // Compressed page body
+
+    void reset_attempt() {
+        out.clear();
+        out_pos = 0;
+        in.clear();
+        got_bytes = false;
+        head_response = HttpResponse();
+        head = ResponseHead();
+        remaining = -1;
+        chunk = Chunk::SIZE;
+        chunk_left = 0;
+        discard = false;
+        redirect_to.clear();
+        decoder.reset();
+    }
+
+    std::string part_path() const { return req.output_path + ".part"; }
+};
+
+HttpEngine::HttpEngine() {
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+}
+
+HttpEngine::~HttpEngine() {
+    idle_.clear();
+    transfers_.clear();
+    if (epoll_fd_ != -1) close(epoll_fd_);
+}
+
+void HttpEngine::submit(AsyncRequest request) {
+    auto t = std::make_unique<Transfer>();
+    t->req = std::move(request);
+    t->url = t->req.url;
+    t->deadline = Clock::now() + std::chrono::milliseconds(t->req.timeout_ms);
+    Transfer* ptr = t.get();
+    transfers_.push_back(std::move(t));
+    start(ptr);
+}
+
+void HttpEngine::watch(Transfer* t, unsigned events) {
+    if (t->watched == events) return;
+    epoll_event ev = {};
+    ev.events = events;
+    ev.data.ptr = t;
+    epoll_ctl(epoll_fd_, t->watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, t->conn->fd, &ev);
+    t->watched = events;
+}
+
+void HttpEngine::release(Transfer* t, bool reusable) {
+    if (!t->conn) return;
+    if (t->watched) epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, t->conn->fd, nullptr);
+    t->watched = 0;
+    if (reusable) {
+        std::string key = t->conn->key;
+        idle_.emplace(key, std::move(t->conn));
+    }
+    t->conn.reset();
+}
+
+void HttpEngine::finish(Transfer* t, bool ok, const std::string& error) {
+    if (t->state == Transfer::State::DONE) return;
+    release(t, false);
+    if (t->file_fd != -1) {
+        close(t->file_fd);
+        t->file_fd = -1;
+        if (ok) ok = rename(t->part_path().c_str(), t->req.output_path.c_str()) == 0;
+        else unlink(t->part_path().c_str());
+    }
+    t->state = Transfer::State::DONE;
+    t->res.ok = ok;
+    t->res.error = error;
+    t->res.final_url = t->url;
+    if (!ok) log_debug("[engine] " + t->url + ": " + error);
+    if (t->req.on_complete) t->req.on_complete(t->res);
+}
+
+void HttpEngine::start(Transfer* t) {
+    t->reset_attempt();
+    if (!parse_url(t->url, t->protocol, t->host, t->path, t->port) || (t->protocol != "https" && t->protocol != "http")) {
+        return finish(t, false, "Unsupported URL: " + t->url);
+    }
+    // Pages are requested compressed; files are written as they come.
+    std::string extra_headers;
+    if (t->req.output_path.empty()) extra_headers = std::string("Accept-Encoding: ") + accepted_encodings() + "\r\n";
+    t->out = build_request("GET", authority(t->protocol, t->host, t->port), t->path, extra_headers);
+
+    std::string key = t->host + ":" + std::to_string(t->port);
+    auto range = idle_.equal_range(key);
+    for (auto it = range.first; it != range.second;) {
+        std::unique_ptr<EngineConn> c = std::move(it->second);
+        it = idle_.erase(it);
+        char buf[1];
+        int r = recv(c->fd, buf, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) continue;
+        t->conn = std::move(c);
+        t->reused = true;
+        t->state = Transfer::State::SENDING;
+        return drive(t);
+    }
+
+    // getaddrinfo() is blocking, but only runs once per host thanks to the shared DNS cache.
+    t->addrs = g_state.resolve(t->host, t->port);
+    if (t->addrs.empty()) return finish(t, false, "Could not resolve " + t->host);
+    connect_next(t);
+}
+
+// Connects to the next address of `t->addrs`. Addresses are tried one at a time: a
+// failed or slow connect moves on to the next one.
+void HttpEngine::connect_next(Transfer* t) {
+    release(t, false);
+    while (!t->addrs.empty()) {
+        t->addr = t->addrs.front();
+        t->addrs.erase(t->addrs.begin());
+        sockaddr_storage addr;
+        socklen_t len;
+        if (!make_sockaddr(t->addr, t->port, addr, len)) continue;
+
+        int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            // E.g. EAFNOSUPPORT for an IPv6 address on a host without IPv6.
+            log_debug("[engine] socket() for " + t->addr + " failed: " + strerror(errno));
+            continue;
+        }
+        int flag = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+        t->conn = std::make_unique<EngineConn>();
+        t->conn->fd = fd;
+        t->conn->key = t->host + ":" + std::to_string(t->port);
+        t->reused = false;
+        t->state = Transfer::State::CONNECTING;
+        t->connect_deadline = Clock::now() + ADDRESS_TIMEOUT;
+
+        if (connect(fd, (sockaddr*)&addr, len) < 0 && errno != EINPROGRESS) {
+            g_state.mark_address(t->host, t->addr, false);
+            t->conn.reset();
+            continue;
+        }
+        return watch(t, EPOLLOUT);
+    }
+    finish(t, false, "Could not connect to " + t->host);
+}
+
+void HttpEngine::drive(Transfer* t) {
+    using State = Transfer::State;
+
+    // A reused keep-alive connection that dies before answering was closed by the server
+    // while idle; retry once on a fresh connection.
+    auto io_failed = [&](const std::string& what) {
+        if (t->reused && !t->got_bytes) {
+            release(t, false);
+            log_debug("[engine] Stale connection to " + t->host + ". Reconnecting.");
+            return start(t);
+        }
+        finish(t, false, what);
+    };
+
+    while (t->state != State::DONE) {
+        switch (t->state) {
+        case State::CONNECTING: {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(t->conn->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err != 0) {
+                log_debug("[engine] Connecting to " + t->host + " at " + t->addr + " failed: " + strerror(err));
+                g_state.mark_address(t->host, t->addr, false);
+                return connect_next(t);
+            }
+            g_state.mark_address(t->host, t->addr, true);
+            if (t->protocol == "https") {
+                t->conn->ssl = SSL_new(g_state.ssl_ctx);
+                if (!t->conn->ssl || !ssl_set_socket(t->conn->ssl, t->conn->fd)) {
+                    return finish(t, false, "TLS setup failed");
+                }
+                SSL_set_tlsext_host_name(t->conn->ssl, t->host.c_str());
+                g_state.resume_session(t->conn->ssl, t->host, false);
+                t->state = State::HANDSHAKE;
+            } else {
+                t->state = State::SENDING;
+            }
+            break;
+        }
+        case State::HANDSHAKE: {
+            int r = SSL_connect(t->conn->ssl);
+            if (r == 1) {
+                g_state.save_session(t->conn->ssl, t->host);
+                t->state = State::SENDING;
+                break;
+            }
+            int e = SSL_get_error(t->conn->ssl, r);
+            if (e == SSL_ERROR_WANT_READ) return watch(t, EPOLLIN);
+            if (e == SSL_ERROR_WANT_WRITE) return watch(t, EPOLLOUT);
+            return finish(t, false, "TLS handshake failed");
+        }
+        case State::SENDING: {
+            while (t->out_pos < t->out.size()) {
+                const char* data = t->out.data() + t->out_pos;
+                int len = (int)(t->out.size() - t->out_pos);
+                int n;
+                if (t->conn->ssl) {
+                    n = SSL_write(t->conn->ssl, data, len);
+                    if (n <= 0) {
+                        int e = SSL_get_error(t->conn->ssl, n);
+                        if (e == SSL_ERROR_WANT_READ) return watch(t, EPOLLIN);
+                        if (e == SSL_ERROR_WANT_WRITE) return watch(t, EPOLLOUT);
+                        return io_failed("write failed");
+                    }
+                } else {
+                    n = send(t->conn->fd, data, len, MSG_NOSIGNAL);
+                    if (n < 0) {
+                        if (errno == EAGAIN || errno == EWOULDBLOCK) return watch(t, EPOLLOUT);
+                        return io_failed("write failed");
+                    }
+                }
+                t->out_pos += n;
+            }
+            t->state = State::HEAD;
+            break;
+        }
+        case State::HEAD:
+        case State::BODY: {
+            char buf[16384];
+            int n;
+            bool eof = false;
+            if (t->conn->ssl) {
+                n = SSL_read(t->conn->ssl, buf, sizeof(buf));
+                if (n <= 0) {
+                    int e = SSL_get_error(t->conn->ssl, n);
+                    if (e == SSL_ERROR_WANT_READ) return watch(t, EPOLLIN);
+                    if (e == SSL_ERROR_WANT_WRITE) return watch(t, EPOLLOUT);
+                    eof = true;
+                }
+            } else {
+                n = recv(t->conn->fd, buf, sizeof(buf), 0);
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return watch(t, EPOLLIN);
+                if (n <= 0) eof = true;
+            }
+
+            if (eof) {
+                if (t->state == State::BODY && t->head.content_length < 0 && !t->head.chunked) {
+                    // Body delimited by connection close.
+                    return complete(t, false);
+                }
+                return io_failed("connection closed before the response was complete");
+            }
+
+            t->got_bytes = true;
+            t->in.append(buf, n);
+            if (!parse(t)) return;
+            break;
+        }
+        case State::DONE:
+            return;
+        }
+    }
+}
+
+bool HttpEngine::emit(Transfer* t, const char* data, size_t len) {
+    if (len == 0 || t->discard) return true;
+    if (!t->decoder) return deliver(t, data, len);
+    if (t->decoder->feed(data, len, [&](const char* out, size_t n) { return deliver(t, out, n); })) return true;
+    if (!t->decoder->stopped()) finish(t, false, "corrupt compressed body");
+    return false;
+}
+
+bool HttpEngine::deliver(Transfer* t, const char* data, size_t len) {
+    t->res.bytes += len;
+    if (t->file_fd != -1) {
+        while (len > 0) {
+            ssize_t w = write(t->file_fd, data, len);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) {
+                finish(t, false, "write failed");
+                return false;
+            }
+            data += w;
+            len -= w;
+        }
+    } else if (t->req.on_data) {
+        if (!t->req.on_data(data, len)) {
+            log_debug("[engine] " + t->url + ": Stopped reading after " + std::to_string(t->res.bytes) + " bytes.");
+            finish(t, true);
+            return false;
+        }
+    } else {
+        t->res.body.append(data, len);
+    }
+    return true;
+}
+
+bool HttpEngine::parse(Transfer* t) {
+    using State = Transfer::State;
+    using Chunk = Transfer::Chunk;
+
+    if (t->state == State::HEAD) {
+        size_t end = t->in.find("\r\n\r\n");
+        if (end == std::string::npos) {
+            if (t->in.size() > 65536) { finish(t, false, "response headers too large"); return false; }
+            return true;
+        }
+
+        size_t line_end = t->in.find("\r\n");
+        sscanf(t->in.c_str(), "HTTP/%*f %d", &t->head_response.status_code);
+        size_t pos = line_end + 2;
+        while (pos < end) {
+            size_t next = t->in.find("\r\n", pos);
+            parse_header_line(t->in.substr(pos, next - pos), t->head_response, t->head);
+            pos = next + 2;
+        }
+        t->in.erase(0, end + 4);
+
+        int status = t->head_response.status_code;
+        if (status >= 100 && status < 200) {
+            t->head_response = HttpResponse();
+            t->head = ResponseHead();
+            return parse(t);
+        }
+
+        t->res.status_code = status;
+        t->res.headers = t->head_response.headers;
+        if (status >= 300 && status < 400 && t->head_response.headers.count("location") && t->redirects < t->req.max_redirects) {
+            t->redirect_to = absolute_location(t->protocol, authority(t->protocol, t->host, t->port),
+                                               t->head_response.headers["location"]);
+            t->discard = true;
+        } else if (status != 200) {
+            t->discard = true;
+        } else if (!t->req.output_path.empty()) {
+            t->file_fd = open(t->part_path().c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (t->file_fd < 0) { finish(t, false, "Cannot open " + t->part_path()); return false; }
+        } else if (t->head_response.headers.count("content-encoding")) {
+            const std::string& encoding = t->head_response.headers["content-encoding"];
+            t->decoder = std::make_unique<ContentDecoder>();
+            if (!t->decoder->start(encoding)) { finish(t, false, "unsupported Content-Encoding: " + encoding); return false; }
+            if (!t->decoder->active()) t->decoder.reset();
+        }
+
+        if (status == 204 || status == 304) t->head.content_length = 0;
+        t->remaining = t->head.content_length;
+        t->state = State::BODY;
+        if (t->remaining == 0) { complete(t, true); return false; }
+    }
+
+    if (t->head.chunked) {
+        while (true) {
+            if (t->chunk == Chunk::SIZE || t->chunk == Chunk::TRAILER) {
+                size_t eol = t->in.find("\r\n");
+                if (eol == std::string::npos) return true;
+                std::string line = t->in.substr(0, eol);
+                t->in.erase(0, eol + 2);
+                if (t->chunk == Chunk::TRAILER) {
+                    if (line.empty()) { complete(t, true); return false; }
+                    continue;
+                }
+                t->chunk_left = strtoll(line.c_str(), nullptr, 16);
+                t->chunk = (t->chunk_left == 0) ? Chunk::TRAILER : Chunk::DATA;
+            } else if (t->chunk == Chunk::DATA) {
+                size_t take = (size_t)std::min<long long>(t->chunk_left, t->in.size());
+                if (!emit(t, t->in.data(), take)) return false;
+                t->in.erase(0, take);
+                t->chunk_left -= take;
+                if (t->chunk_left > 0) return true;
+                t->chunk = Chunk::DATA_END;
+            } else {
+                if (t->in.size() < 2) return true;
+                t->in.erase(0, 2);
+                t->chunk = Chunk::SIZE;
+            }
+        }
+    }
+
+    if (t->remaining >= 0) {
+        size_t take = (size_t)std::min<long long>(t->remaining, t->in.size());
+        if (!emit(t, t->in.data(), take)) return false;
+        t->in.erase(0, take);
+        t->remaining -= take;
+        if (t->remaining == 0) { complete(t, true); return false; }
+        return true;
+    }
+
+    if (!emit(t, t->in.data(), t->in.size())) return false;
+    t->in.clear();
+    return true;
+}
+
+void HttpEngine::complete(Transfer* t, bool reusable) {
+    release(t, reusable && !t->head.connection_close);
+    if (!t->redirect_to.empty()) {
+        ++t->redirects;
+        t->url = t->redirect_to;
+        log_debug("[engine] Redirected to " + t->url);
+        return start(t);
+    }
+    int status = t->res.status_code;
+    finish(t, status == 200, status == 200 ? "" : "HTTP " + std::to_string(status));
+}
+
+void HttpEngine::run() {
+    epoll_event events[128];
+    while (true) {
+        transfers_.erase(std::remove_if(transfers_.begin(), transfers_.end(),
+                                        [](const std::unique_ptr<Transfer>& t) { return t->state == Transfer::State::DONE; }),
+                         transfers_.end());
+        if (transfers_.empty()) break;
+
+        auto now = Clock::now();
+        auto next_deadline = transfers_.front()->deadline;
+        for (const auto& t : transfers_) {
+            next_deadline = std::min(next_deadline, t->deadline);
+            if (t->state == Transfer::State::CONNECTING && !t->addrs.empty()) {
+                next_deadline = std::min(next_deadline, t->connect_deadline);
+            }
+        }
+        long wait_ms = std::chrono::duration_cast<std::chrono::milliseconds>(next_deadline - now).count();
+        if (wait_ms < 0) wait_ms = 0;
+
+        int n = epoll_wait(epoll_fd_, events, 128, (int)std::min<long>(wait_ms + 1, 1000));
+        for (int i = 0; i < n; ++i) {
+            Transfer* t = static_cast<Transfer*>(events[i].data.ptr);
+            if (t->state != Transfer::State::DONE) drive(t);
+        }
+
+        // Callbacks may have submitted new transfers; iterate by index since the vector can grow.
+        now = Clock::now();
+        for (size_t i = 0; i < transfers_.size(); ++i) {
+            Transfer* t = transfers_[i].get();
+            if (t->state == Transfer::State::DONE) continue;
+            if (t->deadline <= now) {
+                finish(t, false, "timed out");
+            } else if (t->state == Transfer::State::CONNECTING && !t->addrs.empty() && t->connect_deadline <= now) {
+                log_debug("[engine] Connecting to " + t->host + " at " + t->addr + " timed out. Trying the next address.");
+                g_state.mark_address(t->host, t->addr, false);
+                connect_next(t);
+            }
+        }
+    }
+}
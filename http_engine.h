@@ -0,0 +1,68 @@
+#ifndef HTTP_ENGINE_H
+#define HTTP_ENGINE_H
+
+#include <string>
+#include <map>
+#include <memory>
+#include <vector>
+#include <functional>
+
+struct AsyncResponse {
+    bool ok = false;
+    int status_code = 0;
+    std::string final_url;
+    std::map<std::string, std::string> headers;
+    std::string body;        // Empty when the body was written to a file or passed to on_data
+    long long bytes = 0;     // Body bytes received, after any Content-Encoding is decoded
+    std::string error;
+};
+
+struct AsyncRequest {
+    std::string url;
+    int max_redirects = 5;
+    // When set, the body is streamed into "<output_path>.part" and renamed on success.
+    std::string output_path;
+    // When set, the body of a 200 response is passed here as it arrives instead of being
+    // collected. Returning false ends the transfer early (successfully) and closes its connection.
+    std::function<bool(const char*, size_t)> on_data;
+    // Deadline for the whole request, redirects included.
+    int timeout_ms = 30000;
+    std::function<void(const AsyncResponse&)> on_complete;
+};
+
+// Event-driven HTTP/1.1 client: non-blocking sockets and non-blocking OpenSSL multiplexed
+// with epoll, so one thread can drive hundreds of transfers at once.
+// Idle keep-alive connections are reused between requests to the same host.
+// Not thread-safe: submit() and run() must be called from the same thread.
+// Callbacks run on that thread and may submit further requests.
+class HttpEngine {
+public:
+    HttpEngine();
+    ~HttpEngine();
+
+    void submit(AsyncRequest request);
+
+    // Runs the event loop until every submitted request (including ones submitted from callbacks) completes.
+    void run();
+
+    struct Transfer;
+    struct EngineConn;
+
+private:
+    void start(Transfer* t);
+    void connect_next(Transfer* t);
+    void drive(Transfer* t);
+    bool parse(Transfer* t);
+    bool emit(Transfer* t, const char* data, size_t len);
+    bool deliver(Transfer* t, const char* data, size_t len);
+    void complete(Transfer* t, bool reusable);
+    void finish(Transfer* t, bool ok, const std::string& error = "");
+    void watch(Transfer* t, unsigned events);
+    void release(Transfer* t, bool reusable);
+
+    int epoll_fd_ = -1;
+    std::vector<std::unique_ptr<Transfer>> transfers_;
+    std::multimap<std::string, std::unique_ptr<EngineConn>> idle_;
+};
+
+#endif
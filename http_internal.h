@@ -0,0 +1,395 @@
+#ifndef HTTP_INTERNAL_H
+#define HTTP_INTERNAL_H
+
+// Connection-level plumbing shared by http_client.cpp and downloader.cpp.
+// Not part of the public interface in http_client.h.
+
+#include "http_client.h"
+#include "http2.h"
+#include "trace.h"
+#include "host_limiter.h"
+#include "connection_pool.h"
+#include <string>
+#include <map>
+#include <set>
+#include <vector>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <fstream>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+
+struct Connection {
+    int socket_fd = -1;
+    SSL* ssl = nullptr;
+    std::string host;
+    int port = 0;
+    bool is_closed = false;
+    std::chrono::steady_clock::time_point idle_since;  // When it was last put back in the pool
+
+    ~Connection() { close_conn(); }
+
+    void close_conn() {
+        if (ssl) { SSL_shutdown(ssl); SSL_free(ssl); ssl = nullptr; }
+        if (socket_fd != -1) { close(socket_fd); socket_fd = -1; }
+        is_closed = true;
+    }
+};
+
+// Called by OpenSSL whenever a server issues a session, including TLS 1.3 tickets that
+// arrive after the handshake.
+int on_new_session(SSL* ssl, SSL_SESSION* session);
+
+// Attaches `fd` to `ssl` like SSL_set_fd(), except that writes go through send() with
+// MSG_NOSIGNAL: a peer that dropped the connection is an error, not a SIGPIPE that kills
+// the process embedding the library. Reads keep the socket BIO, which kTLS needs.
+bool ssl_set_socket(SSL* ssl, int fd);
+
+// Shared by all worker threads. The pool hands out connections exclusively:
+// get_connection() checks an idle connection out of the pool (or opens a new one)
+// and release_connection() checks it back in once the response is fully read.
+// HTTP/2 connections are shared instead: get_h2_connection() returns the one multiplexed
+// connection per host, and hosts that do not negotiate h2 are remembered in `h1_only`.
+struct GlobalState {
+    SSL_CTX* ssl_ctx = nullptr;
+    std::mutex mtx;
+    ConnectionPool pool;  // Has its own locks; `mtx` guards the rest
+    std::map<std::string, std::shared_ptr<H2Connection>> h2_pool;
+    std::set<std::string> h1_only;
+    // Hosts ("host:port") with an HTTP/2 handshake in progress. Concurrent requests to the same
+    // host wait on `h2_connect_cv` and share its result; other hosts are not held up.
+    std::set<std::string> h2_connecting;
+    std::condition_variable h2_connect_cv;
+    bool http2 = true;
+    bool ktls = false;
+    struct DnsEntry {
+        std::vector<std::string> addrs;  // IPv4 and IPv6, in connect order: last winner first
+        long long expires = 0;           // Unix time
+    };
+    std::map<std::string, DnsEntry> dns_cache;
+    // Addresses that recently failed to connect, and when they may be tried first again.
+    std::map<std::string, std::chrono::steady_clock::time_point> addr_down_until;
+    // Keyed by "<host>/<ALPN protocol the session negotiated>" ("<host>" without ALPN): early
+    // data is only allowed when that protocol is offered again, so an h2 session must not be
+    // resumed on an HTTP/1.1-only connection.
+    std::map<std::string, SSL_SESSION*> session_cache;
+
+    // Sessions and DNS answers are kept in <cache_dir()>/network between runs: loaded on
+    // first use, merged back atomically at exit.
+    bool persist = true;
+    bool persist_loaded = false;
+    bool persist_dirty = false;
+
+    // prefetch_host() threads still running; the pool tracks which hosts they connect to.
+    int prefetch_threads = 0;
+    std::condition_variable prefetch_cv;
+
+    // Every request takes a HostPermit from here first.
+    HostLimiter limiter;
+
+    GlobalState() {
+        SSL_library_init();
+        ssl_ctx = SSL_CTX_new(TLS_client_method());
+        if (ssl_ctx) {
+            SSL_CTX_set_default_verify_paths(ssl_ctx);
+            SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+            SSL_CTX_sess_set_new_cb(ssl_ctx, on_new_session);
+            SSL_CTX_set_mode(ssl_ctx, SSL_MODE_RELEASE_BUFFERS); 
+        }
+    }
+
+    // No I/O here: other translation units' statics may already be gone. The network cache
+    // is saved by save_network_cache() before exit.
+    ~GlobalState() {
+        h2_pool.clear();
+        pool.clear();
+        for (auto& kv : session_cache) SSL_SESSION_free(kv.second);
+        if (ssl_ctx) SSL_CTX_free(ssl_ctx);
+    }
+
+    // `early_request` is an idempotent request to send as TLS 1.3 early data if a new
+    // connection has to be opened and the cached session allows it. `request_sent` then
+    // tells whether the server accepted it; if not, the caller sends the request normally.
+    std::unique_ptr<Connection> get_connection(const std::string& host, int port, bool use_ssl,
+                                               const std::string* early_request = nullptr, bool* request_sent = nullptr);
+    // Returns the HTTP/2 connection to `host`, or nullptr if HTTP/2 is disabled or the
+    // server does not speak it. The caller then falls back to get_connection().
+    std::shared_ptr<H2Connection> get_h2_connection(const std::string& host, int port);
+    std::unique_ptr<Connection> open_connection(const std::string& host, int port, bool use_ssl, bool offer_h2,
+                                                const std::string* early_request = nullptr, bool* request_sent = nullptr);
+    void release_connection(std::unique_ptr<Connection> conn);
+    // Closes the HTTP/1.1 and HTTP/2 connections idle for longer than the pool's timeout.
+    // Returns how many were closed. Also drops finished address cooldowns and the limiter
+    // state of hosts idle for a while, so a daemon's bookkeeping does not grow without bound.
+    int evict_idle();
+    void save_session(SSL* ssl, const std::string& host);
+    // Takes ownership of `session`.
+    void store_session(const std::string& host, SSL_SESSION* session);
+    // Picks a saved session the ALPN offer is compatible with: `offer_h2` offers "h2" and
+    // "http/1.1", otherwise only "http/1.1" (or nothing) is offered.
+    void resume_session(SSL* ssl, const std::string& host, bool offer_h2);
+    // Returns the addresses of `host` in the order to try them, resolving when unknown or
+    // expired: families interleaved (RFC 8305), the last address that worked first, addresses
+    // in their cooldown last. Empty on failure.
+    std::vector<std::string> resolve(const std::string& host, int port);
+    // Records a connect result. A reachable address becomes the first one tried for `host`;
+    // an unreachable one goes to the back of the list for a while.
+    void mark_address(const std::string& host, const std::string& addr, bool reachable);
+    // Races TCP connects to the addresses of `host`, starting the next one whenever the
+    // previous has not connected within 250 ms. Returns the connected blocking socket, or -1.
+    int connect_host(const std::string& host, int port);
+    // Expects `mtx` to be held.
+    void load_persistent();
+    // Takes `mtx` only to copy the caches; the file is written without holding it.
+    void save_persistent();
+};
+
+extern GlobalState g_state;
+
+// Seconds from the Retry-After header of `response`, 0 if it has none.
+double retry_after(const HttpResponse& response);
+
+// pwrite() that counts its time as the "write" phase of the current trace.
+inline ssize_t timed_pwrite(int fd, const void* buf, size_t n, off_t offset) {
+    if (!g_trace_enabled) return pwrite(fd, buf, n, offset);
+    auto start = TraceClock::now();
+    ssize_t w = pwrite(fd, buf, n, offset);
+    trace_time("write", std::chrono::duration<double>(TraceClock::now() - start).count());
+    return w;
+}
+
+struct BufferedStream {
+    Connection* conn;
+    char buffer[16384];
+    int pos = 0;
+    int end = 0;
+    bool error = false;
+    bool write_error = false; // A write to the file failed (error is set too)
+    bool clean_eof = false;   // The peer ended the stream properly: a FIN, or a TLS close_notify
+    bool chunk_open = false;  // next_chunk() still has to read the CRLF after a chunk's data
+
+    BufferedStream(Connection* c) : conn(c) {}
+
+    int fill() {
+        if (pos < end) {
+            memmove(buffer, buffer + pos, end - pos);
+            end -= pos;
+        } else {
+            end = 0;
+        }
+        pos = 0;
+
+        int r = 0;
+        if (conn->ssl) {
+            r = SSL_read(conn->ssl, buffer + end, sizeof(buffer) - end);
+        } else {
+            r = recv(conn->socket_fd, buffer + end, sizeof(buffer) - end, 0);
+        }
+
+        if (r <= 0) {
+            // A timeout, a reset or a TLS stream cut off without close_notify is not the end
+            // of a body that is delimited by the end of the connection.
+            clean_eof = conn->ssl ? SSL_get_error(conn->ssl, r) == SSL_ERROR_ZERO_RETURN : r == 0;
+            error = true;
+            conn->close_conn();
+        } else {
+            end += r;
+        }
+        return r;
+    }
+
+    std::string read_line() {
+        std::string line;
+        while (!error) {
+            if (pos >= end) if (fill() <= 0) break;
+            
+            char* newline = (char*)memchr(buffer + pos, '\n', end - pos);
+            if (newline) {
+                int len = newline - (buffer + pos) + 1;
+                line.append(buffer + pos, len);
+                pos += len;
+                return line;
+            }
+            line.append(buffer + pos, end - pos);
+            pos = end;
+        }
+        return line;
+    }
+
+    // Chunked transfer coding: call once the previous chunk's data has been read. Returns the
+    // size of the next chunk, 0 once the last chunk and its trailers are consumed, or -1 if
+    // the framing is malformed or the connection broke.
+    long long next_chunk() {
+        if (chunk_open && read_line() != "\r\n") return -1;
+        std::string line = read_line();
+        char* digits_end = nullptr;
+        long long size = std::strtoll(line.c_str(), &digits_end, 16);
+        if (error || digits_end == line.c_str() || size < 0) return -1;
+        chunk_open = size > 0;
+        if (size == 0) {
+            while (!error && (line = read_line()) != "\r\n" && line != "\n") {}
+            if (error) return -1;
+        }
+        return size;
+    }
+
+    void read_exact(std::string& out, long n) {
+        long target = out.size() + n;
+        out.reserve(target);
+        while (n > 0 && !error) {
+            if (pos >= end) if (fill() <= 0) break;
+            
+            int avail = end - pos;
+            int to_copy = (avail < n) ? avail : n;
+            out.append(buffer + pos, to_copy);
+            pos += to_copy;
+            n -= to_copy;
+        }
+    }
+
+    // Passes up to `n` body bytes (all bytes until EOF if `n` is negative) to `sink` as they
+    // arrive. Returns false if `sink` asked to stop.
+    template <typename Sink>
+    bool read_to_sink(long long n, Sink&& sink) {
+        while (n != 0 && !error) {
+            if (pos >= end) if (fill() <= 0) break;
+
+            int take = (n < 0 || end - pos < n) ? end - pos : (int)n;
+            bool more = sink(buffer + pos, (size_t)take);
+            pos += take;
+            if (n > 0) n -= take;
+            if (!more) return false;
+        }
+        return true;
+    }
+
+    bool read_to_file(std::ofstream& outfile) {
+        if (pos < end) {
+            outfile.write(buffer + pos, end - pos);
+            pos = end;
+        }
+        while (true) {
+            int r = (conn->ssl) ? SSL_read(conn->ssl, buffer, sizeof(buffer)) : recv(conn->socket_fd, buffer, sizeof(buffer), 0);
+            if (r <= 0) break;
+            outfile.write(buffer, r);
+        }
+        return true;
+    }
+
+    // Writes up to `n` body bytes at `offset` in `fd` (pwrite, so several streams can
+    // fill one file concurrently). Returns the number of bytes written.
+    long long read_to_fd(int fd, off_t offset, long long n) {
+        long long written = 0;
+        while (written < n && !error) {
+            if (pos >= end) if (fill() <= 0) break;
+
+            long long avail = end - pos;
+            int to_write = (int)((avail < n - written) ? avail : n - written);
+            ssize_t w = timed_pwrite(fd, buffer + pos, to_write, offset + written);
+            if (w <= 0) { error = write_error = true; break; }
+            pos += w;
+            written += w;
+        }
+        return written;
+    }
+
+    // True when the kernel decrypts this connection (kTLS receive offload), so the socket
+    // itself carries plaintext and splice_to_fd() can be used.
+    bool ktls_recv() const {
+        return conn->ssl && BIO_get_ktls_recv(SSL_get_rbio(conn->ssl));
+    }
+
+    // Same contract as read_to_fd(), but moves the body socket -> pipe -> file with splice()
+    // so it never passes through user space. Bytes OpenSSL or this buffer already hold are
+    // written out normally first. Requires ktls_recv().
+    long long splice_to_fd(int fd, off_t offset, long long n) {
+        int pipefd[2];
+        if (pipe2(pipefd, O_CLOEXEC) != 0) return read_to_fd(fd, offset, n);
+
+        long long written = 0;
+        while (written < n && !error) {
+            if (pos < end) {
+                written += read_to_fd(fd, offset + written, std::min<long long>(end - pos, n - written));
+                continue;
+            }
+            if (SSL_pending(conn->ssl) > 0) {
+                fill();
+                continue;
+            }
+
+            ssize_t in = splice(conn->socket_fd, nullptr, pipefd[1], nullptr,
+                                (size_t)std::min<long long>(n - written, 1 << 20), SPLICE_F_MOVE);
+            if (in < 0 && errno == EIO) {
+                // A TLS control record (alert, session ticket, key update) cannot be spliced.
+                // SSL_read handles it and returns the application data that follows.
+                fill();
+                continue;
+            }
+            if (in <= 0) {
+                error = true;
+                conn->close_conn();
+                break;
+            }
+            while (in > 0) {
+                loff_t out_offset = offset + written;
+                ssize_t out = splice(pipefd[0], nullptr, fd, &out_offset, in, SPLICE_F_MOVE);
+                if (out <= 0) {
+                    // The rest of the body is stuck in the pipe, so the connection is unusable.
+                    error = write_error = true;
+                    conn->close_conn();
+                    break;
+                }
+                in -= out;
+                written += out;
+            }
+        }
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return written;
+    }
+};
+
+// Framing information taken from the response headers.
+struct ResponseHead {
+    long long content_length = -1;
+    bool chunked = false;
+    bool connection_close = false;
+};
+
+std::string get_random_user_agent();
+
+std::string to_lower(std::string s);
+
+// Builds an HTTP/1.1 request. `extra_headers` are complete "Name: value\r\n" lines.
+std::string build_request(const std::string& method, const std::string& host, const std::string& path,
+                          const std::string& extra_headers = "", bool keep_alive = true);
+
+// "host", or "host:port" when the port is not the default one of `protocol`, for the Host
+// header, :authority and relative redirects.
+std::string authority(const std::string& protocol, const std::string& host, int port);
+
+// Turns a Location header value into an absolute URL.
+std::string absolute_location(const std::string& protocol, const std::string& authority, std::string loc);
+
+bool send_request(Connection* conn, const std::string& req);
+
+// Fills in a socket address for a numeric IPv4 or IPv6 address. False if `ip` is neither.
+bool make_sockaddr(const std::string& ip, int port, sockaddr_storage& addr, socklen_t& len);
+
+// Parses one "Name: value" header line into `response` and updates the framing in `head`.
+void parse_header_line(const std::string& line, HttpResponse& response, ResponseHead& head);
+
+// Reads the status line and headers into `response` and fills in the body framing.
+// Returns false if the connection failed before a status line arrived.
+bool read_response_head(BufferedStream& stream, HttpResponse& response, ResponseHead& head);
+
+#endif
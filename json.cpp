@@ -0,0 +1,127 @@
+#include "json.h"
+#include <cstdio>
+#include <cctype>
+
+std::string json_escape(const std::string& s) {
+    std::string out;
+    out.reserve(s.size() + 8);
+    for (unsigned char c : s) {
+        switch (c) {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (c < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    out += buf;
+                } else {
+                    out += (char)c;
+                }
+        }
+    }
+    return out;
+}
+
+static void skip_ws(const std::string& t, size_t& i) {
+    while (i < t.size() && std::isspace((unsigned char)t[i])) ++i;
+}
+
+static void append_utf8(std::string& out, unsigned cp) {
+    if (cp < 0x80) {
+        out += (char)cp;
+    } else if (cp < 0x800) {
+        out += (char)(0xC0 | (cp >> 6));
+        out += (char)(0x80 | (cp & 0x3F));
+    } else {
+        out += (char)(0xE0 | (cp >> 12));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        out += (char)(0x80 | (cp & 0x3F));
+    }
+}
+
+static bool parse_string(const std::string& t, size_t& i, std::string& out) {
+    if (i >= t.size() || t[i] != '"') return false;
+    ++i;
+    while (i < t.size()) {
+        char c = t[i++];
+        if (c == '"') return true;
+        if (c != '\\') { out += c; continue; }
+        if (i >= t.size()) return false;
+        char e = t[i++];
+        switch (e) {
+            case 'n': out += '\n'; break;
+            case 'r': out += '\r'; break;
+            case 't': out += '\t'; break;
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'u': {
+                if (i + 4 > t.size()) return false;
+                unsigned cp = 0;
+                if (sscanf(t.c_str() + i, "%4x", &cp) != 1) return false;
+                i += 4;
+                append_utf8(out, cp);
+                break;
+            }
+            default: out += e;
+        }
+    }
+    return false;
+}
+
+// Moves `i` past the object or array starting at `i`.
+static bool skip_nested(const std::string& t, size_t& i) {
+    int depth = 0;
+    while (i < t.size()) {
+        char c = t[i];
+        if (c == '"') {
+            std::string ignored;
+            if (!parse_string(t, i, ignored)) return false;
+            continue;
+        }
+        ++i;
+        if (c == '{' || c == '[') ++depth;
+        else if ((c == '}' || c == ']') && --depth == 0) return true;
+    }
+    return false;
+}
+
+bool json_parse_object(const std::string& text, std::map<std::string, std::string>& out) {
+    size_t i = 0;
+    skip_ws(text, i);
+    if (i >= text.size() || text[i] != '{') return false;
+    ++i;
+    skip_ws(text, i);
+    if (i < text.size() && text[i] == '}') return true;
+
+    while (i < text.size()) {
+        std::string key, value;
+        skip_ws(text, i);
+        if (!parse_string(text, i, key)) return false;
+        skip_ws(text, i);
+        if (i >= text.size() || text[i] != ':') return false;
+        ++i;
+        skip_ws(text, i);
+        if (i < text.size() && text[i] == '"') {
+            if (!parse_string(text, i, value)) return false;
+        } else if (i < text.size() && (text[i] == '{' || text[i] == '[')) {
+            size_t start = i;
+            if (!skip_nested(text, i)) return false;
+            value = text.substr(start, i - start);
+        } else {
+            size_t start = i;
+            while (i < text.size() && text[i] != ',' && text[i] != '}' && !std::isspace((unsigned char)text[i])) ++i;
+            if (i == start) return false;
+            value = text.substr(start, i - start);
+        }
+        out[key] = value;
+        skip_ws(text, i);
+        if (i >= text.size()) return false;
+        if (text[i] == '}') return true;
+        if (text[i] != ',') return false;
+        ++i;
+    }
+    return false;
+}
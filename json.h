@@ -0,0 +1,15 @@
+#ifndef JSON_H
+#define JSON_H
+
+#include <string>
+#include <map>
+
+// Escapes a string for use inside a JSON string literal (without the quotes).
+std::string json_escape(const std::string& s);
+
+// Parses a flat JSON object such as {"url":"...","thumbnail":true}.
+// String values are unescaped; numbers, booleans and null are stored as their raw text,
+// and so are nested objects and arrays (not parsed further).
+bool json_parse_object(const std::string& text, std::map<std::string, std::string>& out);
+
+#endif
@@ -0,0 +1,213 @@
+#include "logger.h"
+#include "json.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+
+struct Record {
+    LogKind kind = LogKind::NORMAL;
+    double time = 0;  // Unix time, for the JSON format
+    int thread = 0;
+    std::string message;
+};
+
+// Bounded multi-producer, single-consumer ring. A producer claims position `p` with a CAS
+// on `tail_`; the sequence number of its slot then goes from p (free) to p + 1 (filled),
+// and back to p + capacity once the writer has taken the record.
+class LogRing {
+public:
+    explicit LogRing(size_t capacity) : slots_(capacity), mask_(capacity - 1) {
+        for (size_t i = 0; i < capacity; ++i) slots_[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    // False if the ring is full.
+    bool push(Record& record) {
+        size_t pos = tail_.load(std::memory_order_relaxed);
+        while (true) {
+            Slot& slot = slots_[pos & mask_];
+            size_t seq = slot.seq.load(std::memory_order_acquire);
+            if (seq == pos) {
+                if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    slot.record = std::move(record);
+                    slot.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (seq < pos) {
+                return false;
+            } else {
+                pos = tail_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Only called by the writer thread.
+    bool pop(Record& record) {
+        Slot& slot = slots_[head_ & mask_];
+        if (slot.seq.load(std::memory_order_acquire) != head_ + 1) return false;
+        record = std::move(slot.record);
+        slot.seq.store(head_ + slots_.size(), std::memory_order_release);
+        ++head_;
+        return true;
+    }
+
+    bool empty() const {
+        return slots_[head_ & mask_].seq.load(std::memory_order_acquire) != head_ + 1;
+    }
+
+private:
+    struct Slot {
+        std::atomic<size_t> seq{0};
+        Record record;
+    };
+    std::vector<Slot> slots_;
+    size_t mask_;
+    std::atomic<size_t> tail_{0};
+    size_t head_ = 0;
+};
+
+LogFormat g_format = LogFormat::TEXT;
+
+void write_record(const Record& r) {
+    FILE* out = (r.kind == LogKind::NORMAL || r.kind == LogKind::OUTPUT) ? stdout : stderr;
+    if (r.kind == LogKind::OUTPUT) {
+        fputs(r.message.c_str(), out);
+        return;
+    }
+
+    if (g_format == LogFormat::TEXT) {
+        const char* prefix = r.kind == LogKind::DEBUG ? "[DEBUG] " : r.kind == LogKind::ERROR ? "ERROR: " : "";
+        fprintf(out, "%s%s\n", prefix, r.message.c_str());
+        return;
+    }
+
+    // Messages start with their component, as in "[http] Fetching: ...".
+    std::string tag, message = r.message;
+    size_t close = message.find("] ");
+    if (message.size() > 1 && message[0] == '[' && close != std::string::npos && close < 20) {
+        tag = message.substr(1, close - 1);
+        message.erase(0, close + 2);
+    }
+    const char* level = r.kind == LogKind::DEBUG ? "debug" : r.kind == LogKind::ERROR ? "error" : "info";
+    fprintf(stderr, "{\"time\":%.3f,\"level\":\"%s\",\"thread\":%d,%s\"message\":\"%s\"}\n", r.time, level, r.thread,
+            tag.empty() ? "" : ("\"tag\":\"" + json_escape(tag) + "\",").c_str(), json_escape(message).c_str());
+}
+
+// Drains the ring on a background thread, so callers never wait for the terminal or a pipe.
+// The writer stops at exit; lines logged after that are written directly.
+class LogWriter {
+public:
+    LogWriter() : ring_(4096) {
+        thread_ = std::thread([this] { run(); });
+        std::atexit([] { instance().stop(); });
+    }
+
+    static LogWriter& instance() {
+        // Never destroyed: threads may still log while static objects are torn down.
+        static LogWriter* writer = new LogWriter();
+        return *writer;
+    }
+
+    void write(Record& record) {
+        producers_.fetch_add(1);
+        if (stopped_.load()) {
+            producers_.fetch_sub(1);
+            std::lock_guard<std::mutex> lock(mtx_);
+            write_record(record);
+            fflush(record.kind == LogKind::NORMAL || record.kind == LogKind::OUTPUT ? stdout : stderr);
+            return;
+        }
+        // A full ring holds the caller back rather than dropping lines.
+        while (!ring_.push(record)) {
+            wake();
+            std::this_thread::yield();
+        }
+        producers_.fetch_sub(1);
+        if (sleeping_.load()) wake();
+    }
+
+private:
+    void wake() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        cv_.notify_one();
+    }
+
+    // Writes everything queued and flushes once per batch instead of once per line.
+    void drain() {
+        Record record;
+        bool wrote = false;
+        while (ring_.pop(record)) {
+            write_record(record);
+            wrote = true;
+        }
+        if (wrote) {
+            fflush(stdout);
+            fflush(stderr);
+        }
+    }
+
+    void run() {
+        while (true) {
+            drain();
+            std::unique_lock<std::mutex> lock(mtx_);
+            if (stopping_) break;
+            sleeping_.store(true);
+            if (ring_.empty()) cv_.wait_for(lock, std::chrono::milliseconds(100));
+            sleeping_.store(false);
+        }
+    }
+
+    void stop() {
+        stopped_.store(true);
+        // Producers that saw the writer running finish their push first.
+        while (producers_.load() > 0) std::this_thread::yield();
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            stopping_ = true;
+            cv_.notify_one();
+        }
+        thread_.join();
+        std::lock_guard<std::mutex> lock(mtx_);
+        drain();
+    }
+
+    LogRing ring_;
+    std::thread thread_;
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::atomic<bool> sleeping_{false};
+    std::atomic<bool> stopped_{false};
+    std::atomic<int> producers_{0};
+    bool stopping_ = false;
+};
+
+}  // namespace
+
+std::atomic<LogLevel> g_log_level{LogLevel::NORMAL};
+
+void set_log_format(LogFormat format) {
+    g_format = format;
+}
+
+int thread_number() {
+    static std::atomic<int> next{1};
+    static thread_local int number = next++;
+    return number;
+}
+
+void log_write(LogKind kind, std::string message) {
+    Record record;
+    record.kind = kind;
+    record.message = std::move(message);
+    record.thread = thread_number();
+    if (g_format == LogFormat::JSON) {
+        record.time = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+    LogWriter::instance().write(record);
+}
@@ -1,8 +1,9 @@
 #ifndef LOGGER_H
 #define LOGGER_H
 
+#include <atomic>
 #include <string>
-#include <iostream>
+#include <utility>
 
 // Three logging levels for our binary
 enum class LogLevel {
@@ -12,28 +13,49 @@ enum class LogLevel {
 };
 
 // Global variable for the current logging level.
-// "extern" means it will be defined in one of the .cpp files.
-extern LogLevel g_log_level;
-
-// Function for DEBUG output
-inline void log_debug(const std::string& message) {
-    if (g_log_level == LogLevel::DEBUG) {
-        std::cerr << "[DEBUG] " << message << std::endl;
-    }
-}
+// "extern" means it will be defined in one of the .cpp files. Atomic: a PinClient may
+// set it while other threads are logging.
+extern std::atomic<LogLevel> g_log_level;
 
-// Function for NORMAL and DEBUG output
-inline void log_normal(const std::string& message) {
-    if (g_log_level >= LogLevel::NORMAL) {
-        std::cout << message << std::endl;
-    }
-}
+enum class LogKind {
+    DEBUG,   // stderr, "[DEBUG] " prefix
+    NORMAL,  // stdout
+    ERROR,   // stderr, "ERROR: " prefix
+    OUTPUT   // stdout as is, even with --clear (batch result lines)
+};
+
+enum class LogFormat {
+    TEXT,  // Default
+    JSON   // --log-json: {"time":...,"level":"debug","thread":3,"tag":"http","message":"..."} on stderr
+};
+
+void set_log_format(LogFormat format);
+
+// Queues a line for the writer thread, which formats and writes it. Lines from one
+// thread keep their order. Call through the macros below, not directly.
+void log_write(LogKind kind, std::string message);
+
+// Small sequential ID of the calling thread, for log lines and traces.
+int thread_number();
+
+// The message is only built when its level is active: below it, the arguments are not
+// evaluated at all. Building with -DPINOADER_STRIP_DEBUG_LOG (make STRIP_DEBUG_LOG=1)
+// compiles the debug lines out of the binary.
+#ifdef PINOADER_STRIP_DEBUG_LOG
+#define log_debug(...) do { if (false) log_write(LogKind::DEBUG, __VA_ARGS__); } while (0)
+#else
+#define log_debug(...) do { if (g_log_level >= LogLevel::DEBUG) log_write(LogKind::DEBUG, __VA_ARGS__); } while (0)
+#endif
+
+// NORMAL and DEBUG output
+#define log_normal(...) do { if (g_log_level >= LogLevel::NORMAL) log_write(LogKind::NORMAL, __VA_ARGS__); } while (0)
+
+// Error output (always visible, except in SILENT)
+#define log_error(...) do { if (g_log_level >= LogLevel::NORMAL) log_write(LogKind::ERROR, __VA_ARGS__); } while (0)
 
-// Function for error output (always visible, except in SILENT)
-inline void log_error(const std::string& message) {
-    if (g_log_level >= LogLevel::NORMAL) {
-        std::cerr << "ERROR: " << message << std::endl;
-    }
+// Machine-readable output on stdout, queued with the log lines so they stay in order.
+inline void log_output(std::string line) {
+    log_write(LogKind::OUTPUT, std::move(line));
 }
 
 #endif // LOGGER_H
@@ -2,27 +2,99 @@
 #include <string>
 #include <vector>
 #include <chrono>
+#include <fstream>
+#include <cstdlib>
 
-#include "parser.h"
-#include "http_client.h"
+#include "pinterest.h"
+#include "batch.h"
+#include "server.h"
 #include "logger.h"
-
-LogLevel g_log_level = LogLevel::NORMAL;
+#include "trace.h"
 
 void print_help(const char* program_name) {
     std::cout << "pinoader - A utility for downloading videos from Pinterest." << std::endl;
     std::cout << std::endl;
     std::cout << "USAGE:" << std::endl;
-    std::cout << "  " << program_name << " <pinterest_url> [OPTIONS]" << std::endl;
+    std::cout << "  " << program_name << " <pinterest_url>... [OPTIONS]" << std::endl;
     std::cout << std::endl;
     std::cout << "OPTIONS:" << std::endl;
     std::cout << "  -o, --output <filename>  Set a custom filename for the video." << std::endl;
     std::cout << "                           If not specified, the name is generated from the pin ID." << std::endl;
+    std::cout << "                           Interrupted downloads are kept as <filename>.part and resumed on the next run." << std::endl;
     std::cout << std::endl;
     std::cout << "  -t, --thumbnail          Download the thumbnail (cover image) for the video." << std::endl;
     std::cout << "                           The file will be saved with the same name as the video, but with a .jpg extension." << std::endl;
     std::cout << std::endl;
+    std::cout << "  -s, --segments <n>       Download the video over <n> parallel connections using HTTP Range" << std::endl;
+    std::cout << "                           requests. Falls back to one stream if the server does not support ranges." << std::endl;
+    std::cout << "  -q, --quality <policy>   Which entry of the pin's video list to download: 'best', 'smallest'," << std::endl;
+    std::cout << "                           '<n>p' (the best with its shorter side at most <n> pixels, e.g. 480p) or" << std::endl;
+    std::cout << "                           '<n>MB'/'<n>KB' (the best estimated at most that size). Without it the" << std::endl;
+    std::cout << "                           page's 720p video is used. HLS variants are fetched with -s (at least 4)" << std::endl;
+    std::cout << "                           segments in parallel; with --async only MP4 variants are considered." << std::endl;
+    std::cout << std::endl;
+    std::cout << "  -i, --input <file>       Batch mode: read pins from a file ('-' for stdin), one URL per line" << std::endl;
+    std::cout << "                           or JSONL objects like {\"url\": \"...\", \"output\": \"...\", \"thumbnail\": true}." << std::endl;
+    std::cout << "  -j, --jobs <n>           Number of concurrent downloads in batch mode (default: 4)." << std::endl;
+    std::cout << "                           Batch mode is also used when several URLs are given. A JSON result" << std::endl;
+    std::cout << "                           line is printed for every pin; combine with --clear for pure JSONL output." << std::endl;
+    std::cout << "  --async                  Batch mode: drive all transfers from a single thread with non-blocking I/O." << std::endl;
+    std::cout << "                           -j then sets the number of pins in flight (e.g. -j 200). Downloads use" << std::endl;
+    std::cout << "                           one stream each; -s is ignored." << std::endl;
+    std::cout << "  --timeout <seconds>      Deadline for each request in --async mode (default: 30)." << std::endl;
+    std::cout << "  --max-per-host <n>       Upper bound for the requests in flight to one host (default: 32). The actual" << std::endl;
+    std::cout << "                           limit adapts to the host: it grows while responses are fast and drops on" << std::endl;
+    std::cout << "                           429/5xx or rising latency. Those requests are retried with backoff and" << std::endl;
+    std::cout << "                           Retry-After is honoured. Not used by --async." << std::endl;
+    std::cout << std::endl;
+    std::cout << "  --serve                  Run as a daemon: keep connections, TLS sessions and DNS answers warm and" << std::endl;
+    std::cout << "                           download the pins sent to a Unix socket as JSON lines (batch input format)," << std::endl;
+    std::cout << "                           -j at a time. Per-job progress and result lines are sent back. Stops on" << std::endl;
+    std::cout << "                           SIGINT/SIGTERM after finishing the queued jobs." << std::endl;
+    std::cout << "  --submit                 Send the pins to a running daemon instead of downloading them here, and" << std::endl;
+    std::cout << "                           print its result lines. Falls back to downloading here if none is running." << std::endl;
+    std::cout << "  --socket <path>          Daemon socket (default: $PINOADER_SOCKET, else $XDG_RUNTIME_DIR/pinoader.sock," << std::endl;
+    std::cout << "                           else pinoader.sock in the cache directory)." << std::endl;
+    std::cout << "  --idle-timeout <seconds> Close pooled connections idle for this long (default: 60). The daemon" << std::endl;
+    std::cout << "                           also closes those the server has closed, every few seconds." << std::endl;
+    std::cout << "  --pool-per-host <n>      Idle connections kept for reuse per host (default: 8)." << std::endl;
+    std::cout << "  --pool-max <n>           Idle connections kept for reuse in all (default: 256)." << std::endl;
+    std::cout << std::endl;
+    std::cout << "  --no-cache               Do not use or update the on-disk caches. Resolved pins (final URL, video and" << std::endl;
+    std::cout << "                           thumbnail URLs) are cached in ~/.cache/pinoader, or $PINOADER_CACHE_DIR," << std::endl;
+    std::cout << "                           so repeated pins skip the redirects and the page download. TLS sessions" << std::endl;
+    std::cout << "                           and DNS answers are kept there too, so the next run resumes its handshakes." << std::endl;
+    std::cout << "  --refresh-cache          Resolve every pin again and update the cache." << std::endl;
+    std::cout << "  --cache-ttl <seconds>    How long cached pins are used (default: 86400)." << std::endl;
+    std::cout << "  --cache-size <n>         Maximum number of cached entries (default: 10000)." << std::endl;
+    std::cout << "  --no-store               Do not keep downloaded media. By default each download is also kept in the" << std::endl;
+    std::cout << "                           cache directory, by its SHA-256, and fetched again with If-None-Match/" << std::endl;
+    std::cout << "                           If-Modified-Since: when the server answers 304 the stored copy is used." << std::endl;
+    std::cout << "                           Identical files are kept once: outputs are reflinked to the store, or" << std::endl;
+    std::cout << "                           hard-linked where the file system has no reflinks (outputs with the same" << std::endl;
+    std::cout << "                           content are then one file; copy one before editing it in place)." << std::endl;
+    std::cout << "                           --no-cache also turns the store off. Not used by --async." << std::endl;
+    std::cout << "  --store-size <MB>        Space for stored media no output links to any more (default: 1024)." << std::endl;
+    std::cout << std::endl;
+    std::cout << "  --no-http2               Always use HTTP/1.1. By default HTTP/2 is used when the server offers it," << std::endl;
+    std::cout << "                           and all requests to a host share one multiplexed connection." << std::endl;
+    std::cout << "                           -s segments still get HTTP/1.1 connections of their own, and" << std::endl;
+    std::cout << "                           --async transfers always use HTTP/1.1." << std::endl;
+    std::cout << std::endl;
+    std::cout << "  --ktls                   Let the kernel decrypt TLS (kTLS) and splice downloads straight into the" << std::endl;
+    std::cout << "                           file. Needs the Linux 'tls' module and a cipher the kernel supports;" << std::endl;
+    std::cout << "                           other connections, and HTTP/2, fall back to the normal path." << std::endl;
+    std::cout << std::endl;
+    std::cout << "  --timings                Time every phase of a pin: DNS, TCP connect, TLS handshake (full or" << std::endl;
+    std::cout << "                           resumed), redirects, time to first byte, transfer, parsing and disk" << std::endl;
+    std::cout << "                           writes. The totals are added to the JSON result line as \"phases\"" << std::endl;
+    std::cout << "                           (a result line is also printed for a single URL). Not for --async." << std::endl;
+    std::cout << "  --trace <file>           Like --timings, and also write every span to <file> in the Chrome" << std::endl;
+    std::cout << "                           trace-event format (chrome://tracing, ui.perfetto.dev)." << std::endl;
+    std::cout << std::endl;
     std::cout << "  --debug                  Enable debug mode with verbose output." << std::endl;
+    std::cout << "  --log-json               Write log messages to stderr as JSON lines (time, level, thread, tag," << std::endl;
+    std::cout << "                           message) instead of text." << std::endl;
     std::cout << "  --clear                  Silent mode, shows only errors." << std::endl;
     std::cout << std::endl;
     std::cout << "  -h, --help               Show this help message and exit." << std::endl;
@@ -31,26 +103,14 @@ void print_help(const char* program_name) {
     std::cout << "  " << program_name << " https://pin.it/example" << std::endl;
     std::cout << "  " << program_name << " https://pin.it/example -o my_video.mp4" << std::endl;
     std::cout << "  " << program_name << " https://pin.it/example -t --debug" << std::endl;
+    std::cout << "  " << program_name << " -i pins.txt -j 8 --clear > results.jsonl" << std::endl;
+    std::cout << "  " << program_name << " --serve -j 8 &  " << program_name << " --submit -i pins.txt" << std::endl;
 }
 
-std::string extract_pin_id(const std::string& url) {
-    size_t start_pos = url.find("/pin/");
-    if (start_pos == std::string::npos) return "";
-    start_pos += 5;
-    size_t end_pos = url.find('/', start_pos);
-    return (end_pos == std::string::npos) ? url.substr(start_pos) : url.substr(start_pos, end_pos - start_pos);
-}
-
-std::string sanitize_pinterest_url(const std::string& dirty_url) {
-    size_t pin_pos = dirty_url.find("/pin/");
-    if (pin_pos == std::string::npos) {
-        return dirty_url;
-    }
-    size_t end_pin_id = dirty_url.find('/', pin_pos + 5);
-    if (end_pin_id == std::string::npos) {
-        return dirty_url;
-    }
-    return dirty_url.substr(0, end_pin_id + 1);
+static void log_pool_stats() {
+    PoolStats st = connection_pool_stats();
+    log_debug("[main] Connection pool: " + std::to_string(st.hits) + " hits, " + std::to_string(st.misses) +
+              " misses, " + std::to_string(st.evictions) + " evictions, " + std::to_string(st.idle) + " idle.");
 }
 
 int main(int argc, char* argv[]) {
@@ -61,9 +121,18 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    std::string url;
-    std::string custom_filename;
-    bool download_thumbnail = false;
+    std::vector<std::string> urls;
+    std::string input_path;
+    PinOptions options;
+    int jobs = 4;
+    bool async = false;
+    int timeout_s = 30;
+    bool serve = false;
+    bool submit = false;
+    std::string socket_path = default_socket_path();
+    double idle_timeout_s = 60;
+    int pool_per_host = 8;
+    int pool_max = 256;
 
     for (int i = 1; i < argc; ++i) {
         std::string arg = argv[i];
@@ -72,24 +141,133 @@ int main(int argc, char* argv[]) {
             return 0;
         } else if (arg == "--debug") {
             g_log_level = LogLevel::DEBUG;
+        } else if (arg == "--log-json") {
+            set_log_format(LogFormat::JSON);
         } else if (arg == "--clear") {
             g_log_level = LogLevel::SILENT;
         } else if (arg == "-t" || arg == "--thumbnail") {
-            download_thumbnail = true;
+            options.thumbnail = true;
         } else if (arg == "-o" || arg == "--output") {
             if (i + 1 < argc) {
-                custom_filename = argv[++i];
+                options.output = argv[++i];
+            } else {
+                log_error("Option '" + arg + "' requires a filename.");
+                return 1;
+            }
+        } else if (arg == "-i" || arg == "--input") {
+            if (i + 1 < argc) {
+                input_path = argv[++i];
+            } else {
+                log_error("Option '" + arg + "' requires a filename.");
+                return 1;
+            }
+        } else if (arg == "-j" || arg == "--jobs") {
+            if (i + 1 < argc && std::atoi(argv[i + 1]) > 0) {
+                jobs = std::atoi(argv[++i]);
+            } else {
+                log_error("Option '" + arg + "' requires a positive number.");
+                return 1;
+            }
+        } else if (arg == "--no-http2") {
+            set_http2_enabled(false);
+        } else if (arg == "--no-cache") {
+            options.cache.read = false;
+            options.cache.write = false;
+            set_network_cache_enabled(false);
+            set_media_store_enabled(false);
+        } else if (arg == "--no-store") {
+            set_media_store_enabled(false);
+        } else if (arg == "--store-size") {
+            if (i + 1 < argc && std::atol(argv[i + 1]) > 0) {
+                set_media_store_limit(std::atoll(argv[++i]) << 20);
+            } else {
+                log_error("Option '" + arg + "' requires a positive number.");
+                return 1;
+            }
+        } else if (arg == "--refresh-cache") {
+            options.cache.read = false;
+        } else if (arg == "--cache-ttl") {
+            if (i + 1 < argc && std::atol(argv[i + 1]) > 0) {
+                options.cache.ttl_s = std::atol(argv[++i]);
+            } else {
+                log_error("Option '" + arg + "' requires a positive number.");
+                return 1;
+            }
+        } else if (arg == "--cache-size") {
+            if (i + 1 < argc && std::atol(argv[i + 1]) > 0) {
+                options.cache.max_entries = std::atol(argv[++i]);
+            } else {
+                log_error("Option '" + arg + "' requires a positive number.");
+                return 1;
+            }
+        } else if (arg == "--ktls") {
+            set_ktls_enabled(true);
+        } else if (arg == "--timings") {
+            g_trace_enabled = true;
+        } else if (arg == "--trace") {
+            if (i + 1 < argc) {
+                set_trace_file(argv[++i]);
             } else {
                 log_error("Option '" + arg + "' requires a filename.");
                 return 1;
             }
-        } else if (arg.rfind("-", 0) != 0) {
-            if (url.empty()) {
-                url = arg;
+        } else if (arg == "--serve") {
+            serve = true;
+        } else if (arg == "--submit") {
+            submit = true;
+        } else if (arg == "--socket") {
+            if (i + 1 < argc) {
+                socket_path = argv[++i];
+            } else {
+                log_error("Option '" + arg + "' requires a path.");
+                return 1;
+            }
+        } else if (arg == "--idle-timeout") {
+            if (i + 1 < argc && std::atof(argv[i + 1]) > 0) {
+                idle_timeout_s = std::atof(argv[++i]);
             } else {
-                log_error("Multiple URLs provided. Please provide only one.");
+                log_error("Option '" + arg + "' requires a positive number.");
                 return 1;
             }
+        } else if (arg == "--pool-per-host" || arg == "--pool-max") {
+            if (i + 1 < argc && std::atoi(argv[i + 1]) > 0) {
+                (arg == "--pool-max" ? pool_max : pool_per_host) = std::atoi(argv[++i]);
+            } else {
+                log_error("Option '" + arg + "' requires a positive number.");
+                return 1;
+            }
+        } else if (arg == "--async") {
+            async = true;
+        } else if (arg == "--timeout") {
+            if (i + 1 < argc && std::atoi(argv[i + 1]) > 0) {
+                timeout_s = std::atoi(argv[++i]);
+            } else {
+                log_error("Option '" + arg + "' requires a positive number.");
+                return 1;
+            }
+        } else if (arg == "--max-per-host") {
+            if (i + 1 < argc && std::atoi(argv[i + 1]) > 0) {
+                set_max_requests_per_host(std::atoi(argv[++i]));
+            } else {
+                log_error("Option '" + arg + "' requires a positive number.");
+                return 1;
+            }
+        } else if (arg == "-s" || arg == "--segments") {
+            if (i + 1 < argc && std::atoi(argv[i + 1]) > 0) {
+                options.download.segments = std::atoi(argv[++i]);
+            } else {
+                log_error("Option '" + arg + "' requires a positive number.");
+                return 1;
+            }
+        } else if (arg == "-q" || arg == "--quality") {
+            if (i + 1 < argc && parse_quality(argv[i + 1], options.quality)) {
+                ++i;
+            } else {
+                log_error("Option '" + arg + "' requires 'best', 'smallest', '<n>p' or a size such as '8MB'.");
+                return 1;
+            }
+        } else if (arg == "-" || arg.rfind("-", 0) != 0) {
+            urls.push_back(arg);
         } else {
             log_error("Unknown option: " + arg);
             print_help(argv[0]);
@@ -97,91 +275,84 @@ int main(int argc, char* argv[]) {
         }
     }
 
-    if (url.empty()) {
+    set_connection_pool_limits(pool_per_host, pool_max, idle_timeout_s);
+
+    if (serve) {
+        if (!urls.empty() || !input_path.empty() || !options.output.empty()) {
+            log_error("Option '--serve' takes no URLs; submit them with '--submit'.");
+            return 1;
+        }
+        ServeOptions serve_options;
+        serve_options.socket_path = socket_path;
+        serve_options.workers = jobs;
+        serve_options.defaults = options;
+        return run_server(serve_options);
+    }
+
+    if (urls.empty() && input_path.empty()) {
         log_error("No URL provided.");
         print_help(argv[0]);
         return 1;
     }
 
     log_debug("[main] Debug mode is enabled.");
-    log_debug("[main] Target URL: " + url);
-    if (!custom_filename.empty()) log_debug("[main] Custom filename requested: " + custom_filename);
-    if (download_thumbnail) log_debug("[main] Thumbnail download requested.");
-
-    std::string final_url;
-    log_normal("[pinterest] " + url + ": Resolving URL");
 
-    std::string html_content = fetch_url(url, final_url);
-
-    std::string clean_url = sanitize_pinterest_url(final_url);
-    if (clean_url != final_url) {
-        log_debug("[pinterest] URL contains extra parameters. Sanitizing to: " + clean_url);
-        final_url = clean_url;
-        std::string temp_redirected_url;
-        html_content = fetch_url(final_url, temp_redirected_url);
-    }
-
-    if (html_content.empty()) {
-        log_error("Failed to fetch HTML content from the final URL.");
+    bool batch_mode = urls.size() > 1 || !input_path.empty() || async;
+    if (batch_mode && !options.output.empty()) {
+        log_error("Option '-o' cannot be used in batch mode. Set \"output\" per line in a JSONL input instead.");
         return 1;
     }
 
-    log_debug("[pinterest] Final URL: " + final_url);
-    log_debug("[parser] Received " + std::to_string(html_content.length()) + " bytes of HTML. Parsing for media URL.");
-    
-    if (download_thumbnail) {
-        std::string thumbnail_url = find_thumbnail_url(html_content);
-        if (thumbnail_url.empty()) {
-            log_error("Could not find thumbnail URL on the page.");
-        } else {
-            log_normal("[downloader] Thumbnail URL: " + thumbnail_url);
-            std::string thumb_filename;
-            if (!custom_filename.empty()) {
-                size_t dot_pos = custom_filename.find_last_of(".");
-                if (dot_pos != std::string::npos) {
-                    thumb_filename = custom_filename.substr(0, dot_pos) + ".jpg";
-                } else {
-                    thumb_filename = custom_filename + ".jpg";
-                }
-            } else {
-                std::string pin_id = extract_pin_id(final_url);
-                thumb_filename = (pin_id.empty() ? "pinterest_video" : pin_id) + ".jpg";
-            }
-
-            if (download_file(thumbnail_url, thumb_filename)) {
-                log_normal("[pinoader] Thumbnail saved: " + thumb_filename);
-            } else {
-                log_error("Failed to download the thumbnail.");
-            }
+    std::ifstream input_file;
+    std::istream* input = nullptr;
+    if (input_path == "-") {
+        input = &std::cin;
+    } else if (!input_path.empty()) {
+        input_file.open(input_path);
+        if (!input_file) {
+            log_error("Cannot open input file: " + input_path);
+            return 1;
         }
+        input = &input_file;
     }
 
-    std::string media_url = find_video_url(html_content);
-
-    if (media_url.empty()) {
-        log_error("Could not find media URL on the page.");
-        return 1;
+    if (submit) {
+        int failed = submit_to_server(socket_path, urls, input, options);
+        if (failed >= 0) return failed == 0 ? 0 : 1;
+        log_normal("[daemon] No daemon is listening on " + socket_path + ". Downloading here.");
     }
 
-    log_normal("[downloader] Media URL: " + media_url);
+    if (batch_mode) {
+        BatchOptions batch;
+        batch.workers = jobs;
+        batch.async = async;
+        batch.timeout_ms = timeout_s * 1000;
+        batch.defaults = options;
+        int failed = run_batch(urls, input, batch);
+        save_network_cache();
+        if (!write_trace_file()) log_error("Could not write the trace file.");
 
-    std::string video_filename;
-    if (!custom_filename.empty()) {
-        video_filename = custom_filename;
-    } else {
-        std::string pin_id = extract_pin_id(final_url);
-        video_filename = (pin_id.empty() ? "pinterest_video" : pin_id) + ".mp4";
+        auto end_time = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double> elapsed = end_time - start_time;
+        log_pool_stats();
+        log_debug("[main] Total execution time: " + std::to_string(elapsed.count()) + " seconds.");
+        return failed == 0 ? 0 : 1;
     }
 
-    if (download_file(media_url, video_filename)) {
-        log_normal("[pinoader] File saved: " + video_filename);
-    } else {
-        log_error("Failed to download the file.");
-    }
+    const std::string& url = urls.front();
+    log_debug("[main] Target URL: " + url);
+    if (!options.output.empty()) log_debug("[main] Custom filename requested: " + options.output);
+    if (options.thumbnail) log_debug("[main] Thumbnail download requested.");
+
+    PinResult result = process_pin(url, options);
+    save_network_cache();
+    if (g_trace_enabled) write_result_line(result);
+    if (!write_trace_file()) log_error("Could not write the trace file.");
 
     auto end_time = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double> elapsed = end_time - start_time;
+    log_pool_stats();
     log_debug("[main] Total execution time: " + std::to_string(elapsed.count()) + " seconds.");
 
-    return 0;
+    return result.ok ? 0 : 1;
 }
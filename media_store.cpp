@@ -0,0 +1,309 @@
+#include "media_store.h"
+#include "cache_dir.h"
+#include "http_client.h"
+#include "logger.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <openssl/evp.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static std::atomic<bool> g_enabled{true};
+static std::atomic<long long> g_limit{1LL << 30};
+
+void set_media_store_enabled(bool enabled) {
+    g_enabled = enabled;
+}
+
+void set_media_store_limit(long long bytes) {
+    g_limit = bytes;
+}
+
+bool media_store_enabled() {
+    return g_enabled && !cache_dir().empty();
+}
+
+Sha256::Sha256() : ctx_(EVP_MD_CTX_new()) {
+    EVP_DigestInit_ex(ctx_, EVP_sha256(), nullptr);
+}
+
+Sha256::~Sha256() {
+    EVP_MD_CTX_free(ctx_);
+}
+
+void Sha256::update(const void* data, size_t len) {
+    EVP_DigestUpdate(ctx_, data, len);
+}
+
+std::string Sha256::hex_digest() {
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    EVP_DigestFinal_ex(ctx_, md, &len);
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+    for (unsigned int i = 0; i < len; ++i) {
+        hex += digits[md[i] >> 4];
+        hex += digits[md[i] & 15];
+    }
+    return hex;
+}
+
+bool hash_file(const std::string& path, long long length, Sha256& digest) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    char buf[65536];
+    long long done = 0;
+    while (length < 0 || done < length) {
+        size_t want = length < 0 ? sizeof(buf) : (size_t)std::min<long long>(sizeof(buf), length - done);
+        ssize_t r = read(fd, buf, want);
+        if (r <= 0) break;
+        digest.update(buf, r);
+        done += r;
+    }
+    close(fd);
+    return length < 0 || done == length;
+}
+
+static std::string sha256_of(const std::string& s) {
+    Sha256 digest;
+    digest.update(s.data(), s.size());
+    return digest.hex_digest();
+}
+
+// "<cache_dir()>/media", with its two subdirectories created. Empty if unusable.
+static std::string store_dir() {
+    static std::once_flag once;
+    static std::string dir;
+    std::call_once(once, [] {
+        std::string base = cache_dir();
+        if (base.empty()) return;
+        base += "/media";
+        for (const char* sub : {"", "/objects", "/urls"}) {
+            if (mkdir((base + sub).c_str(), 0755) != 0 && errno != EEXIST) {
+                log_debug("[store] Cannot create " + base + sub + ". Media store disabled.");
+                return;
+            }
+        }
+        dir = base;
+    });
+    return dir;
+}
+
+static std::string object_path(const std::string& sha256) {
+    return store_dir() + "/objects/" + sha256;
+}
+
+static std::string record_path(const std::string& url) {
+    return store_dir() + "/urls/" + sha256_of(url);
+}
+
+// A name next to `path` that no other thread or process uses.
+static std::string temp_path(const std::string& path) {
+    static std::atomic<long> counter{0};
+    return path + ".tmp." + std::to_string(getpid()) + "." + std::to_string(counter++);
+}
+
+static std::string object_stat_line(const struct stat& st) {
+    long long mtime_ns = (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    return std::to_string((long long)st.st_size) + " " + std::to_string(mtime_ns);
+}
+
+// True if the object exists and still has the size and mtime it was stored with.
+static bool object_intact(const std::string& sha256) {
+    std::string object = object_path(sha256);
+    struct stat st;
+    if (stat(object.c_str(), &st) != 0) return false;
+    std::ifstream in(object + ".stat");
+    std::string line;
+    return std::getline(in, line) && line == object_stat_line(st);
+}
+
+static void remove_object(const std::string& sha256) {
+    std::string object = object_path(sha256);
+    unlink(object.c_str());
+    unlink((object + ".stat").c_str());
+}
+
+// A copy-on-write clone: shares the blocks of `from` (Btrfs, XFS) but not its inode.
+static bool reflink(const std::string& from, const std::string& to) {
+    int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) return false;
+    int out = open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    bool ok = out >= 0 && ioctl(out, FICLONE, in) == 0;
+    if (out >= 0) close(out);
+    close(in);
+    if (!ok && out >= 0) unlink(to.c_str());
+    return ok;
+}
+
+static bool copy_file(const std::string& from, const std::string& to) {
+    int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) return false;
+    int out = open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    bool ok = out >= 0;
+    while (ok) {
+        ssize_t n = copy_file_range(in, nullptr, out, nullptr, 1 << 30, 0);
+        if (n == 0) break;
+        ok = n > 0;
+    }
+    if (out >= 0) close(out);
+    close(in);
+    if (!ok && out >= 0) unlink(to.c_str());
+    return ok;
+}
+
+bool media_store_lookup(const std::string& url, StoredMedia& media) {
+    if (!g_enabled || store_dir().empty()) return false;
+    std::string path = record_path(url);
+    std::ifstream in(path);
+    if (!in) return false;
+    media = StoredMedia();
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t space = line.find(' ');
+        if (space == std::string::npos) continue;
+        std::string key = line.substr(0, space);
+        std::string val = line.substr(space + 1);
+        if (key == "url") media.url = val;
+        else if (key == "etag") media.etag = val;
+        else if (key == "last-modified") media.last_modified = val;
+        else if (key == "size") media.size = std::atoll(val.c_str());
+        else if (key == "sha256") media.sha256 = val;
+    }
+    if (media.url != url || media.sha256.size() != 64) return false;
+
+    if (!object_intact(media.sha256)) {
+        log_debug("[store] Stored copy of " + url + " is gone or was modified. Forgetting it.");
+        unlink(path.c_str());
+        return false;
+    }
+    return !media.etag.empty() || !media.last_modified.empty();
+}
+
+std::string conditional_headers(const StoredMedia& media) {
+    std::string headers;
+    if (!media.etag.empty()) headers += "If-None-Match: " + media.etag + "\r\n";
+    if (!media.last_modified.empty()) headers += "If-Modified-Since: " + media.last_modified + "\r\n";
+    return headers;
+}
+
+bool media_store_place(const StoredMedia& media, const std::string& output_path) {
+    std::string object = object_path(media.sha256);
+    std::string tmp = temp_path(output_path);
+    if (!reflink(object, tmp) && link(object.c_str(), tmp.c_str()) != 0 && !copy_file(object, tmp)) return false;
+    bool ok = rename(tmp.c_str(), output_path.c_str()) == 0;
+    // When the output already is a link to the object, rename() succeeds without removing `tmp`.
+    unlink(tmp.c_str());
+    return ok;
+}
+
+// Deletes the least recently linked objects that only the store holds (no output links to
+// them any more) until those fit in the limit.
+static void trim_store() {
+    std::string dir = store_dir() + "/objects";
+    DIR* d = opendir(dir.c_str());
+    if (!d) return;
+    struct Object {
+        std::string path;
+        long long size;
+        time_t used;
+    };
+    std::vector<Object> unlinked;
+    long long total = 0;
+    while (dirent* e = readdir(d)) {
+        std::string name = e->d_name;
+        struct stat st;
+        if (name.size() != 64 || stat((dir + "/" + name).c_str(), &st) != 0 || st.st_nlink != 1) continue;
+        unlinked.push_back({dir + "/" + name, (long long)st.st_size, st.st_ctime});
+        total += st.st_size;
+    }
+    closedir(d);
+    if (total <= g_limit) return;
+
+    std::sort(unlinked.begin(), unlinked.end(), [](const Object& a, const Object& b) { return a.used < b.used; });
+    int removed = 0;
+    for (const auto& o : unlinked) {
+        if (total <= g_limit) break;
+        if (unlink(o.path.c_str()) == 0) {
+            unlink((o.path + ".stat").c_str());
+            total -= o.size;
+            ++removed;
+        }
+    }
+    log_debug("[store] Removed " + std::to_string(removed) + " objects to stay within the size limit.");
+}
+
+void media_store_add(const std::string& url, const std::string& etag, const std::string& last_modified,
+                     const std::string& sha256, const std::string& output_path) {
+    if (!g_enabled || store_dir().empty()) return;
+    if (url.find('\n') != std::string::npos || etag.find('\n') != std::string::npos ||
+        last_modified.find('\n') != std::string::npos) {
+        return;
+    }
+    struct stat out_st, obj_st;
+    if (stat(output_path.c_str(), &out_st) != 0) return;
+
+    std::string object = object_path(sha256);
+    if (stat(object.c_str(), &obj_st) == 0 && !object_intact(sha256)) {
+        log_debug("[store] Object " + sha256.substr(0, 12) + " was modified. Replacing it.");
+        remove_object(sha256);
+    }
+    if (stat(object.c_str(), &obj_st) == 0) {
+        if (obj_st.st_ino != out_st.st_ino || obj_st.st_dev != out_st.st_dev) {
+            // The content is stored already, possibly from another URL: keep one copy.
+            std::string tmp = temp_path(output_path);
+            if ((reflink(object, tmp) || link(object.c_str(), tmp.c_str()) == 0) &&
+                rename(tmp.c_str(), output_path.c_str()) == 0) {
+                log_debug("[store] " + output_path + " is identical to stored object " + sha256.substr(0, 12) + ".");
+            } else {
+                unlink(tmp.c_str());
+            }
+        }
+    } else {
+        std::string tmp = temp_path(object);
+        if (!reflink(output_path, tmp) && link(output_path.c_str(), tmp.c_str()) != 0) {
+            log_debug("[store] Cannot link " + output_path + " into the store (another file system?). Not stored.");
+            return;
+        }
+        if (rename(tmp.c_str(), object.c_str()) != 0 || stat(object.c_str(), &obj_st) != 0) {
+            unlink(tmp.c_str());
+            return;
+        }
+        std::string stat_tmp = temp_path(object + ".stat");
+        {
+            std::ofstream out(stat_tmp, std::ios::trunc);
+            out << object_stat_line(obj_st) << "\n";
+        }
+        if (rename(stat_tmp.c_str(), (object + ".stat").c_str()) != 0) {
+            unlink(stat_tmp.c_str());
+            remove_object(sha256);
+            return;
+        }
+        log_debug("[store] Stored " + output_path + " as object " + sha256.substr(0, 12) + ".");
+    }
+
+    std::string path = record_path(url);
+    std::string tmp = temp_path(path);
+    {
+        std::ofstream out(tmp, std::ios::trunc);
+        out << "url " << url << "\n";
+        if (!etag.empty()) out << "etag " << etag << "\n";
+        if (!last_modified.empty()) out << "last-modified " << last_modified << "\n";
+        out << "size " << obj_st.st_size << "\n";
+        out << "sha256 " << sha256 << "\n";
+        if (!out) {
+            unlink(tmp.c_str());
+            return;
+        }
+    }
+    if (rename(tmp.c_str(), path.c_str()) != 0) unlink(tmp.c_str());
+    trim_store();
+}
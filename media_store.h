@@ -0,0 +1,64 @@
+#ifndef MEDIA_STORE_H
+#define MEDIA_STORE_H
+
+#include <string>
+
+typedef struct evp_md_ctx_st EVP_MD_CTX;
+
+// Downloaded media kept in "<cache_dir()>/media", so that a file the server has not changed
+// is not downloaded again:
+//   objects/<sha256>  one file per distinct content, however many URLs served it
+//   objects/<sha256>.stat  its size and mtime when stored: a hard-linked output that was
+//                          edited in place changes the object, which is then discarded
+//   urls/<sha256 of the URL>  what the URL last served: validators, size and content digest
+// download_file() asks for a known URL with If-None-Match/If-Modified-Since and on a 304 puts
+// the stored copy at the output path (reflink, else hard link, else copy) instead of the body.
+// Objects are reflinked or hard-linked from the downloaded files, so while those exist the
+// store costs no space. Every file is replaced with rename(), so several processes can share
+// the store without locks. Safe to call from several threads.
+
+struct StoredMedia {
+    std::string url;
+    std::string etag;
+    std::string last_modified;
+    long long size = -1;
+    std::string sha256;       // Hex digest of the content, names the object
+};
+
+// Incremental SHA-256, fed as the body is written.
+class Sha256 {
+public:
+    Sha256();
+    ~Sha256();
+    Sha256(const Sha256&) = delete;
+    Sha256& operator=(const Sha256&) = delete;
+
+    void update(const void* data, size_t len);
+    std::string hex_digest();  // Ends the computation
+
+private:
+    EVP_MD_CTX* ctx_;
+};
+
+// Feeds the first `length` bytes of `path` (-1: all of it) to `digest`. For bytes that were
+// not hashed as they were written: ranges of a segmented download, or an earlier run's part.
+bool hash_file(const std::string& path, long long length, Sha256& digest);
+
+// The record for `url`, if its object is still in the store and unmodified.
+bool media_store_lookup(const std::string& url, StoredMedia& media);
+
+// "If-None-Match: ...\r\n" and/or "If-Modified-Since: ...\r\n" for the request of a stored URL.
+std::string conditional_headers(const StoredMedia& media);
+
+// Puts the stored copy of `media` at `output_path`, replacing what is there.
+bool media_store_place(const StoredMedia& media, const std::string& output_path);
+
+// Records that `url` served `output_path` (already complete, with digest `sha256`). New
+// content becomes an object; content the store already has replaces the output with a link
+// to it, so it is kept once. Then trims the store to its size limit.
+void media_store_add(const std::string& url, const std::string& etag, const std::string& last_modified,
+                     const std::string& sha256, const std::string& output_path);
+
+bool media_store_enabled();
+
+#endif
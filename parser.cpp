@@ -1,66 +1,341 @@
 #include "parser.h"
+#include "json.h"
+#include "trace.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <queue>
 #include <vector>
 #include <string>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-std::string find_video_url(const std::string& html_content) {
-    const std::vector<std::string> anchors = {
-        "\"v720P\":{\"thumbnail\":",
-        "\"videoList720P\":{\"v720P\":{\"thumbnail\"",
-        "\"video_list\":{\"V_720P\"",
-        "\"videoList\":{\"V_720P\"",
-        "\"v720P\":{\"url\""
-    };
+enum Pattern {
+    V720P_THUMBNAIL,
+    VIDEOLIST720P,
+    VIDEO_LIST_V720P,
+    VIDEOLIST_V720P,
+    V720P_URL,
+    URL_MARKER,
+    OG_IMAGE,
+    V720P_THUMBNAIL_VALUE,
+    THUMBNAIL_MARKER,
+    PATTERN_COUNT
+};
 
-    const std::string url_marker = "\"url\":\"";
-    const std::string url_end_marker = "\"";
+static const std::string_view PATTERNS[PATTERN_COUNT] = {
+    "\"v720P\":{\"thumbnail\":",
+    "\"videoList720P\":{\"v720P\":{\"thumbnail\"",
+    "\"video_list\":{\"V_720P\"",
+    "\"videoList\":{\"V_720P\"",
+    "\"v720P\":{\"url\"",
+    "\"url\":\"",
+    "<meta property=\"og:image\" content=\"",
+    "\"v720P\":{\"thumbnail\":\"",
+    "\"thumbnail\":\"",
+};
 
-    for (const auto& anchor : anchors) {
-        size_t anchor_pos = html_content.find(anchor);
+// Aho-Corasick automaton over PATTERNS with a dense transition table. Bytes that occur in
+// no pattern share one input class, which keeps the table a few kilobytes. States are
+// stored premultiplied by the number of classes, and entries leading to a state where a
+// pattern ends carry MATCH_FLAG, so the scan loop is one table lookup per byte.
+struct Automaton {
+    static const uint16_t MATCH_FLAG = 0x8000;
 
-        if (anchor_pos != std::string::npos) {
-            size_t url_start_pos = html_content.find(url_marker, anchor_pos);
-            if (url_start_pos != std::string::npos) {
-                url_start_pos += url_marker.length();
+    uint8_t byte_class[256] = {};
+    int classes = 1;
+    std::vector<uint16_t> next;      // next[state + class], state premultiplied
+    std::vector<uint16_t> matches;   // Bitmask of the patterns ending in each state, by state / classes
+    std::vector<std::pair<char, char>> starts;  // Distinct first two bytes of the patterns
 
-                size_t url_end_pos = html_content.find(url_end_marker, url_start_pos);
+    Automaton() {
+        for (auto p : PATTERNS) {
+            for (unsigned char c : p) {
+                if (!byte_class[c]) byte_class[c] = classes++;
+            }
+        }
 
-                if (url_end_pos != std::string::npos) {
-                    return html_content.substr(url_start_pos, url_end_pos - url_start_pos);
+        std::vector<std::vector<int>> child(1, std::vector<int>(classes, -1));
+        matches.assign(1, 0);
+        for (int i = 0; i < PATTERN_COUNT; ++i) {
+            int s = 0;
+            for (unsigned char c : PATTERNS[i]) {
+                int k = byte_class[c];
+                if (child[s][k] < 0) {
+                    child[s][k] = (int)child.size();
+                    child.emplace_back(classes, -1);
+                    matches.push_back(0);
                 }
+                s = child[s][k];
             }
+            matches[s] |= 1u << i;
+
+            std::pair<char, char> start(PATTERNS[i][0], PATTERNS[i][1]);
+            if (std::find(starts.begin(), starts.end(), start) == starts.end()) starts.push_back(start);
+        }
+
+        // Breadth-first, so a state's failure link is complete before its children need it.
+        std::vector<int> goto_state(child.size() * classes, 0);
+        std::vector<int> fail(child.size(), 0);
+        std::queue<int> queue;
+        for (int k = 0; k < classes; ++k) {
+            if (child[0][k] > 0) {
+                goto_state[k] = child[0][k];
+                queue.push(child[0][k]);
+            }
+        }
+        while (!queue.empty()) {
+            int s = queue.front();
+            queue.pop();
+            for (int k = 0; k < classes; ++k) {
+                int c = child[s][k];
+                if (c < 0) {
+                    goto_state[s * classes + k] = goto_state[fail[s] * classes + k];
+                    continue;
+                }
+                fail[c] = goto_state[fail[s] * classes + k];
+                matches[c] |= matches[fail[c]];
+                goto_state[s * classes + k] = c;
+                queue.push(c);
+            }
+        }
+
+        next.resize(goto_state.size());
+        for (size_t i = 0; i < goto_state.size(); ++i) {
+            int target = goto_state[i];
+            next[i] = (uint16_t)(target * classes) | (matches[target] ? MATCH_FLAG : 0);
         }
     }
+};
 
-    return "";
+static const Automaton& automaton() {
+    static const Automaton a;
+    return a;
 }
 
-std::string find_thumbnail_url(const std::string& html_content) {
-    const std::string end_marker = "\"";
-
-    const std::string og_marker = "<meta property=\"og:image\" content=\"";
-    size_t start_pos = html_content.find(og_marker);
-    if (start_pos != std::string::npos) {
-        start_pos += og_marker.length();
-        size_t end_pos = html_content.find(end_marker, start_pos);
-        if (end_pos != std::string::npos) {
-            return html_content.substr(start_pos, end_pos - start_pos);
+// While the automaton is in its root state, nothing can match before a position where
+// the first two bytes of some pattern occur, so those stretches are skipped 16 bytes at
+// a time. Returns the first position >= `i` that may start a match. Without SSE2, or near
+// the end of the data, it returns `i` and the automaton steps through byte by byte.
+static size_t skip_to_candidate(const Automaton& a, const unsigned char* data, size_t i, size_t size) {
+#ifdef __SSE2__
+    while (i + 17 <= size) {
+        __m128i first = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i second = _mm_loadu_si128((const __m128i*)(data + i + 1));
+        __m128i hits = _mm_setzero_si128();
+        for (const auto& start : a.starts) {
+            hits = _mm_or_si128(hits, _mm_and_si128(_mm_cmpeq_epi8(first, _mm_set1_epi8(start.first)),
+                                                    _mm_cmpeq_epi8(second, _mm_set1_epi8(start.second))));
         }
+        int mask = _mm_movemask_epi8(hits);
+        if (mask) return i + __builtin_ctz(mask);
+        i += 16;
     }
+#else
+    (void)a;
+    (void)data;
+    (void)size;
+#endif
+    return i;
+}
 
-    const std::string anchor = "\"v720P\":{\"thumbnail\":\"";
-    const std::string thumb_marker = "\"thumbnail\":\"";
-
-    size_t anchor_pos = html_content.find(anchor);
-    if (anchor_pos != std::string::npos) {
-        start_pos = html_content.find(thumb_marker, anchor_pos);
-        if (start_pos != std::string::npos) {
-            start_pos += thumb_marker.length();
-            size_t end_pos = html_content.find(end_marker, start_pos);
-            if (end_pos != std::string::npos) {
-                return html_content.substr(start_pos, end_pos - start_pos);
+MediaMatcher::MediaMatcher(bool want_thumbnail) {
+    fields_ = {
+        {V720P_THUMBNAIL, URL_MARKER},
+        {VIDEOLIST720P, URL_MARKER},
+        {VIDEO_LIST_V720P, URL_MARKER},
+        {VIDEOLIST_V720P, URL_MARKER},
+        {V720P_URL, URL_MARKER},
+    };
+    video_count_ = fields_.size();
+    if (want_thumbnail) {
+        fields_.emplace_back(OG_IMAGE, OG_IMAGE);
+        fields_.emplace_back(V720P_THUMBNAIL_VALUE, THUMBNAIL_MARKER);
+    }
+}
+
+void MediaMatcher::find_quote(Field& f, std::string_view page) {
+    const void* quote = memchr(page.data() + f.quote_from, '"', page.size() - f.quote_from);
+    if (quote) f.value_end = (const char*)quote - page.data();
+    else f.quote_from = page.size();
+}
+
+void MediaMatcher::start_value(Field& f, std::string_view page, size_t pos) {
+    f.value_start = f.quote_from = pos;
+    find_quote(f, page);
+}
+
+// `patterns` end at page[end].
+void MediaMatcher::on_match(std::string_view page, unsigned patterns, size_t end) {
+    for (auto& f : fields_) {
+        if (f.anchor_pos == std::string::npos) {
+            if (!(patterns & (1u << f.anchor))) continue;
+            f.anchor_pos = end + 1 - PATTERNS[f.anchor].size();
+            // A marker inside the anchor was reported before the anchor was known.
+            std::string_view marker = PATTERNS[f.marker];
+            for (size_t pos = f.anchor_pos; pos + marker.size() <= end + 1; ++pos) {
+                if (page.compare(pos, marker.size(), marker) == 0) {
+                    start_value(f, page, pos + marker.size());
+                    break;
+                }
             }
+        } else if (f.value_start == std::string::npos && (patterns & (1u << f.marker))) {
+            size_t pos = end + 1 - PATTERNS[f.marker].size();
+            if (pos >= f.anchor_pos) start_value(f, page, end + 1);
+        }
+    }
+}
+
+void MediaMatcher::scan(std::string_view page, size_t from) {
+    for (auto& f : fields_) {
+        if (f.value_start != std::string::npos && !f.done()) find_quote(f, page);
+    }
+    if (complete()) return;
+
+    const Automaton& a = automaton();
+    const uint16_t* next = a.next.data();
+    const uint8_t* byte_class = a.byte_class;
+    const unsigned char* data = (const unsigned char*)page.data();
+    const size_t size = page.size();
+    unsigned s = state_;
+    for (size_t i = from; i < size; ++i) {
+        if (s == 0) i = skip_to_candidate(a, data, i, size);
+        uint16_t entry = next[s + byte_class[data[i]]];
+        s = entry & ~Automaton::MATCH_FLAG;
+        if (entry & Automaton::MATCH_FLAG) {
+            on_match(page, a.matches[s / a.classes], i);
+            if (complete()) break;
         }
     }
+    state_ = s;
+}
+
+// Later fields only matter if an earlier one never completes, so the result is final once
+// the highest-priority field of each kind has it.
+bool MediaMatcher::complete() const {
+    return fields_[0].done() && (video_count_ == fields_.size() || fields_[video_count_].done());
+}
 
-    return "";
-}
\ No newline at end of file
+MediaFields MediaMatcher::fields(std::string_view page) const {
+    MediaFields result;
+    bool found[2] = {false, false};
+    for (size_t i = 0; i < fields_.size(); ++i) {
+        const Field& f = fields_[i];
+        int kind = (i < video_count_) ? 0 : 1;
+        if (!f.done() || found[kind]) continue;
+        found[kind] = true;
+        (kind == 0 ? result.video_url : result.thumbnail_url) = page.substr(f.value_start, f.value_end - f.value_start);
+    }
+    return result;
+}
+
+void PageScanner::feed(const char* data, size_t len) {
+    if (complete()) return;
+    Span span("parse");
+    size_t from = page_.size();
+    page_.append(data, len);
+    matcher_.scan(page_, from);
+    if (want_variants_ && list_end_ == std::string::npos) scan_video_list();
+}
+
+static const std::string_view VIDEO_LIST_ANCHORS[] = {"\"video_list\":{", "\"videoList\":{"};
+
+// Finds the first video list, then follows its braces (outside of strings) to its end.
+void PageScanner::scan_video_list() {
+    if (list_start_ == std::string::npos) {
+        for (auto anchor : VIDEO_LIST_ANCHORS) {
+            size_t pos = page_.find(anchor, list_from_);
+            if (pos != std::string::npos && (list_start_ == std::string::npos || pos + anchor.size() - 1 < list_start_)) {
+                list_start_ = pos + anchor.size() - 1;
+            }
+        }
+        if (list_start_ == std::string::npos) {
+            // An anchor may be cut in two by the end of this chunk.
+            list_from_ = page_.size() >= 16 ? page_.size() - 16 : 0;
+            return;
+        }
+        list_from_ = list_start_;
+    }
+
+    for (size_t i = list_from_; i < page_.size(); ++i) {
+        char c = page_[i];
+        if (in_string_) {
+            if (escaped_) escaped_ = false;
+            else if (c == '\\') escaped_ = true;
+            else if (c == '"') in_string_ = false;
+        } else if (c == '"') {
+            in_string_ = true;
+        } else if (c == '{') {
+            ++list_depth_;
+        } else if (c == '}' && --list_depth_ == 0) {
+            list_end_ = i + 1;
+            return;
+        }
+    }
+    list_from_ = page_.size();
+}
+
+std::vector<VideoVariant> PageScanner::variants() const {
+    if (list_end_ == std::string::npos) return {};
+    return parse_video_list(std::string_view(page_).substr(list_start_, list_end_ - list_start_));
+}
+
+// "V_720P" and "v720P" carry the height when the entry itself does not.
+static int height_from_name(const std::string& name) {
+    size_t p = name.find_first_of("pP");
+    while (p != std::string::npos) {
+        size_t digits = p;
+        while (digits > 0 && std::isdigit((unsigned char)name[digits - 1])) --digits;
+        if (digits < p) return std::atoi(name.c_str() + digits);
+        p = name.find_first_of("pP", p + 1);
+    }
+    return 0;
+}
+
+std::vector<VideoVariant> parse_video_list(std::string_view object) {
+    std::vector<VideoVariant> result;
+    std::map<std::string, std::string> entries;
+    if (!json_parse_object(std::string(object), entries)) return result;
+    for (const auto& entry : entries) {
+        std::map<std::string, std::string> f;
+        if (entry.second.empty() || entry.second[0] != '{' || !json_parse_object(entry.second, f)) continue;
+        if (f["url"].empty()) continue;
+        VideoVariant v;
+        v.name = entry.first;
+        v.url = f["url"];
+        v.width = std::atoi(f["width"].c_str());
+        v.height = std::atoi(f["height"].c_str());
+        v.duration_ms = std::atoll(f["duration"].c_str());
+        v.bitrate = std::atoll(f["bitrate"].c_str());
+        if (!f["size"].empty()) v.size = std::atoll(f["size"].c_str());
+        v.hls = v.url.find(".m3u8") != std::string::npos;
+        if (v.width == 0 && v.height == 0) v.height = height_from_name(v.name);
+        result.push_back(v);
+    }
+    return result;
+}
+
+std::vector<VideoVariant> find_video_variants(std::string_view html) {
+    PageScanner scanner(false, true);
+    scanner.feed(html.data(), html.size());
+    return scanner.variants();
+}
+
+MediaFields find_media_fields(std::string_view html, bool want_thumbnail) {
+    Span span("parse");
+    MediaMatcher matcher(want_thumbnail);
+    matcher.scan(html, 0);
+    return matcher.fields(html);
+}
+
+std::string find_video_url(const std::string& html_content) {
+    return std::string(find_media_fields(html_content, false).video_url);
+}
+
+std::string find_thumbnail_url(const std::string& html_content) {
+    return std::string(find_media_fields(html_content, true).thumbnail_url);
+}
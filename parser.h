@@ -2,9 +2,111 @@
 #define PARSER_H
 
 #include <string>
+#include <string_view>
+#include <vector>
+
+// Media fields of a pin page, as views into the scanned page. Empty when not found.
+struct MediaFields {
+    std::string_view video_url;
+    std::string_view thumbnail_url;
+};
+
+// Finds all media fields in a single pass over the page.
+MediaFields find_media_fields(std::string_view html, bool want_thumbnail = true);
+
+// One entry of the pin's video list ("video_list" or "videoList" in the page data).
+struct VideoVariant {
+    std::string name;           // "V_720P", "V_HLSV3_MOBILE", "v720P", ...
+    std::string url;
+    int width = 0;              // 0 when the page does not say
+    int height = 0;
+    long long duration_ms = 0;
+    long long bitrate = 0;      // Bits per second, 0 when unknown
+    long long size = -1;        // Bytes, -1 when unknown
+    bool hls = false;           // `url` is an HLS (.m3u8) playlist
+};
+
+// Every variant in the first video list of the page. Empty if the page has none.
+std::vector<VideoVariant> find_video_variants(std::string_view html);
+
+// Parses a video list object, `{"V_720P":{"url":"...","width":720,...},...}`.
+std::vector<VideoVariant> parse_video_list(std::string_view object);
 
 std::string find_video_url(const std::string& html_content);
 
 std::string find_thumbnail_url(const std::string& html_content);
 
+// Runs every anchor and marker of the page through one Aho-Corasick automaton.
+// The page can be scanned in several steps; the automaton state is kept between them, so
+// patterns split across two steps still match. A field takes the first `marker` at or
+// after the first `anchor`, up to the next quote, and the first complete field in
+// priority order wins.
+class MediaMatcher {
+public:
+    explicit MediaMatcher(bool want_thumbnail = true);
+
+    // Scans page[from, page.size()). `page` must start with everything scanned before.
+    void scan(std::string_view page, size_t from);
+
+    // True once no further bytes can change the result.
+    bool complete() const;
+
+    MediaFields fields(std::string_view page) const;
+
+    struct Field {
+        int anchor;
+        int marker;
+        size_t anchor_pos = std::string::npos;
+        size_t value_start = std::string::npos;
+        size_t value_end = std::string::npos;
+        size_t quote_from = 0;
+
+        Field(int a, int m) : anchor(a), marker(m) {}
+        bool done() const { return value_end != std::string::npos; }
+    };
+
+private:
+    void on_match(std::string_view page, unsigned patterns, size_t end);
+    void start_value(Field& f, std::string_view page, size_t pos);
+    void find_quote(Field& f, std::string_view page);
+
+    unsigned state_ = 0;  // Premultiplied automaton state
+    std::vector<Field> fields_;  // Video fields, then thumbnail fields, each in priority order
+    size_t video_count_ = 0;
+};
+
+// A page that arrives in chunks. complete() turns true as soon as the media fields are
+// final, so the rest of the page does not need to be downloaded. With `want_variants` that
+// also waits for the end of the first video list.
+class PageScanner {
+public:
+    explicit PageScanner(bool want_thumbnail = true, bool want_variants = false)
+        : matcher_(want_thumbnail), want_variants_(want_variants) {}
+
+    void feed(const char* data, size_t len);
+
+    bool complete() const { return matcher_.complete() && (!want_variants_ || list_end_ != std::string::npos); }
+
+    // Views into the scanner's buffer, valid until the next feed().
+    MediaFields fields() const { return matcher_.fields(page_); }
+
+    // The first video list, once it has been scanned to its end. Needs `want_variants`.
+    std::vector<VideoVariant> variants() const;
+
+    size_t size() const { return page_.size(); }
+
+private:
+    void scan_video_list();
+
+    std::string page_;
+    MediaMatcher matcher_;
+    bool want_variants_;
+    size_t list_start_ = std::string::npos;  // The '{' of the video list
+    size_t list_end_ = std::string::npos;    // Just past its '}'
+    size_t list_from_ = 0;                   // Where scan_video_list() continues
+    int list_depth_ = 0;
+    bool in_string_ = false;
+    bool escaped_ = false;
+};
+
 #endif
@@ -0,0 +1,207 @@
+#include "pin_cache.h"
+#include "cache_dir.h"
+#include "pinterest.h"
+#include "logger.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct CacheRecord {
+    long long stored = 0;   // Unix time
+    PinCacheEntry entry;
+};
+
+// In-memory view of the log file, shared by all threads of this process.
+struct PinCacheState {
+    std::mutex mtx;
+    bool initialized = false;
+    std::string dir;
+    std::string log_path;
+    std::string lock_path;
+    std::unordered_map<std::string, CacheRecord> records;
+    ino_t inode = 0;
+    off_t offset = 0;       // How much of the log has been parsed
+    long lines = 0;         // Lines in the log, including superseded ones
+};
+
+static PinCacheState g_cache;
+
+static bool init_locked() {
+    if (g_cache.initialized) return !g_cache.dir.empty();
+    g_cache.initialized = true;
+    std::string dir = cache_dir();
+    if (dir.empty()) {
+        log_debug("[cache] No usable cache directory. Pin cache disabled.");
+        return false;
+    }
+    g_cache.dir = dir;
+    g_cache.log_path = dir + "/pins";
+    g_cache.lock_path = dir + "/pins.lock";
+    return true;
+}
+
+// Holds flock() on the lock file for its lifetime.
+struct FileLock {
+    int fd = -1;
+    FileLock(const std::string& path, int op) {
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd >= 0 && flock(fd, op) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    ~FileLock() {
+        if (fd >= 0) close(fd);
+    }
+    bool ok() const { return fd >= 0; }
+};
+
+// "<time>\t<key>\t<final url>\t<video url>\t<thumbnail url>[\t<fallback url>]"
+static bool parse_record(const std::string& line, std::string& key, CacheRecord& record) {
+    std::vector<std::string> fields;
+    std::stringstream ss(line);
+    std::string field;
+    while (std::getline(ss, field, '\t')) fields.push_back(field);
+    while (fields.size() < 6) fields.push_back("");
+    if (fields.size() != 6 || fields[1].empty() || fields[3].empty()) return false;
+    record.stored = std::atoll(fields[0].c_str());
+    key = fields[1];
+    record.entry.final_url = fields[2];
+    record.entry.video_url = fields[3];
+    record.entry.thumbnail_url = fields[4];
+    record.entry.fallback_url = fields[5];
+    return true;
+}
+
+static std::string format_record(const std::string& key, const CacheRecord& record) {
+    return std::to_string(record.stored) + "\t" + key + "\t" + record.entry.final_url + "\t" +
+           record.entry.video_url + "\t" + record.entry.thumbnail_url +
+           (record.entry.fallback_url.empty() ? "" : "\t" + record.entry.fallback_url) + "\n";
+}
+
+// Brings the in-memory map up to date with the log. Requires the file lock (shared or
+// exclusive) and g_cache.mtx.
+static void sync_locked() {
+    struct stat st;
+    if (stat(g_cache.log_path.c_str(), &st) != 0) {
+        g_cache.records.clear();
+        g_cache.inode = 0;
+        g_cache.offset = 0;
+        g_cache.lines = 0;
+        return;
+    }
+    if (st.st_ino != g_cache.inode || st.st_size < g_cache.offset) {
+        // Compacted by another process: start over.
+        g_cache.records.clear();
+        g_cache.inode = st.st_ino;
+        g_cache.offset = 0;
+        g_cache.lines = 0;
+    }
+    if (st.st_size == g_cache.offset) return;
+
+    std::ifstream in(g_cache.log_path, std::ios::binary);
+    in.seekg(g_cache.offset);
+    std::string line;
+    while (std::getline(in, line)) {
+        if (in.eof()) break;  // Incomplete last line
+        g_cache.offset += line.size() + 1;
+        ++g_cache.lines;
+        std::string key;
+        CacheRecord record;
+        if (parse_record(line, key, record)) g_cache.records[key] = record;
+    }
+}
+
+// Rewrites the log with the newest live entries only. Requires the exclusive lock.
+static void compact_locked(const CacheOptions& options) {
+    long long now = time(nullptr);
+    std::vector<std::pair<std::string, CacheRecord>> live;
+    for (const auto& kv : g_cache.records) {
+        if (now - kv.second.stored < options.ttl_s) live.push_back(kv);
+    }
+    std::sort(live.begin(), live.end(), [](const auto& a, const auto& b) { return a.second.stored > b.second.stored; });
+    if ((long)live.size() > options.max_entries) live.resize(options.max_entries);
+
+    std::string tmp = g_cache.log_path + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        for (auto it = live.rbegin(); it != live.rend(); ++it) out << format_record(it->first, it->second);
+        if (!out) return;
+    }
+    if (rename(tmp.c_str(), g_cache.log_path.c_str()) != 0) return;
+
+    log_debug("[cache] Compacted pin cache to " + std::to_string(live.size()) + " entries.");
+    g_cache.records.clear();
+    g_cache.inode = 0;
+    g_cache.offset = 0;
+    g_cache.lines = 0;
+    sync_locked();
+}
+
+static std::vector<std::string> cache_keys(const std::string& url, const std::string& final_url,
+                                           const CacheOptions& options) {
+    std::vector<std::string> keys = {url + options.variant};
+    std::string pin_id = extract_pin_id(final_url.empty() ? url : final_url);
+    if (!pin_id.empty()) keys.push_back("pin:" + pin_id + options.variant);
+    return keys;
+}
+
+bool pin_cache_lookup(const std::string& url, const CacheOptions& options, PinCacheEntry& entry) {
+    if (!options.read) return false;
+    std::lock_guard<std::mutex> lock(g_cache.mtx);
+    if (!init_locked()) return false;
+    {
+        FileLock file_lock(g_cache.lock_path, LOCK_SH);
+        if (!file_lock.ok()) return false;
+        sync_locked();
+    }
+
+    long long now = time(nullptr);
+    for (const auto& key : cache_keys(url, "", options)) {
+        auto it = g_cache.records.find(key);
+        if (it != g_cache.records.end() && now - it->second.stored < options.ttl_s) {
+            entry = it->second.entry;
+            return true;
+        }
+    }
+    return false;
+}
+
+void pin_cache_store(const std::string& url, const PinCacheEntry& entry, const CacheOptions& options) {
+    if (!options.write) return;
+    for (const std::string* value : {&url, &entry.final_url, &entry.video_url, &entry.thumbnail_url, &entry.fallback_url}) {
+        if (value->find_first_of("\t\r\n") != std::string::npos) return;
+    }
+
+    std::lock_guard<std::mutex> lock(g_cache.mtx);
+    if (!init_locked()) return;
+    FileLock file_lock(g_cache.lock_path, LOCK_EX);
+    if (!file_lock.ok()) return;
+    sync_locked();
+
+    CacheRecord record;
+    record.stored = time(nullptr);
+    record.entry = entry;
+    std::string lines;
+    for (const auto& key : cache_keys(url, entry.final_url, options)) lines += format_record(key, record);
+
+    int fd = open(g_cache.log_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) return;
+    bool ok = write(fd, lines.data(), lines.size()) == (ssize_t)lines.size();
+    close(fd);
+    if (!ok) return;
+    sync_locked();
+
+    // Superseded and expired lines accumulate until the log is twice the size bound.
+    if (g_cache.lines > 2 * options.max_entries) compact_locked(options);
+}
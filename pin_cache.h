@@ -0,0 +1,34 @@
+#ifndef PIN_CACHE_H
+#define PIN_CACHE_H
+
+#include <string>
+
+struct CacheOptions {
+    bool read = true;               // Use cached resolutions (--no-cache, --refresh-cache turn this off)
+    bool write = true;              // Record new resolutions (--no-cache turns this off)
+    long ttl_s = 24 * 3600;         // Entries older than this are ignored
+    long max_entries = 10000;       // Size bound, enforced when the file is compacted
+    std::string variant;            // Appended to the keys, so a --quality choice has its own entries
+};
+
+// What resolving a pin produced: enough to go straight to the downloads.
+struct PinCacheEntry {
+    std::string final_url;
+    std::string video_url;
+    std::string thumbnail_url;      // Empty if the page was not scanned for it
+    std::string fallback_url;       // Progressive video to try if an HLS video_url fails, or empty
+};
+
+// Persistent cache of pin resolutions in "<cache_dir()>/pins". Entries are keyed both by
+// the URL that was given (e.g. a pin.it short link) and by the pin ID of the final URL.
+// The file is an append-only log shared by all processes: appends and compaction
+// take an exclusive flock() on "pins.lock", reads a shared one. Each process keeps the
+// parsed log in memory and only reads what other processes appended since.
+// Safe to call from several threads.
+
+// Looks up `url`, then its pin ID. False on a miss or an expired entry.
+bool pin_cache_lookup(const std::string& url, const CacheOptions& options, PinCacheEntry& entry);
+
+void pin_cache_store(const std::string& url, const PinCacheEntry& entry, const CacheOptions& options);
+
+#endif
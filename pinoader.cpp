@@ -0,0 +1,56 @@
+#include "pinoader.h"
+#include "logger.h"
+#include "trace.h"
+#include <algorithm>
+#include <memory>
+
+static thread_local bool t_worker = false;
+
+PinClient::PinClient(const PinClientOptions& options) : max_queued_(std::max(0, options.max_queued)) {
+    g_log_level = options.debug ? LogLevel::DEBUG : options.quiet ? LogLevel::SILENT : LogLevel::NORMAL;
+    if (options.timings) g_trace_enabled = true;
+    int n = options.workers > 0 ? options.workers : 1;
+    for (int i = 0; i < n; ++i) workers_.emplace_back([this] { run(); });
+}
+
+PinClient::~PinClient() {
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    for (auto& t : workers_) t.join();
+    save_network_cache();
+}
+
+std::future<PinResult> PinClient::submit(const std::string& url, const PinOptions& options) {
+    auto promise = std::make_shared<std::promise<PinResult>>();
+    std::future<PinResult> future = promise->get_future();
+    submit(url, options, [promise](const PinResult& result) { promise->set_value(result); });
+    return future;
+}
+
+void PinClient::submit(const std::string& url, const PinOptions& options, std::function<void(const PinResult&)> done) {
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        if (max_queued_ > 0 && !t_worker) space_cv_.wait(lock, [&] { return jobs_.size() < max_queued_; });
+        jobs_.push_back([url, options, done] { done(process_pin(url, options)); });
+    }
+    cv_.notify_one();
+}
+
+void PinClient::run() {
+    t_worker = true;
+    while (true) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(mtx_);
+            cv_.wait(lock, [&] { return stopping_ || !jobs_.empty(); });
+            if (jobs_.empty()) return;
+            job = std::move(jobs_.front());
+            jobs_.pop_front();
+        }
+        space_cv_.notify_one();
+        job();
+    }
+}
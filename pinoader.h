@@ -0,0 +1,64 @@
+#ifndef PINOADER_H
+#define PINOADER_H
+
+// libpinoader: the pin downloader as a library (libpinoader.a / libpinoader.so).
+//
+//   PinClient client;
+//   std::future<PinResult> f = client.submit("https://pin.it/abc");
+//   PinResult r = f.get();
+//
+// PinOptions (pinterest.h) sets the output file, or a video_sink/thumbnail_sink that
+// receives the media as it downloads, and whether to fetch the thumbnail. PinResult
+// carries the outcome, the error messages, the byte count and the timings.
+//
+// All clients in a process share one connection pool, TLS session cache, DNS cache and
+// per-host request limiter, so each pin after the first starts on warm connections.
+
+#include "pinterest.h"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct PinClientOptions {
+    int workers = 4;         // Pins processed at the same time
+    bool quiet = true;       // No log output (the CLI's --clear); errors are in PinResult
+    bool debug = false;      // Debug log on stderr (the CLI's --debug); overrides `quiet`
+    bool timings = false;    // Fill PinResult::phases (the CLI's --timings)
+    int max_queued = 1024;   // submit() blocks while this many pins wait for a worker; 0: no limit
+};
+
+// Processes submitted pins on a pool of worker threads. Thread-safe.
+// Logging and timings are process-wide settings: the last client created decides them.
+class PinClient {
+public:
+    explicit PinClient(const PinClientOptions& options = PinClientOptions());
+    // Finishes the pins already submitted, then stops the workers.
+    ~PinClient();
+    PinClient(const PinClient&) = delete;
+    PinClient& operator=(const PinClient&) = delete;
+
+    std::future<PinResult> submit(const std::string& url, const PinOptions& options = PinOptions());
+
+    // Calls `done` on a worker thread once the pin is finished. Sinks in `options` are
+    // also called on worker threads. Both submit()s wait while the queue is full, except
+    // when called from a worker thread (from `done`), which would wait for itself.
+    void submit(const std::string& url, const PinOptions& options, std::function<void(const PinResult&)> done);
+
+private:
+    void run();
+
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::condition_variable space_cv_;  // Signalled when a worker takes a job
+    std::deque<std::function<void()>> jobs_;
+    size_t max_queued_ = 0;
+    bool stopping_ = false;
+    std::vector<std::thread> workers_;
+};
+
+#endif
@@ -0,0 +1,263 @@
+#include "pinterest.h"
+#include "parser.h"
+#include "http_client.h"
+#include "hls.h"
+#include "logger.h"
+#include "trace.h"
+#include <chrono>
+#include <thread>
+#include <cstdio>
+
+using Clock = std::chrono::steady_clock;
+
+static double seconds_since(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+std::string extract_pin_id(const std::string& url) {
+    size_t start_pos = url.find("/pin/");
+    if (start_pos == std::string::npos) return "";
+    start_pos += 5;
+    size_t end_pos = url.find('/', start_pos);
+    return (end_pos == std::string::npos) ? url.substr(start_pos) : url.substr(start_pos, end_pos - start_pos);
+}
+
+std::string sanitize_pinterest_url(const std::string& dirty_url) {
+    size_t pin_pos = dirty_url.find("/pin/");
+    if (pin_pos == std::string::npos) {
+        return dirty_url;
+    }
+    size_t end_pin_id = dirty_url.find('/', pin_pos + 5);
+    if (end_pin_id == std::string::npos) {
+        return dirty_url;
+    }
+    return dirty_url.substr(0, end_pin_id + 1);
+}
+
+static std::string generated_filename(const std::string& final_url, const PinOptions& options, const char* ext) {
+    std::string pin_id = extract_pin_id(final_url);
+    std::string name = (pin_id.empty() ? "pinterest_video" : pin_id) + ext;
+    if (options.directory.empty()) return name;
+    return options.directory + (options.directory.back() == '/' ? "" : "/") + name;
+}
+
+std::string pin_video_filename(const std::string& final_url, const PinOptions& options) {
+    if (!options.output.empty()) return options.output;
+    return generated_filename(final_url, options, ".mp4");
+}
+
+std::string pin_thumbnail_filename(const std::string& final_url, const PinOptions& options) {
+    if (!options.output.empty()) {
+        size_t dot_pos = options.output.find_last_of(".");
+        if (dot_pos != std::string::npos) {
+            return options.output.substr(0, dot_pos) + ".jpg";
+        }
+        return options.output + ".jpg";
+    }
+    return generated_filename(final_url, options, ".jpg");
+}
+
+CacheOptions pin_cache_options(const PinOptions& options, bool allow_hls) {
+    CacheOptions cache = options.cache;
+    if (options.quality.kind != QualityPolicy::DEFAULT) {
+        cache.variant = "#" + quality_name(options.quality) + (allow_hls ? "+hls" : "");
+    }
+    return cache;
+}
+
+std::string select_video_url(const std::vector<VideoVariant>& variants, const std::string& default_url,
+                             const PinOptions& options, bool allow_hls) {
+    if (options.quality.kind == QualityPolicy::DEFAULT) return default_url;
+    int chosen = select_variant(variants, options.quality, allow_hls);
+    if (chosen < 0) return default_url;
+    const VideoVariant& v = variants[chosen];
+    log_debug("[pinterest] Quality " + quality_name(options.quality) + ": " + v.name + " (" +
+              std::to_string(v.width) + "x" + std::to_string(v.height) + ") of " + std::to_string(variants.size()) +
+              " variants.");
+    return v.url;
+}
+
+void prefetch_media_hosts(bool thumbnail, bool connect) {
+    prefetch_host("https://v1.pinimg.com/", connect);
+    if (thumbnail) prefetch_host("https://i.pinimg.com/", connect);
+}
+
+// Follows the redirects to the pin page and scans it for the media URLs, and for the video
+// list when a quality is chosen. False if the page could not be fetched.
+static bool resolve_pin(const std::string& url, const PinOptions& options, PinCacheEntry& pin) {
+    // The page is scanned while it downloads and the transfer stops once the media URLs
+    // are known. A page that is about to be refetched under its sanitized URL is dropped
+    // at its first byte.
+    std::string& final_url = pin.final_url;
+    bool want_variants = options.quality.kind != QualityPolicy::DEFAULT;
+    PageScanner scanner(options.thumbnail, want_variants);
+    auto scan = [&](const char* data, size_t len) {
+        if (sanitize_pinterest_url(final_url) != final_url) return false;
+        scanner.feed(data, len);
+        return !scanner.complete();
+    };
+    bool fetched = fetch_url_streaming(url, final_url, scan);
+
+    std::string clean_url = sanitize_pinterest_url(final_url);
+    if (clean_url != final_url) {
+        log_debug("[pinterest] URL contains extra parameters. Sanitizing to: " + clean_url);
+        final_url = clean_url;
+        std::string temp_redirected_url;
+        scanner = PageScanner(options.thumbnail, want_variants);
+        fetched = fetch_url_streaming(final_url, temp_redirected_url, [&](const char* data, size_t len) {
+            scanner.feed(data, len);
+            return !scanner.complete();
+        });
+    }
+
+    if (!fetched || scanner.size() == 0) return false;
+
+    log_debug("[pinterest] Final URL: " + final_url);
+    log_debug("[parser] Scanned " + std::to_string(scanner.size()) + " bytes of HTML" +
+              (scanner.complete() ? ", stopped early once the media URLs were found." : "."));
+
+    MediaFields fields = scanner.fields();
+    pin.thumbnail_url = std::string(fields.thumbnail_url);
+    std::vector<VideoVariant> variants;
+    if (want_variants) variants = scanner.variants();
+    pin.video_url = select_video_url(variants, std::string(fields.video_url), options, !options.video_sink);
+    if (is_hls_url(pin.video_url)) pin.fallback_url = select_video_url(variants, "", options, false);
+    return true;
+}
+
+// `thumbnail_done`: a stale-cache retry whose first attempt already saved the thumbnail.
+static PinResult process_pin_attempt(const std::string& url, const PinOptions& options, bool thumbnail_done) {
+    PinResult result;
+    result.url = url;
+    auto start_time = Clock::now();
+    // A retry from the stale-cache path below adds to the trace of the first attempt.
+    std::shared_ptr<Trace> trace = current_trace_shared();
+    if (g_trace_enabled && !trace) trace = std::make_shared<Trace>(url);
+    TraceScope scope(trace);
+    Span span("pin");
+
+    log_normal("[pinterest] " + url + ": Resolving URL");
+    prefetch_media_hosts(options.thumbnail);
+
+    CacheOptions cache = pin_cache_options(options, !options.video_sink);
+    PinCacheEntry pin;
+    bool from_cache = pin_cache_lookup(url, cache, pin) && (!options.thumbnail || !pin.thumbnail_url.empty());
+    if (from_cache) {
+        log_debug("[cache] Hit: " + url + " -> " + pin.final_url);
+    } else {
+        pin = PinCacheEntry();
+        if (!resolve_pin(url, options, pin)) {
+            result.error = "Failed to fetch HTML content from the final URL.";
+            log_error(result.error);
+            result.resolve_s = result.total_s = seconds_since(start_time);
+            span.end();
+            if (trace) result.phases = trace->summary_json();
+            return result;
+        }
+        if (!pin.video_url.empty()) pin_cache_store(url, pin, cache);
+    }
+
+    const std::string& final_url = pin.final_url;
+    const std::string& thumbnail_url = pin.thumbnail_url;
+    const std::string& media_url = pin.video_url;
+    result.resolve_s = seconds_since(start_time);
+
+    auto download_start = Clock::now();
+    std::thread thumbnail_thread;
+    long long thumbnail_bytes = 0;
+    if (options.thumbnail && !thumbnail_done) {
+        if (thumbnail_url.empty()) {
+            result.thumbnail_error = "Could not find thumbnail URL on the page.";
+            log_error(result.thumbnail_error);
+        } else {
+            log_normal("[downloader] Thumbnail URL: " + thumbnail_url);
+            thumbnail_thread = std::thread([&, download_start] {
+                TraceScope thread_scope(trace);
+                DownloadStats stats;
+                if (options.thumbnail_sink) {
+                    bool ok = download_to_sink(thumbnail_url, options.thumbnail_sink, &stats);
+                    thumbnail_bytes = stats.bytes;
+                    if (!ok) result.thumbnail_error = "Failed to download the thumbnail.";
+                } else {
+                    std::string thumb_filename = pin_thumbnail_filename(final_url, options);
+                    if (download_file(thumbnail_url, thumb_filename, DownloadOptions(), &stats)) {
+                        log_normal("[pinoader] Thumbnail saved: " + thumb_filename);
+                        result.thumbnail_path = thumb_filename;
+                        thumbnail_bytes = stats.bytes;
+                    } else {
+                        result.thumbnail_error = "Failed to download the thumbnail.";
+                    }
+                }
+                if (!result.thumbnail_error.empty()) log_error(result.thumbnail_error);
+                result.thumbnail_s = seconds_since(download_start);
+            });
+        }
+    }
+
+    bool video_ok = false;
+    DownloadStats stats;
+    std::string video_filename = pin_video_filename(final_url, options);
+    if (media_url.empty()) {
+        result.error = "Could not find media URL on the page.";
+        log_error(result.error);
+    } else {
+        log_normal("[downloader] Media URL: " + media_url);
+        if (options.video_sink) {
+            video_ok = download_to_sink(media_url, options.video_sink, &stats);
+        } else if (is_hls_url(media_url)) {
+            video_ok = download_hls(media_url, video_filename, options.download, options.quality, &stats);
+            if (!video_ok && !pin.fallback_url.empty()) {
+                log_normal("[downloader] HLS download failed. Falling back to " + pin.fallback_url);
+                stats = DownloadStats();
+                video_ok = download_file(pin.fallback_url, video_filename, options.download, &stats);
+            }
+        } else {
+            video_ok = download_file(media_url, video_filename, options.download, &stats);
+        }
+        result.video_s = seconds_since(download_start);
+    }
+    if (thumbnail_thread.joinable()) thumbnail_thread.join();
+    result.bytes += thumbnail_bytes;
+
+    if (video_ok) {
+        result.ok = true;
+        result.bytes += stats.bytes;
+        if (!options.video_sink) {
+            log_normal("[pinoader] File saved: " + video_filename);
+            result.video_path = video_filename;
+        }
+    } else if (from_cache && !media_url.empty() && ((stats.bytes == 0 && thumbnail_bytes == 0) ||
+                                                    (!options.video_sink && !options.thumbnail_sink))) {
+        // The cached media URL may have gone stale. Retrying is only possible as long as
+        // no bytes reached a sink.
+        log_normal("[cache] Download from the cached media URL failed. Resolving the pin again.");
+        PinOptions fresh = options;
+        fresh.cache.read = false;
+        // A thumbnail that was saved is kept instead of being downloaded again.
+        bool thumbnail_saved = options.thumbnail && !thumbnail_url.empty() && result.thumbnail_error.empty();
+        PinResult retry = process_pin_attempt(url, fresh, thumbnail_saved);
+        if (thumbnail_saved) {
+            retry.thumbnail_path = result.thumbnail_path;
+            retry.thumbnail_s = result.thumbnail_s;
+            retry.bytes += thumbnail_bytes;
+        }
+        return retry;
+    } else if (!media_url.empty()) {
+        result.error = "Failed to download the file.";
+        log_error(result.error);
+    }
+
+    result.download_s = seconds_since(download_start);
+    result.total_s = seconds_since(start_time);
+    char stages[160];
+    snprintf(stages, sizeof(stages), "resolve %.3fs, thumbnail %.3fs, video %.3fs, download %.3fs, total %.3fs",
+             result.resolve_s, result.thumbnail_s, result.video_s, result.download_s, result.total_s);
+    log_debug(std::string("[pinterest] Stages: ") + stages);
+    span.end();
+    if (trace) result.phases = trace->summary_json();
+    return result;
+}
+
+PinResult process_pin(const std::string& url, const PinOptions& options) {
+    return process_pin_attempt(url, options, false);
+}
@@ -0,0 +1,66 @@
+#ifndef PINTEREST_H
+#define PINTEREST_H
+
+#include <string>
+#include <vector>
+#include "http_client.h"
+#include "pin_cache.h"
+#include "quality.h"
+
+struct PinOptions {
+    std::string output;      // Custom video filename; generated from the pin ID when empty
+    std::string directory;   // Where generated filenames go; the current directory when empty
+    bool thumbnail = false;  // Also download the cover image next to the video
+    DownloadOptions download;
+    QualityPolicy quality;   // Which entry of the pin's video list to download
+    CacheOptions cache;
+    // When set, the media is streamed here instead of written to a file (segments and
+    // resuming across runs then do not apply).
+    BodyCallback video_sink;
+    BodyCallback thumbnail_sink;
+};
+
+struct PinResult {
+    std::string url;
+    bool ok = false;
+    std::string error;
+    std::string thumbnail_error;  // A failed thumbnail does not fail the pin
+    std::string video_path;
+    std::string thumbnail_path;
+    long long bytes = 0;      // Total media bytes written (video + thumbnail)
+    double resolve_s = 0;     // Redirects, page fetch and parsing
+    double download_s = 0;    // Media downloads; thumbnail and video run in parallel
+    double thumbnail_s = 0;
+    double video_s = 0;
+    double total_s = 0;
+    std::string phases;       // Per-phase times as a JSON object, when tracing is enabled
+};
+
+std::string extract_pin_id(const std::string& url);
+
+std::string sanitize_pinterest_url(const std::string& dirty_url);
+
+// Output file names: PinOptions::output if set, otherwise derived from the pin ID in `final_url`
+// and placed in PinOptions::directory.
+std::string pin_video_filename(const std::string& final_url, const PinOptions& options);
+std::string pin_thumbnail_filename(const std::string& final_url, const PinOptions& options);
+
+// options.cache, with the entries of a non-default options.quality kept apart, and those
+// that may hold an HLS playlist (`allow_hls`) apart from those that may not.
+CacheOptions pin_cache_options(const PinOptions& options, bool allow_hls);
+
+// The variant options.quality picks from `variants`, or `default_url` (the page's 720p URL)
+// for the default policy and pages without a video list. HLS only with `allow_hls`.
+std::string select_video_url(const std::vector<VideoVariant>& variants, const std::string& default_url,
+                             const PinOptions& options, bool allow_hls);
+
+// Starts resolving, and with `connect` connecting to, the CDN hosts pin media is served
+// from, so that work overlaps the page download.
+void prefetch_media_hosts(bool thumbnail, bool connect = true);
+
+// Resolves a pin URL, parses the page and downloads its media. The thumbnail, if requested,
+// downloads on its own thread alongside the video.
+// Safe to call concurrently from several threads.
+PinResult process_pin(const std::string& url, const PinOptions& options);
+
+#endif
@@ -0,0 +1,92 @@
+#include "quality.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+
+bool parse_quality(const std::string& text, QualityPolicy& policy) {
+    std::string s = text;
+    std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return std::tolower(c); });
+    policy = QualityPolicy();
+    if (s == "default") return true;
+    if (s == "best") { policy.kind = QualityPolicy::BEST; return true; }
+    if (s == "smallest") { policy.kind = QualityPolicy::SMALLEST; return true; }
+
+    char* end = nullptr;
+    long long n = std::strtoll(s.c_str(), &end, 10);
+    if (end == s.c_str() || n <= 0) return false;
+    std::string unit = end;
+    if (unit == "p") {
+        policy.kind = QualityPolicy::MAX_PIXELS;
+        policy.limit = n;
+        return true;
+    }
+    long long scale = 0;
+    if (unit == "" || unit == "b") scale = 1;
+    else if (unit == "k" || unit == "kb") scale = 1LL << 10;
+    else if (unit == "m" || unit == "mb") scale = 1LL << 20;
+    else if (unit == "g" || unit == "gb") scale = 1LL << 30;
+    if (scale == 0) return false;
+    policy.kind = QualityPolicy::MAX_BYTES;
+    policy.limit = n * scale;
+    return true;
+}
+
+std::string quality_name(const QualityPolicy& policy) {
+    switch (policy.kind) {
+        case QualityPolicy::BEST: return "best";
+        case QualityPolicy::SMALLEST: return "smallest";
+        case QualityPolicy::MAX_PIXELS: return std::to_string(policy.limit) + "p";
+        case QualityPolicy::MAX_BYTES: return std::to_string(policy.limit);
+        default: return "default";
+    }
+}
+
+long long estimated_size(const VideoVariant& variant) {
+    if (variant.size >= 0) return variant.size;
+    if (variant.bitrate > 0 && variant.duration_ms > 0) return variant.bitrate / 8 * variant.duration_ms / 1000;
+    return -1;
+}
+
+static long long pixels(const VideoVariant& v) {
+    if (v.width > 0 && v.height > 0) return (long long)v.width * v.height;
+    // Only the number in a name such as "V_720P" is known. It is the short side, like the
+    // "720p" of a landscape video; assume 9:16.
+    return (long long)v.height * v.height * 16 / 9;
+}
+
+static int short_side(const VideoVariant& v) {
+    if (v.width > 0 && v.height > 0) return std::min(v.width, v.height);
+    return v.height;
+}
+
+int select_variant(const std::vector<VideoVariant>& variants, const QualityPolicy& policy, bool allow_hls) {
+    // Ranked by pixels, then bitrate; an MP4 wins a tie with HLS.
+    auto better = [](const VideoVariant& a, const VideoVariant& b) {
+        if (pixels(a) != pixels(b)) return pixels(a) > pixels(b);
+        if (a.bitrate != b.bitrate) return a.bitrate > b.bitrate;
+        return !a.hls && b.hls;
+    };
+    auto smaller = [](const VideoVariant& a, const VideoVariant& b) {
+        if (pixels(a) != pixels(b)) return pixels(a) < pixels(b);
+        if (a.bitrate != b.bitrate) return a.bitrate < b.bitrate;
+        return !a.hls && b.hls;
+    };
+    auto fits = [&](const VideoVariant& v) {
+        if (policy.kind == QualityPolicy::MAX_PIXELS) return short_side(v) <= policy.limit;
+        if (policy.kind == QualityPolicy::MAX_BYTES) {
+            long long size = estimated_size(v);
+            return size >= 0 && size <= policy.limit;
+        }
+        return true;
+    };
+
+    int best = -1, smallest = -1;
+    for (int i = 0; i < (int)variants.size(); ++i) {
+        const VideoVariant& v = variants[i];
+        if (v.hls && !allow_hls) continue;
+        if (smallest < 0 || smaller(v, variants[smallest])) smallest = i;
+        if (fits(v) && (best < 0 || better(v, variants[best]))) best = i;
+    }
+    if (policy.kind == QualityPolicy::SMALLEST) return smallest;
+    return best >= 0 ? best : smallest;
+}
@@ -0,0 +1,36 @@
+#ifndef QUALITY_H
+#define QUALITY_H
+
+#include <string>
+#include <vector>
+#include "parser.h"
+
+// Which video variant to download when a pin offers several (--quality).
+struct QualityPolicy {
+    enum Kind {
+        DEFAULT,     // The 720p URL the page names first, as without --quality
+        BEST,        // Most pixels
+        SMALLEST,    // Fewest pixels
+        MAX_PIXELS,  // Best variant whose shorter side is at most `limit` ("480p")
+        MAX_BYTES    // Best variant estimated at most `limit` bytes ("8MB")
+    };
+    Kind kind = DEFAULT;
+    long long limit = 0;
+};
+
+// "best", "smallest", "default", "<n>p", or "<n>", "<n>KB", "<n>MB", "<n>GB" for a byte
+// budget. False if `text` is none of these.
+bool parse_quality(const std::string& text, QualityPolicy& policy);
+
+// The policy in the form parse_quality() accepts.
+std::string quality_name(const QualityPolicy& policy);
+
+// Estimated size in bytes: the known size, else bitrate times duration. -1 if unknown.
+long long estimated_size(const VideoVariant& variant);
+
+// Index of the variant `policy` picks, or -1 if there is none. HLS variants are only
+// considered with `allow_hls`. On equal pixels an MP4 wins over HLS. When nothing fits a
+// MAX_PIXELS or MAX_BYTES limit, the smallest variant is picked.
+int select_variant(const std::vector<VideoVariant>& variants, const QualityPolicy& policy, bool allow_hls);
+
+#endif
@@ -0,0 +1,366 @@
+#include "server.h"
+#include "batch.h"
+#include "cache_dir.h"
+#include "http_client.h"
+#include "json.h"
+#include "logger.h"
+#include "pinoader.h"
+#include "trace.h"
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using Clock = std::chrono::steady_clock;
+
+// Minimum time between two progress events of one job.
+static const auto PROGRESS_EVERY = std::chrono::milliseconds(250);
+
+// How often idle and server-closed connections are swept from the pools.
+static const auto HOUSEKEEPING_EVERY = std::chrono::seconds(5);
+
+static volatile sig_atomic_t g_stop = 0;
+
+static void on_stop_signal(int) {
+    g_stop = 1;
+}
+
+std::string default_socket_path() {
+    if (const char* env = getenv("PINOADER_SOCKET")) return env;
+    if (const char* run = getenv("XDG_RUNTIME_DIR")) return std::string(run) + "/pinoader.sock";
+    std::string dir = cache_dir();
+    return dir.empty() ? "pinoader.sock" : dir + "/pinoader.sock";
+}
+
+static bool make_address(const std::string& path, sockaddr_un& addr) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+        log_error("Invalid socket path: " + path);
+        return false;
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+static int connect_socket(const std::string& path) {
+    sockaddr_un addr;
+    if (!make_address(path, addr)) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool send_all(int fd, const std::string& data) {
+    for (size_t off = 0; off < data.size();) {
+        ssize_t n = send(fd, data.data() + off, data.size() - off, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        off += n;
+    }
+    return true;
+}
+
+// Splits what arrives on `fd` into lines. False at EOF or on error.
+class LineReader {
+public:
+    explicit LineReader(int fd) : fd_(fd) {}
+
+    bool next(std::string& line) {
+        while (true) {
+            size_t nl = buffer_.find('\n', pos_);
+            if (nl != std::string::npos) {
+                line.assign(buffer_, pos_, nl - pos_);
+                pos_ = nl + 1;
+                return true;
+            }
+            buffer_.erase(0, pos_);
+            pos_ = 0;
+            char chunk[16384];
+            ssize_t n = recv(fd_, chunk, sizeof(chunk), 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                // A last line without a newline still counts.
+                if (buffer_.empty()) return false;
+                line.swap(buffer_);
+                buffer_.clear();
+                return true;
+            }
+            buffer_.append(chunk, n);
+        }
+    }
+
+private:
+    int fd_;
+    std::string buffer_;
+    size_t pos_ = 0;
+};
+
+// One client connection. Events of its jobs are written from the worker threads; the socket
+// is closed when the reader and the last job are done with it.
+struct ClientConnection {
+    int fd;
+    std::mutex mtx;
+    bool gone = false;  // The client disconnected; events are dropped
+
+    explicit ClientConnection(int fd) : fd(fd) {}
+    ~ClientConnection() { close(fd); }
+
+    void send_event(const std::string& line) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!gone && !send_all(fd, line + "\n")) gone = true;
+    }
+};
+
+struct Server {
+    ServeOptions options;
+    std::mutex mtx;
+    bool stopping = false;
+    std::unique_ptr<PinClient> pins;
+    std::atomic<long long> jobs{0};
+};
+
+static std::string event_prefix(const std::string& id, const char* event) {
+    return "{\"id\":\"" + json_escape(id) + "\",\"event\":\"" + event + "\"";
+}
+
+// Reports the progress of the video download, at most every PROGRESS_EVERY.
+static std::function<void(long long, long long)> progress_events(std::shared_ptr<ClientConnection> conn, const std::string& id) {
+    auto last = std::make_shared<std::atomic<long long>>(0);
+    return [conn, id, last](long long done, long long total) {
+        long long now = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now().time_since_epoch()).count();
+        long long prev = last->load();
+        if (now - prev < PROGRESS_EVERY.count() || !last->compare_exchange_strong(prev, now)) return;
+        conn->send_event(event_prefix(id, "progress") + ",\"bytes\":" + std::to_string(done) +
+                         ",\"total\":" + std::to_string(total) + "}");
+    };
+}
+
+static void serve_connection(std::shared_ptr<Server> server, std::shared_ptr<ClientConnection> conn) {
+    LineReader reader(conn->fd);
+    std::string line, error;
+    long long next_id = 0;
+    while (reader.next(line)) {
+        BatchJob job;
+        if (!parse_job_line(line, server->options.defaults, job, error)) {
+            if (!error.empty()) conn->send_event("{\"event\":\"error\",\"error\":\"" + json_escape(error) + "\"}");
+            continue;
+        }
+        if (job.id.empty()) job.id = std::to_string(++next_id);
+        job.options.download.progress = progress_events(conn, job.id);
+        conn->send_event(event_prefix(job.id, "queued") + ",\"url\":\"" + json_escape(job.url) + "\"}");
+
+        std::string id = job.id;
+        std::lock_guard<std::mutex> lock(server->mtx);
+        if (server->stopping) {
+            PinResult result;
+            result.url = job.url;
+            result.error = "The daemon is shutting down.";
+            conn->send_event(event_prefix(id, "result") + "," + result_json(result).substr(1));
+            continue;
+        }
+        ++server->jobs;
+        server->pins->submit(job.url, job.options, [conn, id](const PinResult& result) {
+            conn->send_event(event_prefix(id, "result") + "," + result_json(result).substr(1));
+            if (!flush_trace_file()) log_error("Could not write the trace file.");
+        });
+    }
+}
+
+int run_server(const ServeOptions& options) {
+    sockaddr_un addr;
+    if (!make_address(options.socket_path, addr)) return 1;
+
+    // A socket file nobody answers on is left over from a daemon that did not exit cleanly.
+    int existing = connect_socket(options.socket_path);
+    if (existing >= 0) {
+        close(existing);
+        log_error("A daemon is already listening on " + options.socket_path + ".");
+        return 1;
+    }
+    unlink(options.socket_path.c_str());
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) return 1;
+    mode_t old_mask = umask(0077);  // Only this user may submit jobs
+    bool bound = bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) == 0;
+    umask(old_mask);
+    if (!bound || listen(listen_fd, 64) != 0) {
+        log_error("Cannot listen on " + options.socket_path + ": " + strerror(errno));
+        close(listen_fd);
+        return 1;
+    }
+
+    struct sigaction sa = {};
+    sa.sa_handler = on_stop_signal;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    auto server = std::make_shared<Server>();
+    server->options = options;
+    PinClientOptions client_options;
+    client_options.workers = options.workers;
+    client_options.quiet = g_log_level == LogLevel::SILENT;
+    client_options.debug = g_log_level >= LogLevel::DEBUG;
+    client_options.timings = g_trace_enabled;
+    server->pins = std::make_unique<PinClient>(client_options);
+
+    // The media CDN is the same for every pin; have its address and connections ready.
+    prefetch_media_hosts(options.defaults.thumbnail, true);
+    log_normal("[daemon] Listening on " + options.socket_path + " with " + std::to_string(options.workers) +
+               " workers.");
+
+    auto next_housekeeping = Clock::now() + HOUSEKEEPING_EVERY;
+    while (!g_stop) {
+        pollfd p = {listen_fd, POLLIN, 0};
+        int r = poll(&p, 1, 1000);
+        if (r > 0) {
+            int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd >= 0) {
+                log_debug("[daemon] Client connected.");
+                std::thread(serve_connection, server, std::make_shared<ClientConnection>(fd)).detach();
+            }
+        }
+        if (Clock::now() >= next_housekeeping) {
+            if (evict_idle_connections() > 0) {
+                PoolStats st = connection_pool_stats();
+                log_debug("[daemon] Connection pool: " + std::to_string(st.idle) + " idle, " + std::to_string(st.hits) +
+                          " hits, " + std::to_string(st.misses) + " misses, " + std::to_string(st.evictions) +
+                          " evictions.");
+            }
+            next_housekeeping = Clock::now() + HOUSEKEEPING_EVERY;
+        }
+    }
+
+    log_normal("[daemon] Stopping. Finishing the queued jobs.");
+    close(listen_fd);
+    unlink(options.socket_path.c_str());
+    std::unique_ptr<PinClient> pins;
+    {
+        std::lock_guard<std::mutex> lock(server->mtx);
+        server->stopping = true;
+        pins = std::move(server->pins);
+    }
+    pins.reset();
+    log_debug("[daemon] Served " + std::to_string(server->jobs.load()) + " jobs.");
+    if (!write_trace_file()) log_error("Could not write the trace file.");
+    return 0;
+}
+
+static std::string absolute_path(const std::string& path, const std::string& cwd) {
+    if (path.empty() || path[0] == '/') return path;
+    return cwd + "/" + path;
+}
+
+static std::string job_line(const BatchJob& job, const std::string& id, const std::string& cwd) {
+    std::string line = "{\"id\":\"" + json_escape(id) + "\",\"url\":\"" + json_escape(job.url) + "\"";
+    if (!job.options.output.empty()) line += ",\"output\":\"" + json_escape(absolute_path(job.options.output, cwd)) + "\"";
+    std::string dir = job.options.directory.empty() ? cwd : absolute_path(job.options.directory, cwd);
+    line += ",\"dir\":\"" + json_escape(dir) + "\"";
+    line += std::string(",\"thumbnail\":") + (job.options.thumbnail ? "true" : "false");
+    line += ",\"segments\":" + std::to_string(job.options.download.segments);
+    line += ",\"quality\":\"" + quality_name(job.options.quality) + "\"";
+    return line + "}\n";
+}
+
+int submit_to_server(const std::string& socket_path, const std::vector<std::string>& urls, std::istream* input,
+                     const PinOptions& defaults) {
+    int fd = connect_socket(socket_path);
+    if (fd < 0) return -1;
+    signal(SIGPIPE, SIG_IGN);
+    log_debug("[daemon] Submitting to " + socket_path + ".");
+
+    char buf[4096];
+    std::string cwd = getcwd(buf, sizeof(buf)) ? buf : ".";
+
+    // Jobs are written from their own thread while results come back, so a long list streams
+    // through without either side blocking the other.
+    std::mutex mtx;
+    std::map<std::string, std::string> pending;  // id -> URL
+    std::atomic<long long> sent{0};
+    std::thread writer([&]() {
+        auto submit = [&](const BatchJob& job) {
+            std::string id = std::to_string(sent + 1);
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                pending[id] = job.url;
+            }
+            if (!send_all(fd, job_line(job, id, cwd))) return false;
+            ++sent;
+            return true;
+        };
+        BatchJob job;
+        bool ok = true;
+        for (size_t i = 0; ok && i < urls.size(); ++i) {
+            job.url = urls[i];
+            job.options = defaults;
+            ok = submit(job);
+        }
+        std::string line, error;
+        while (ok && input && std::getline(*input, line)) {
+            if (parse_job_line(line, defaults, job, error)) ok = submit(job);
+            else if (!error.empty()) log_error("Skipping input line: " + error);
+        }
+        shutdown(fd, SHUT_WR);
+    });
+
+    int failed = 0;
+    LineReader reader(fd);
+    std::string line;
+    while (reader.next(line)) {
+        std::map<std::string, std::string> fields;
+        if (!json_parse_object(line, fields)) continue;
+        const std::string& event = fields["event"];
+        // Errors about input lines the daemon could not parse belong to no job.
+        auto id = fields.find("id");
+        if (id == fields.end()) {
+            if (event == "error") log_error("[daemon] " + fields["error"]);
+            continue;
+        }
+        std::string url;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            auto it = pending.find(id->second);
+            if (it == pending.end()) {
+                log_debug("[daemon] Event for unknown job " + id->second + ": " + line);
+                continue;
+            }
+            url = it->second;
+            if (event == "result") pending.erase(it);
+        }
+        if (event == "result") {
+            if (fields["status"] != "ok") ++failed;
+            log_output(line + "\n");
+        } else if (event == "progress") {
+            log_normal("[daemon] " + url + ": " + fields["bytes"] + " of " + fields["total"] + " bytes");
+        } else if (event == "queued") {
+            log_debug("[daemon] Queued " + url + " as job " + id->second + ".");
+        }
+    }
+    writer.join();
+    close(fd);
+
+    std::lock_guard<std::mutex> lock(mtx);
+    if (!pending.empty()) {
+        log_error("The daemon closed the connection with " + std::to_string(pending.size()) + " jobs unfinished.");
+        failed += (int)pending.size();
+    }
+    return failed;
+}
@@ -0,0 +1,44 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <istream>
+#include <string>
+#include <vector>
+#include "pinterest.h"
+
+// Daemon mode (--serve): one long-running process keeps the connection pool, TLS sessions,
+// DNS answers and the pin cache warm, and downloads the pins that clients send it over a
+// Unix socket.
+//
+// Protocol: newline-delimited JSON in both directions. A client writes job lines in the
+// batch input format (see batch.h), optionally with an "id", and may then shut down its
+// writing side. For every job the daemon answers with
+//   {"id":"...","event":"queued","url":"..."}
+//   {"id":"...","event":"progress","bytes":1048576,"total":3145851}   (zero or more)
+//   {"id":"...","event":"result", <the batch result fields>}
+// Jobs without an "id" are numbered per connection ("1", "2", ...). A line that is not a
+// job gets {"event":"error","error":"..."}. The daemon closes the connection once every
+// job has its result and the client has stopped writing.
+// Relative "output" and "dir" paths are relative to the daemon's working directory.
+
+struct ServeOptions {
+    std::string socket_path;
+    int workers = 4;      // Pins downloaded at the same time
+    PinOptions defaults;  // For the fields a job line does not set
+};
+
+// $PINOADER_SOCKET, else $XDG_RUNTIME_DIR/pinoader.sock, else pinoader.sock in the cache directory.
+std::string default_socket_path();
+
+// Serves until SIGINT or SIGTERM, then finishes the queued jobs. Idle connections are closed
+// as set_connection_pool_limits() says. Returns the exit code.
+int run_server(const ServeOptions& options);
+
+// Sends the jobs (`urls`, then the lines of `input`, which may be null) to the daemon at
+// `socket_path` and writes its result lines to stdout as they arrive. Output paths are made
+// absolute and generated file names go to the current directory, as without the daemon.
+// Returns the number of failed pins, or -1 if no daemon is listening.
+int submit_to_server(const std::string& socket_path, const std::vector<std::string>& urls, std::istream* input,
+                     const PinOptions& defaults);
+
+#endif
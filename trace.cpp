@@ -0,0 +1,114 @@
+#include "trace.h"
+#include "json.h"
+#include "logger.h"
+#include <cstdio>
+#include <fstream>
+#include <vector>
+
+std::atomic<bool> g_trace_enabled{false};
+
+static thread_local std::shared_ptr<Trace> t_trace;
+
+// Chrome trace events, recorded only when a trace file was requested.
+static std::string g_trace_path;
+static std::mutex g_events_mtx;
+static std::vector<std::string> g_events;
+static bool g_trace_started = false;   // The file holds the header and g_trace_written events
+static long long g_trace_written = 0;
+static const TraceClock::time_point g_epoch = TraceClock::now();
+
+static double ms_between(TraceClock::time_point start, TraceClock::time_point end) {
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+void Trace::add_span(const char* name, TraceClock::time_point start, TraceClock::time_point end,
+                     const std::string& args) {
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        ms_[name] += ms_between(start, end);
+    }
+    if (g_trace_path.empty()) return;
+
+    char timing[96];
+    snprintf(timing, sizeof(timing), "\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d", ms_between(g_epoch, start) * 1000,
+             ms_between(start, end) * 1000, thread_number());
+    std::string event = std::string("{\"name\":\"") + name + "\",\"cat\":\"pinoader\",\"ph\":\"X\"," + timing +
+                        ",\"args\":{\"pin\":\"" + json_escape(url_) + "\"" + (args.empty() ? "" : ",") + args + "}}";
+    std::lock_guard<std::mutex> lock(g_events_mtx);
+    g_events.push_back(std::move(event));
+}
+
+void Trace::add_time(const char* name, double seconds) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    ms_[name] += seconds * 1000;
+}
+
+void Trace::count(const char* name, long long n) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    counts_[name] += n;
+}
+
+std::string Trace::summary_json() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    std::string json = "{";
+    char buf[64];
+    for (const auto& kv : ms_) {
+        snprintf(buf, sizeof(buf), "%.3f", kv.second);
+        json += (json.size() > 1 ? ",\"" : "\"") + kv.first + "_ms\":" + buf;
+    }
+    for (const auto& kv : counts_) {
+        json += (json.size() > 1 ? ",\"" : "\"") + kv.first + "\":" + std::to_string(kv.second);
+    }
+    return json + "}";
+}
+
+Trace* current_trace() {
+    return t_trace.get();
+}
+
+std::shared_ptr<Trace> current_trace_shared() {
+    return t_trace;
+}
+
+TraceScope::TraceScope(std::shared_ptr<Trace> trace) : previous_(std::move(t_trace)) {
+    t_trace = std::move(trace);
+}
+
+TraceScope::~TraceScope() {
+    t_trace = std::move(previous_);
+}
+
+void Span::arg(const char* key, const std::string& value) {
+    if (trace_) add_arg(key, "\"" + json_escape(value) + "\"");
+}
+
+void Span::add_arg(const char* key, const std::string& json_value) {
+    if (!args_.empty()) args_ += ",";
+    args_ += std::string("\"") + key + "\":" + json_value;
+}
+
+void set_trace_file(const std::string& path) {
+    g_trace_path = path;
+    g_trace_enabled = true;
+}
+
+// Moves g_events to the end of the trace file; `finish` closes the event list.
+static bool append_events(bool finish) {
+    if (g_trace_path.empty()) return true;
+    std::lock_guard<std::mutex> lock(g_events_mtx);
+    std::ofstream out(g_trace_path, g_trace_started ? std::ios::app : std::ios::trunc);
+    if (!g_trace_started) out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    g_trace_started = true;
+    for (const auto& event : g_events) out << (g_trace_written++ ? ",\n" : "\n") << event;
+    g_events.clear();
+    if (finish) out << "\n]}\n";
+    return (bool)out;
+}
+
+bool flush_trace_file() {
+    return append_events(false);
+}
+
+bool write_trace_file() {
+    return append_events(true);
+}
@@ -0,0 +1,115 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// Per-phase timing (DNS, TCP, TLS, time to first byte, transfer, parsing, disk writes).
+// process_pin() puts a Trace in scope for each URL and every Span opened on that thread, or
+// on a thread the trace is handed to with TraceScope, is added to it. When tracing is
+// disabled a Span costs one branch on g_trace_enabled.
+
+// Set at startup or when a PinClient asks for timings; atomic like g_log_level.
+extern std::atomic<bool> g_trace_enabled;
+
+using TraceClock = std::chrono::steady_clock;
+
+// The spans of one URL, summed per phase.
+class Trace {
+public:
+    explicit Trace(const std::string& url) : url_(url) {}
+
+    void add_span(const char* name, TraceClock::time_point start, TraceClock::time_point end,
+                  const std::string& args);
+    void add_time(const char* name, double seconds);
+    void count(const char* name, long long n);
+
+    // {"dns_ms":1.234,...,"tls_resumed":1}: milliseconds per span name, then the counters.
+    std::string summary_json();
+
+private:
+    std::string url_;
+    std::mutex mtx_;
+    std::map<std::string, double> ms_;
+    std::map<std::string, long long> counts_;
+};
+
+// The trace of the URL the current thread works on, or null.
+Trace* current_trace();
+std::shared_ptr<Trace> current_trace_shared();
+
+// Makes `trace` the current trace of this thread until the scope ends.
+class TraceScope {
+public:
+    explicit TraceScope(std::shared_ptr<Trace> trace);
+    ~TraceScope();
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    std::shared_ptr<Trace> previous_;
+};
+
+// Times the enclosing block as phase `name` of the current trace.
+class Span {
+public:
+    explicit Span(const char* name) : name_(name), trace_(g_trace_enabled ? current_trace() : nullptr) {
+        if (trace_) start_ = TraceClock::now();
+    }
+    ~Span() { end(); }
+    Span(const Span&) = delete;
+    Span& operator=(const Span&) = delete;
+
+    explicit operator bool() const { return trace_ != nullptr; }
+
+    // Renames the span, e.g. a page request that turned out to be a redirect.
+    void rename(const char* name) { name_ = name; }
+
+    // Attributes shown in the Chrome trace.
+    void arg(const char* key, long long value) {
+        if (trace_) add_arg(key, std::to_string(value));
+    }
+    void arg(const char* key, const std::string& value);
+
+    // Ends the span before the end of the block. Later calls do nothing.
+    void end() {
+        if (trace_) trace_->add_span(name_, start_, TraceClock::now(), args_);
+        trace_ = nullptr;
+    }
+
+private:
+    void add_arg(const char* key, const std::string& json_value);
+
+    const char* name_;
+    Trace* trace_;
+    TraceClock::time_point start_;
+    std::string args_;  // "key":value pairs, comma separated
+};
+
+// Adds to a counter or to the time of a phase of the current trace, for work that is too
+// fine-grained for a span of its own (each write() of a download).
+inline void trace_count(const char* name, long long n = 1) {
+    if (!g_trace_enabled) return;
+    if (Trace* t = current_trace()) t->count(name, n);
+}
+
+inline void trace_time(const char* name, double seconds) {
+    if (!g_trace_enabled) return;
+    if (Trace* t = current_trace()) t->add_time(name, seconds);
+}
+
+// Also records every span as a Chrome trace event (chrome://tracing, Perfetto).
+void set_trace_file(const std::string& path);
+
+// Appends the events recorded so far to the trace file and forgets them, so a daemon does not
+// keep every event in memory. False if the file could not be written.
+bool flush_trace_file();
+
+// Writes the remaining events and completes the trace file. False if it could not be written.
+bool write_trace_file();
+
+#endif